@@ -0,0 +1,64 @@
+# Measures insert and lookup throughput and memory use of the StackTable trie.
+#
+# Run it against two builds to compare trie layouts:
+#
+#   ruby -Ilib examples/stack_table_benchmark.rb
+
+require "vernier"
+
+STACK_COUNT = Integer(ENV.fetch("STACK_COUNT", 200_000))
+
+def nest(depth, &block)
+  if depth > 0
+    nest(depth - 1, &block)
+  else
+    yield
+  end
+end
+
+def measure
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  yield
+  Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+end
+
+def rss_delta
+  GC.start
+  before = Vernier.memory_rss
+  result = yield
+  GC.start
+  [result, Vernier.memory_rss - before]
+end
+
+# Build a source table with many distinct stacks at varying depths, so that
+# the trie has both long chains and wide fan-out.
+source = Vernier::StackTable.new
+random = Random.new(1234)
+indexes = []
+while source.stack_count < STACK_COUNT
+  nest(random.rand(30)) do
+    indexes << eval("source.current_stack", binding, "(eval)", random.rand(STACK_COUNT / 10))
+  end
+end
+stack_count = source.stack_count
+puts "#{stack_count} stacks in source table"
+
+target = nil
+insert_time = nil
+_, memory = rss_delta do
+  target = Vernier::StackTable.new
+  insert_time = measure do
+    stack_count.times { |idx| target.convert(source, idx) }
+  end
+end
+
+lookup_time = measure do
+  stack_count.times { |idx| target.convert(source, idx) }
+end
+
+puts format("insert: %8.0f stacks/s", stack_count / insert_time)
+puts format("lookup: %8.0f stacks/s", stack_count / lookup_time)
+puts format("memory: %8.1f bytes/stack (RSS)", memory.to_f / stack_count)
+
+edges = target.hash_stats[:stack_edges]
+puts format("probes: %8.2f mean, %d max (load %.2f)", edges[:mean_probes], edges[:max_probes], edges[:load_factor])
@@ -10,8 +10,18 @@ have_header("ruby/thread.h")
 have_struct_member("rb_internal_thread_event_data_t", "thread", ["ruby/thread.h"])
 
 have_func("rb_profile_thread_frames", "ruby/debug.h")
+have_func("rb_postponed_job_preregister", "ruby/debug.h")
 
 have_func("pthread_setname_np")
 have_func("pthread_condattr_setclock")
 
+# Used for per-thread CPU time sampling (mode: :cpu)
+unless have_func("timer_create", "time.h")
+  have_library("rt", "timer_create", "time.h") && have_func("timer_create", "time.h")
+end
+have_const("SIGEV_THREAD_ID", "signal.h")
+
+# Used to gzip pprof output without the GVL
+have_library("z", "deflate", "zlib.h") && have_header("zlib.h")
+
 create_makefile("vernier/vernier")
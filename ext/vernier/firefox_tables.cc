@@ -0,0 +1,224 @@
+#include <unordered_map>
+#include <vector>
+
+#include "vernier.hh"
+#include "stack_table.hh"
+
+// Builds a thread's samples, stackTable, frameTable and funcTable columns
+// for the Firefox profiler from its packed stack table and samples, so
+// that a large profile's tables are never arrays of Ruby objects. They're
+// returned packed, for JSONWriter::PackedArray to write. Only per func
+// inputs, such as which category each func is in, come from Ruby.
+//
+// Samples which were idle or stalled get a copy of their stack with the
+// sample's category, so the profiler shows the time as that category
+// rather than the leaf func's. Copies come after all the original stacks,
+// and their leaf frames after the original frames, both in the order the
+// samples first use them.
+
+static VALUE rb_mFirefoxTables;
+
+static VALUE
+fetch_value(VALUE hash, const char *key) {
+    return rb_hash_fetch(hash, sym(key));
+}
+
+static std::vector<int>
+fetch_packed(VALUE hash, const char *key) {
+    return unpack_int32s(fetch_value(hash, key));
+}
+
+// Reads an array of integers, with nil as -1
+static std::vector<int>
+fetch_ints(VALUE hash, const char *key, long expected_size) {
+    VALUE array = fetch_value(hash, key);
+    Check_Type(array, T_ARRAY);
+    if (RARRAY_LEN(array) != expected_size) {
+        rb_raise(rb_eArgError, "%s has %ld entries, expected %ld", key, RARRAY_LEN(array), expected_size);
+    }
+    std::vector<int> values(expected_size);
+    for (long i = 0; i < expected_size; i++) {
+        VALUE value = RARRAY_AREF(array, i);
+        values[i] = NIL_P(value) ? -1 : NUM2INT(value);
+    }
+    return values;
+}
+
+static void
+check_indexes(const std::vector<int> &indexes, size_t size, bool allow_none, const char *name) {
+    for (int idx : indexes) {
+        if (allow_none && idx == -1) continue;
+        if (idx < 0 || (size_t)idx >= size) {
+            rb_raise(rb_eArgError, "invalid %s index: %d", name, idx);
+        }
+    }
+}
+
+static VALUE
+pack_bools(const std::vector<bool> &values) {
+    std::string buf;
+    buf.reserve(values.size());
+    for (bool value : values) {
+        buf.push_back(value ? 1 : 0);
+    }
+    return rb_str_new(buf.data(), buf.size());
+}
+
+// FirefoxTables.build(columns) with columns a hash of:
+//
+// stack_parent, stack_frame, frame_func, frame_line, func_first_line::
+//   the stack table, as from StackTable#packed_tables
+// func_name, func_filename::
+//   arrays of each func's indexes in the thread's string table
+// func_category, func_subcategory, func_implementation::
+//   arrays of each func's Firefox category, subcategory and implementation
+//   string index, nil for the interpreter
+// cfunc::
+//   the string index of "<cfunc>", the filename of funcs which aren't JS
+// samples, sample_categories::
+//   the thread's packed stack indexes and uint8 raw categories, which can be
+//   empty if all of them are 0
+// sample_category::
+//   an array of the Firefox category for each nonzero raw category
+//
+// Returns a hash of packed int32 columns named as in the output, or for
+// isJS, packed bytes. stack_prefix and frame_implementation, and
+// func_line_number for cfuncs without one, are -1 for null.
+static VALUE
+firefox_tables_build(VALUE self, VALUE columns) {
+    Check_Type(columns, T_HASH);
+
+    std::vector<int> stack_parents = fetch_packed(columns, "stack_parent");
+    std::vector<int> stack_frames = fetch_packed(columns, "stack_frame");
+    std::vector<int> frame_funcs = fetch_packed(columns, "frame_func");
+    std::vector<int> frame_lines = fetch_packed(columns, "frame_line");
+    std::vector<int> func_first_lines = fetch_packed(columns, "func_first_line");
+    std::vector<int> samples = fetch_packed(columns, "samples");
+
+    size_t stack_count = stack_parents.size();
+    size_t frame_count = frame_funcs.size();
+    size_t func_count = func_first_lines.size();
+    if (stack_frames.size() != stack_count || frame_lines.size() != frame_count) {
+        rb_raise(rb_eArgError, "stack table columns differ in length");
+    }
+
+    std::vector<int> func_names = fetch_ints(columns, "func_name", func_count);
+    std::vector<int> func_filenames = fetch_ints(columns, "func_filename", func_count);
+    std::vector<int> func_categories = fetch_ints(columns, "func_category", func_count);
+    std::vector<int> func_subcategories = fetch_ints(columns, "func_subcategory", func_count);
+    std::vector<int> func_implementations = fetch_ints(columns, "func_implementation", func_count);
+    int cfunc = NUM2INT(fetch_value(columns, "cfunc"));
+
+    VALUE sample_categoriesval = fetch_value(columns, "sample_categories");
+    StringValue(sample_categoriesval);
+    long categorized_count = RSTRING_LEN(sample_categoriesval);
+    if (categorized_count != 0 && (size_t)categorized_count != samples.size()) {
+        rb_raise(rb_eArgError, "samples and sample_categories differ in length");
+    }
+    std::vector<uint8_t> raw_categories(
+        (const uint8_t *)RSTRING_PTR(sample_categoriesval),
+        (const uint8_t *)RSTRING_PTR(sample_categoriesval) + categorized_count);
+
+    VALUE sample_categoryval = fetch_value(columns, "sample_category");
+    Check_Type(sample_categoryval, T_ARRAY);
+    std::vector<int> sample_category(RARRAY_LEN(sample_categoryval));
+    for (long i = 0; i < RARRAY_LEN(sample_categoryval); i++) {
+        VALUE value = RARRAY_AREF(sample_categoryval, i);
+        sample_category[i] = NIL_P(value) ? -1 : NUM2INT(value);
+    }
+
+    check_indexes(stack_parents, stack_count, true, "stack");
+    check_indexes(stack_frames, frame_count, false, "frame");
+    check_indexes(frame_funcs, func_count, false, "func");
+    check_indexes(samples, stack_count, false, "stack");
+    for (uint8_t raw : raw_categories) {
+        if (raw != 0 && (raw >= sample_category.size() || sample_category[raw] < 0)) {
+            rb_raise(rb_eArgError, "invalid sample category: %d", raw);
+        }
+    }
+
+    std::vector<int> out_stack_frames = stack_frames;
+    std::vector<int> out_stack_prefixes = stack_parents;
+    std::vector<int> out_stack_categories(stack_count);
+    std::vector<int> out_stack_subcategories(stack_count);
+    for (size_t stack = 0; stack < stack_count; stack++) {
+        int func = frame_funcs[stack_frames[stack]];
+        out_stack_categories[stack] = func_categories[func];
+        out_stack_subcategories[stack] = func_subcategories[func];
+    }
+
+    std::vector<int> out_frame_funcs = frame_funcs;
+    std::vector<int> out_frame_lines = frame_lines;
+    std::vector<int> out_frame_categories(frame_count);
+    std::vector<int> out_frame_subcategories(frame_count);
+    std::vector<int> out_frame_implementations(frame_count);
+    for (size_t frame = 0; frame < frame_count; frame++) {
+        int func = frame_funcs[frame];
+        out_frame_categories[frame] = func_categories[func];
+        out_frame_subcategories[frame] = func_subcategories[func];
+        out_frame_implementations[frame] = func_implementations[func];
+    }
+
+    // Keyed by stack or frame and raw category
+    std::unordered_map<uint64_t, int> categorized_stacks;
+    std::unordered_map<uint64_t, int> categorized_frames;
+    auto key = [](int idx, uint8_t raw) {
+        return (uint64_t)(uint32_t)idx << 8 | raw;
+    };
+
+    std::vector<int> out_samples = samples;
+    for (size_t i = 0; i < raw_categories.size(); i++) {
+        uint8_t raw = raw_categories[i];
+        if (raw == 0) continue;
+
+        int stack = samples[i];
+        auto stack_result = categorized_stacks.insert({key(stack, raw), (int)out_stack_frames.size()});
+        if (stack_result.second) {
+            int frame = stack_frames[stack];
+            auto frame_result = categorized_frames.insert({key(frame, raw), (int)out_frame_funcs.size()});
+            if (frame_result.second) {
+                out_frame_funcs.push_back(frame_funcs[frame]);
+                out_frame_lines.push_back(frame_lines[frame]);
+                out_frame_categories.push_back(sample_category[raw]);
+                out_frame_subcategories.push_back(0);
+                out_frame_implementations.push_back(out_frame_implementations[frame]);
+            }
+
+            out_stack_frames.push_back(frame_result.first->second);
+            out_stack_prefixes.push_back(stack_parents[stack]);
+            out_stack_categories.push_back(sample_category[raw]);
+            out_stack_subcategories.push_back(0);
+        }
+        out_samples[i] = stack_result.first->second;
+    }
+
+    std::vector<bool> func_is_js(func_count);
+    std::vector<int> func_line_numbers(func_count);
+    for (size_t func = 0; func < func_count; func++) {
+        func_is_js[func] = func_filenames[func] != cfunc;
+        int line = func_first_lines[func];
+        func_line_numbers[func] = func_is_js[func] || line != 0 ? line : -1;
+    }
+
+    VALUE result = rb_hash_new();
+    rb_hash_aset(result, sym("samples"), pack_int32s(out_samples));
+    rb_hash_aset(result, sym("stack_frame"), pack_int32s(out_stack_frames));
+    rb_hash_aset(result, sym("stack_category"), pack_int32s(out_stack_categories));
+    rb_hash_aset(result, sym("stack_subcategory"), pack_int32s(out_stack_subcategories));
+    rb_hash_aset(result, sym("stack_prefix"), pack_int32s(out_stack_prefixes));
+    rb_hash_aset(result, sym("frame_category"), pack_int32s(out_frame_categories));
+    rb_hash_aset(result, sym("frame_subcategory"), pack_int32s(out_frame_subcategories));
+    rb_hash_aset(result, sym("frame_func"), pack_int32s(out_frame_funcs));
+    rb_hash_aset(result, sym("frame_implementation"), pack_int32s(out_frame_implementations));
+    rb_hash_aset(result, sym("frame_line"), pack_int32s(out_frame_lines));
+    rb_hash_aset(result, sym("func_name"), pack_int32s(func_names));
+    rb_hash_aset(result, sym("func_is_js"), pack_bools(func_is_js));
+    rb_hash_aset(result, sym("func_filename"), pack_int32s(func_filenames));
+    rb_hash_aset(result, sym("func_line_number"), pack_int32s(func_line_numbers));
+    return result;
+}
+
+void Init_firefox_tables() {
+  rb_mFirefoxTables = rb_define_module_under(rb_mVernier, "FirefoxTables");
+  rb_define_singleton_method(rb_mFirefoxTables, "build", firefox_tables_build, 1);
+}
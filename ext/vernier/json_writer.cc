@@ -0,0 +1,776 @@
+#include <string>
+#include <vector>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vernier.hh"
+
+#include "ruby/encoding.h"
+#include "ruby/io.h"
+#include "ruby/thread.h"
+
+// Generates the same JSON as JSON.generate for the hashes, arrays, strings
+// and numbers profiles are built from, a chunk at a time. For each chunk,
+// the object is walked with the GVL to copy out text and numbers, then the
+// numbers, which is where most of the time goes in a large profile, are
+// formatted without it. Only one chunk is ever held, so output can be
+// written or compressed as it's generated.
+//
+// Two more kinds of value keep the object itself small. A PackedArray is a
+// column of numbers in a binary string, such as a thread's samples, written
+// without an object per number. A Deferred is only built when the walk
+// reaches it, and can be collected once it's written, so that each of a
+// profile's threads is only in memory while it's being written.
+
+static VALUE rb_cPackedArray;
+static VALUE rb_cDeferred;
+
+struct PackedArray {
+    enum Type : uint8_t {
+        INT32,
+        // Negative values are null, like the roots' prefixes
+        NULLABLE_INT32,
+        UINT32,
+        INT64,
+        // A byte, as false or true
+        BOOL,
+        // Nanoseconds as a uint64, written as float milliseconds
+        MILLISECONDS,
+        // The same value, length times
+        REPEAT,
+    };
+
+    // The packed string, or the value for REPEAT
+    VALUE value;
+    Type type;
+    long repeat_length;
+
+    static size_t element_size(Type type) {
+        switch (type) {
+            case INT32: case NULLABLE_INT32: case UINT32: return 4;
+            case INT64: case MILLISECONDS: return 8;
+            case BOOL: return 1;
+            case REPEAT: return 0;
+        }
+        return 0;
+    }
+
+    // Read from the string each time, so that it's never out of date
+    long length() const {
+        if (type == REPEAT) return repeat_length;
+        return RSTRING_LEN(value) / element_size(type);
+    }
+
+    uint64_t read(long idx) const {
+        size_t size = element_size(type);
+        const unsigned char *p = (const unsigned char *)RSTRING_PTR(value) + idx * size;
+        uint64_t result = 0;
+        for (size_t i = 0; i < size; i++) {
+            result |= (uint64_t)p[i] << (8 * i);
+        }
+        return result;
+    }
+};
+
+static void
+packed_array_mark(void *data) {
+    PackedArray *packed = static_cast<PackedArray *>(data);
+    rb_gc_mark_movable(packed->value);
+}
+
+static void
+packed_array_compact(void *data) {
+    PackedArray *packed = static_cast<PackedArray *>(data);
+    packed->value = rb_gc_location(packed->value);
+}
+
+static void
+packed_array_free(void *data) {
+    delete static_cast<PackedArray *>(data);
+}
+
+static size_t
+packed_array_memsize(const void *data) {
+    return sizeof(PackedArray);
+}
+
+static const rb_data_type_t rb_packed_array_type = {
+    .wrap_struct_name = "vernier/packed_array",
+    .function = {
+        .dmark = packed_array_mark,
+        .dfree = packed_array_free,
+        .dsize = packed_array_memsize,
+        .dcompact = packed_array_compact,
+    },
+};
+
+static const PackedArray *
+get_packed_array(VALUE obj) {
+    PackedArray *packed;
+    TypedData_Get_Struct(obj, PackedArray, &rb_packed_array_type, packed);
+    return packed;
+}
+
+class JSONWriter {
+    enum Op : uint8_t {
+        // Copy text up to the offset in the value
+        TEXT,
+        INTEGER,
+        FLOAT,
+    };
+
+    // The chunk being generated. text has punctuation, escaped strings and
+    // anything generated by Ruby. ops and values are parallel arrays
+    // rather than a struct, to save padding for every number.
+    std::string text;
+    std::vector<Op> ops;
+    std::vector<uint64_t> values;
+
+    // An array, hash or PackedArray being walked. Hashes are walked through
+    // an array of their keys and values, so that the walk can stop between
+    // chunks.
+    enum Kind : uint8_t {
+        ARRAY,
+        HASH,
+        PACKED,
+    };
+    struct Frame {
+        VALUE array;
+        long index;
+        Kind kind;
+    };
+    // Marked by mark, which also pins them, since the walk holds their
+    // addresses between chunks. Key/value arrays and the values of
+    // Deferreds aren't reachable from anything else.
+    std::vector<Frame> stack;
+
+    bool started = false;
+
+    // The last string's escaped text is kept, for columns which repeat
+    // one. It's marked, so that its address can't be reused by another.
+    VALUE last_string = Qundef;
+    std::string last_string_text;
+
+    void flush_text() {
+        if (!ops.empty() && ops.back() == TEXT) {
+            values.back() = text.size();
+        } else {
+            ops.push_back(TEXT);
+            values.push_back(text.size());
+        }
+    }
+
+    void add_integer(int64_t value) {
+        flush_text();
+        ops.push_back(INTEGER);
+        values.push_back((uint64_t)value);
+    }
+
+    void add_float(double value) {
+        flush_text();
+        ops.push_back(FLOAT);
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        values.push_back(bits);
+    }
+
+    // Anything we don't handle is generated by the json gem, which also
+    // raises for NaN or invalid strings like JSON.generate would
+    void add_generated(VALUE obj) {
+        VALUE json = rb_funcall(obj, rb_intern("to_json"), 0);
+        text.append(RSTRING_PTR(json), RSTRING_LEN(json));
+    }
+
+    void add_string(VALUE str) {
+        if (str == last_string) {
+            text.append(last_string_text);
+            return;
+        }
+        size_t start = text.size();
+        escape_string(str);
+        last_string = str;
+        last_string_text.assign(text, start, std::string::npos);
+    }
+
+    void escape_string(VALUE str) {
+        rb_encoding *enc = rb_enc_get(str);
+        int coderange = rb_enc_str_coderange(str);
+        if (coderange != ENC_CODERANGE_7BIT && !(enc == rb_utf8_encoding() && coderange == ENC_CODERANGE_VALID)) {
+            add_generated(str);
+            return;
+        }
+
+        static const char hex[] = "0123456789abcdef";
+        const char *ptr = RSTRING_PTR(str);
+        long len = RSTRING_LEN(str);
+
+        text.push_back('"');
+        for (long i = 0; i < len; i++) {
+            unsigned char c = ptr[i];
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                long end = i + 1;
+                while (end < len && (unsigned char)ptr[end] >= 0x20 && ptr[end] != '"' && ptr[end] != '\\') end++;
+                text.append(ptr + i, end - i);
+                i = end - 1;
+                continue;
+            }
+            switch (c) {
+                case '"': text.append("\\\""); break;
+                case '\\': text.append("\\\\"); break;
+                case '\b': text.append("\\b"); break;
+                case '\f': text.append("\\f"); break;
+                case '\n': text.append("\\n"); break;
+                case '\r': text.append("\\r"); break;
+                case '\t': text.append("\\t"); break;
+                default:
+                    text.append("\\u00");
+                    text.push_back(hex[c >> 4]);
+                    text.push_back(hex[c & 0xf]);
+            }
+        }
+        text.push_back('"');
+    }
+
+    void add_key(VALUE key) {
+        if (RB_TYPE_P(key, T_STRING)) {
+            add_string(key);
+        } else if (RB_TYPE_P(key, T_SYMBOL)) {
+            add_string(rb_sym2str(key));
+        } else {
+            escape_string(rb_obj_as_string(key));
+        }
+    }
+
+    static int collect_pair(VALUE key, VALUE value, VALUE array) {
+        rb_ary_push(array, key);
+        rb_ary_push(array, value);
+        return ST_CONTINUE;
+    }
+
+    void add_packed(const PackedArray *packed, long idx) {
+        switch (packed->type) {
+            case PackedArray::INT32:
+                add_integer((int32_t)packed->read(idx));
+                break;
+            case PackedArray::NULLABLE_INT32: {
+                int32_t value = (int32_t)packed->read(idx);
+                if (value < 0) {
+                    text.append("null");
+                } else {
+                    add_integer(value);
+                }
+                break;
+            }
+            case PackedArray::UINT32:
+                add_integer((uint32_t)packed->read(idx));
+                break;
+            case PackedArray::INT64:
+                add_integer((int64_t)packed->read(idx));
+                break;
+            case PackedArray::BOOL:
+                text.append(packed->read(idx) ? "true" : "false");
+                break;
+            case PackedArray::MILLISECONDS:
+                add_float(packed->read(idx) / 1e6);
+                break;
+            case PackedArray::REPEAT:
+                add(packed->value);
+                break;
+        }
+    }
+
+    // Writes obj, or for an array, hash or PackedArray its opening bracket,
+    // leaving its contents to be walked
+    void add(VALUE obj) {
+        if (FIXNUM_P(obj)) {
+            add_integer(FIX2LONG(obj));
+        } else if (RB_FLOAT_TYPE_P(obj) && std::isfinite(RFLOAT_VALUE(obj))) {
+            add_float(RFLOAT_VALUE(obj));
+        } else if (NIL_P(obj)) {
+            text.append("null");
+        } else if (obj == Qtrue) {
+            text.append("true");
+        } else if (obj == Qfalse) {
+            text.append("false");
+        } else if (RB_TYPE_P(obj, T_STRING)) {
+            add_string(obj);
+        } else if (RB_TYPE_P(obj, T_SYMBOL)) {
+            add_string(rb_sym2str(obj));
+        } else if (RB_TYPE_P(obj, T_ARRAY)) {
+            text.push_back('[');
+            stack.push_back({ obj, 0, ARRAY });
+        } else if (RB_TYPE_P(obj, T_HASH)) {
+            text.push_back('{');
+            VALUE array = rb_ary_new_capa(RHASH_SIZE(obj) * 2);
+            rb_hash_foreach(obj, collect_pair, array);
+            stack.push_back({ array, 0, HASH });
+        } else if (rb_typeddata_is_kind_of(obj, &rb_packed_array_type)) {
+            text.push_back('[');
+            stack.push_back({ obj, 0, PACKED });
+        } else if (rb_obj_is_kind_of(obj, rb_cDeferred)) {
+            add(rb_funcall(obj, rb_intern("value"), 0));
+        } else {
+            add_generated(obj);
+        }
+    }
+
+    public:
+        void mark() const {
+            for (const Frame &frame : stack) {
+                rb_gc_mark(frame.array);
+            }
+            if (last_string != Qundef) {
+                rb_gc_mark(last_string);
+            }
+        }
+
+        static const size_t CHUNK_SIZE = 64 * 1024;
+
+        // Walks obj from where the last chunk stopped, until there's about
+        // CHUNK_SIZE of output. Returns false once there's nothing left.
+        bool walk_chunk(VALUE obj) {
+            text.clear();
+            ops.clear();
+            values.clear();
+
+            if (!started) {
+                started = true;
+                add(obj);
+            }
+
+            // Numbers are counted as 16 bytes, around what they format to
+            while (!stack.empty() && text.size() + values.size() * 16 < CHUNK_SIZE) {
+                Frame &frame = stack.back();
+                const PackedArray *packed = frame.kind == PACKED ? get_packed_array(frame.array) : nullptr;
+                long length = packed ? packed->length() : RARRAY_LEN(frame.array);
+                if (frame.index >= length) {
+                    text.push_back(frame.kind == HASH ? '}' : ']');
+                    stack.pop_back();
+                    continue;
+                }
+
+                if (frame.index > 0) {
+                    text.push_back(',');
+                }
+                if (packed) {
+                    add_packed(packed, frame.index++);
+                    continue;
+                }
+                VALUE value = RARRAY_AREF(frame.array, frame.index);
+                if (frame.kind == HASH) {
+                    add_key(value);
+                    text.push_back(':');
+                    value = RARRAY_AREF(frame.array, frame.index + 1);
+                    frame.index += 2;
+                } else {
+                    frame.index += 1;
+                }
+
+                // May push to stack, so frame can't be used after
+                add(value);
+            }
+
+            flush_text();
+            return !stack.empty();
+        }
+
+        // Appends the walked chunk to out. Doesn't touch any Ruby objects,
+        // so can run without the GVL.
+        void format_chunk(std::string &out) const {
+            size_t text_pos = 0;
+            char number[64];
+            for (size_t i = 0; i < ops.size(); i++) {
+                switch (ops[i]) {
+                    case TEXT:
+                        out.append(text, text_pos, values[i] - text_pos);
+                        text_pos = values[i];
+                        break;
+                    case INTEGER:
+                        out.append(number, sprintf(number, "%lld", (long long)(int64_t)values[i]));
+                        break;
+                    case FLOAT: {
+                        double value;
+                        memcpy(&value, &values[i], sizeof(value));
+                        out.append(number, format_float(value, number));
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Writes the same digits as Ruby's Float#to_s: the shortest that
+        // read back as value, in decimal unless the exponent is large.
+        static size_t format_float(double value, char *out) {
+            if (value == 0) {
+                return sprintf(out, "%s", std::signbit(value) ? "-0.0" : "0.0");
+            }
+
+            // Times in milliseconds are nanoseconds divided by a million,
+            // so usually have at most six decimal places. If the decimal
+            // from rounding that does read back as value, it's also the
+            // shortest, by the same reasoning as below.
+            double abs = std::fabs(value);
+            if (abs >= 0.001 && abs < 1e9) {
+                double scaled = std::nearbyint(abs * 1e6);
+                if (scaled / 1e6 == abs) {
+                    uint64_t micro = (uint64_t)scaled;
+                    char *o = out;
+                    if (value < 0) *o++ = '-';
+                    o += sprintf(o, "%llu.", (unsigned long long)(micro / 1000000));
+                    uint64_t fraction = micro % 1000000;
+                    if (fraction == 0) {
+                        *o++ = '0';
+                    } else {
+                        for (uint64_t place = 100000; fraction > 0; place /= 10) {
+                            *o++ = '0' + fraction / place;
+                            fraction %= place;
+                        }
+                    }
+                    return o - out;
+                }
+            }
+
+            // 15 significant digits are spaced further apart than doubles,
+            // so if the nearest 15 digit number reads back as value then,
+            // without its trailing zeros, it's also the shortest that does.
+            // Subnormals have less precision, so may need fewer digits than
+            // that, and are searched from one.
+            char buf[32];
+            for (int precision = abs < DBL_MIN ? 1 : 15; ; precision++) {
+                snprintf(buf, sizeof(buf), "%.*e", precision - 1, value);
+                if (precision == 17 || strtod(buf, nullptr) == value) break;
+            }
+
+            // Split "-d.ddde+XX" into sign, digits and decimal exponent
+            char *p = buf;
+            char *o = out;
+            if (*p == '-') *o++ = *p++;
+            char digits[20];
+            int ndigits = 0;
+            for (; *p != 'e'; p++) {
+                if (*p != '.') digits[ndigits++] = *p;
+            }
+            while (ndigits > 1 && digits[ndigits - 1] == '0') ndigits--;
+            int decpt = atoi(p + 1) + 1;
+
+            if (decpt > 0 && decpt < ndigits && decpt <= 16) {
+                memcpy(o, digits, decpt);
+                o += decpt;
+                *o++ = '.';
+                memcpy(o, digits + decpt, ndigits - decpt);
+                o += ndigits - decpt;
+            } else if (decpt > 0 && decpt <= 15) {
+                memcpy(o, digits, ndigits);
+                o += ndigits;
+                memset(o, '0', decpt - ndigits);
+                o += decpt - ndigits;
+                memcpy(o, ".0", 2);
+                o += 2;
+            } else if (decpt <= 0 && decpt > -4) {
+                memcpy(o, "0.", 2);
+                o += 2;
+                memset(o, '0', -decpt);
+                o += -decpt;
+                memcpy(o, digits, ndigits);
+                o += ndigits;
+            } else {
+                *o++ = digits[0];
+                *o++ = '.';
+                if (ndigits > 1) {
+                    memcpy(o, digits + 1, ndigits - 1);
+                    o += ndigits - 1;
+                } else {
+                    *o++ = '0';
+                }
+                o += sprintf(o, "e%+03d", decpt - 1);
+            }
+            return o - out;
+        }
+};
+
+// State for one call, freed by rb_ensure even if walking the object or
+// the block raises. It's wrapped in an object for the walk to be marked.
+struct Generation {
+    JSONWriter writer;
+    std::string buffer;
+
+    VALUE obj;
+
+    int fd = -1;
+    size_t written = 0;
+    int error = 0;
+
+    Generation(VALUE obj) : obj(obj) {}
+
+    // Walks and formats the next chunk into buffer, releasing the GVL to
+    // format. Returns false after the last chunk.
+    bool next_chunk() {
+        bool more = writer.walk_chunk(obj);
+        buffer.clear();
+        rb_thread_call_without_gvl(format, this, RUBY_UBF_IO, NULL);
+        return more;
+    }
+
+    static void *format(void *data) {
+        Generation *gen = static_cast<Generation *>(data);
+        gen->writer.format_chunk(gen->buffer);
+        return nullptr;
+    }
+
+    static void *write_buffer(void *data) {
+        Generation *gen = static_cast<Generation *>(data);
+        const char *ptr = gen->buffer.data();
+        size_t len = gen->buffer.size();
+        while (len > 0) {
+            ssize_t n = write(gen->fd, ptr, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                gen->error = errno;
+                break;
+            }
+            ptr += n;
+            len -= n;
+            gen->written += n;
+        }
+        return nullptr;
+    }
+};
+
+static void
+generation_mark(void *data) {
+    Generation *gen = static_cast<Generation *>(data);
+    rb_gc_mark(gen->obj);
+    gen->writer.mark();
+}
+
+static void
+generation_dfree(void *data) {
+    delete static_cast<Generation *>(data);
+}
+
+static const rb_data_type_t rb_generation_type = {
+    .wrap_struct_name = "vernier/json_generation",
+    .function = {
+        .dmark = generation_mark,
+        .dfree = generation_dfree,
+    },
+};
+
+static VALUE
+generation_new(VALUE obj) {
+    return TypedData_Wrap_Struct(0, &rb_generation_type, new Generation(obj));
+}
+
+static Generation *
+get_generation(VALUE wrapper) {
+    return static_cast<Generation *>(RTYPEDDATA_DATA(wrapper));
+}
+
+// Frees the state as soon as the call is done rather than at the next GC
+static VALUE
+generation_free(VALUE wrapper) {
+    delete get_generation(wrapper);
+    RTYPEDDATA_DATA(wrapper) = nullptr;
+    return Qnil;
+}
+
+static VALUE
+generate_string(VALUE wrapper) {
+    Generation *gen = get_generation(wrapper);
+    VALUE str = rb_utf8_str_new(0, 0);
+    bool more;
+    do {
+        more = gen->next_chunk();
+        rb_str_cat(str, gen->buffer.data(), gen->buffer.size());
+    } while (more);
+    return str;
+}
+
+static VALUE
+generate_chunks(VALUE wrapper) {
+    Generation *gen = get_generation(wrapper);
+    bool more;
+    do {
+        more = gen->next_chunk();
+        if (!gen->buffer.empty()) {
+            rb_yield(rb_str_new(gen->buffer.data(), gen->buffer.size()));
+        }
+    } while (more);
+    return Qnil;
+}
+
+static VALUE
+generate_to_fd(VALUE wrapper) {
+    Generation *gen = get_generation(wrapper);
+    bool more;
+    do {
+        more = gen->next_chunk();
+        rb_thread_call_without_gvl(Generation::write_buffer, gen, RUBY_UBF_IO, NULL);
+        if (gen->error) {
+            rb_syserr_fail(gen->error, "write");
+        }
+    } while (more);
+    return SIZET2NUM(gen->written);
+}
+
+// Returns the JSON for obj, or if given a block, yields it in binary
+// chunks of about 64KB so that the whole document is never in memory
+static VALUE
+json_writer_generate(VALUE self, VALUE obj) {
+    VALUE wrapper = generation_new(obj);
+    auto body = rb_block_given_p() ? generate_chunks : generate_string;
+    VALUE result = rb_ensure(body, wrapper, generation_free, wrapper);
+    RB_GC_GUARD(wrapper);
+    return result;
+}
+
+// Writes to io's file descriptor directly, after flushing anything it has
+// buffered. Returns the number of bytes written.
+static VALUE
+json_writer_write(VALUE self, VALUE obj, VALUE io) {
+    io = rb_io_get_io(io);
+    rb_io_flush(io);
+
+    VALUE wrapper = generation_new(obj);
+    get_generation(wrapper)->fd = rb_io_descriptor(io);
+    VALUE result = rb_ensure(generate_to_fd, wrapper, generation_free, wrapper);
+    RB_GC_GUARD(wrapper);
+    return result;
+}
+
+static VALUE
+packed_array_wrap(VALUE value, PackedArray::Type type, long repeat_length) {
+    PackedArray *packed = new PackedArray{ value, type, repeat_length };
+    return TypedData_Wrap_Struct(rb_cPackedArray, &rb_packed_array_type, packed);
+}
+
+// PackedArray.new(bytes, type) for a column packed little-endian as type:
+// :int32, :nullable_int32 (negative values are null), :uint32, :int64,
+// :bool (a byte each) or :milliseconds (uint64 nanoseconds)
+static VALUE
+packed_array_new(VALUE self, VALUE bytes, VALUE type) {
+    StringValue(bytes);
+    Check_Type(type, T_SYMBOL);
+
+    static const struct { const char *name; PackedArray::Type type; } types[] = {
+        { "int32", PackedArray::INT32 },
+        { "nullable_int32", PackedArray::NULLABLE_INT32 },
+        { "uint32", PackedArray::UINT32 },
+        { "int64", PackedArray::INT64 },
+        { "bool", PackedArray::BOOL },
+        { "milliseconds", PackedArray::MILLISECONDS },
+    };
+    for (const auto &entry : types) {
+        if (type == sym(entry.name)) {
+            if (RSTRING_LEN(bytes) % PackedArray::element_size(entry.type) != 0) {
+                rb_raise(rb_eArgError, "packed length isn't a multiple of the element size");
+            }
+            return packed_array_wrap(bytes, entry.type, 0);
+        }
+    }
+    rb_raise(rb_eArgError, "unknown packed type: %" PRIsVALUE, type);
+}
+
+// PackedArray.repeat(value, length) for a column of the same value, which
+// can't be an array or hash
+static VALUE
+packed_array_repeat(VALUE self, VALUE value, VALUE lengthval) {
+    long length = NUM2LONG(lengthval);
+    if (length < 0) {
+        rb_raise(rb_eArgError, "negative length");
+    }
+    if (RB_TYPE_P(value, T_ARRAY) || RB_TYPE_P(value, T_HASH) || rb_obj_is_kind_of(value, rb_cDeferred)) {
+        rb_raise(rb_eArgError, "can't repeat an array, hash or deferred value");
+    }
+    return packed_array_wrap(value, PackedArray::REPEAT, length);
+}
+
+static VALUE
+packed_array_length(VALUE self) {
+    return LONG2NUM(get_packed_array(self)->length());
+}
+
+static VALUE
+packed_array_to_a(VALUE self) {
+    const PackedArray *packed = get_packed_array(self);
+    long length = packed->length();
+    VALUE array = rb_ary_new_capa(length);
+    for (long i = 0; i < length; i++) {
+        VALUE value = Qnil;
+        switch (packed->type) {
+            case PackedArray::INT32:
+                value = INT2NUM((int32_t)packed->read(i));
+                break;
+            case PackedArray::NULLABLE_INT32: {
+                int32_t number = (int32_t)packed->read(i);
+                value = number < 0 ? Qnil : INT2NUM(number);
+                break;
+            }
+            case PackedArray::UINT32:
+                value = UINT2NUM((uint32_t)packed->read(i));
+                break;
+            case PackedArray::INT64:
+                value = LL2NUM((int64_t)packed->read(i));
+                break;
+            case PackedArray::BOOL:
+                value = packed->read(i) ? Qtrue : Qfalse;
+                break;
+            case PackedArray::MILLISECONDS:
+                value = DBL2NUM(packed->read(i) / 1e6);
+                break;
+            case PackedArray::REPEAT:
+                value = packed->value;
+                break;
+        }
+        rb_ary_push(array, value);
+    }
+    return array;
+}
+
+// So that JSON.generate writes the same as JSONWriter
+static VALUE
+packed_array_to_json(int argc, VALUE *argv, VALUE self) {
+    return rb_funcallv(packed_array_to_a(self), rb_intern("to_json"), argc, argv);
+}
+
+static VALUE
+deferred_initialize(VALUE self) {
+    rb_ivar_set(self, rb_intern("@block"), rb_block_proc());
+    return self;
+}
+
+// Builds the value. It isn't kept, so that it can be collected once it's
+// been written.
+static VALUE
+deferred_value(VALUE self) {
+    return rb_proc_call(rb_ivar_get(self, rb_intern("@block")), rb_ary_new());
+}
+
+static VALUE
+deferred_to_json(int argc, VALUE *argv, VALUE self) {
+    return rb_funcallv(deferred_value(self), rb_intern("to_json"), argc, argv);
+}
+
+void Init_json_writer() {
+  VALUE rb_mJSONWriter = rb_define_module_under(rb_mVernier, "JSONWriter");
+  rb_define_singleton_method(rb_mJSONWriter, "generate", json_writer_generate, 1);
+  rb_define_singleton_method(rb_mJSONWriter, "write", json_writer_write, 2);
+
+  rb_cPackedArray = rb_define_class_under(rb_mJSONWriter, "PackedArray", rb_cObject);
+  rb_undef_alloc_func(rb_cPackedArray);
+  rb_define_singleton_method(rb_cPackedArray, "new", packed_array_new, 2);
+  rb_define_singleton_method(rb_cPackedArray, "repeat", packed_array_repeat, 2);
+  rb_define_method(rb_cPackedArray, "length", packed_array_length, 0);
+  rb_define_method(rb_cPackedArray, "size", packed_array_length, 0);
+  rb_define_method(rb_cPackedArray, "to_a", packed_array_to_a, 0);
+  rb_define_method(rb_cPackedArray, "to_json", packed_array_to_json, -1);
+
+  rb_cDeferred = rb_define_class_under(rb_mJSONWriter, "Deferred", rb_cObject);
+  rb_define_method(rb_cDeferred, "initialize", deferred_initialize, 0);
+  rb_define_method(rb_cDeferred, "value", deferred_value, 0);
+  rb_define_method(rb_cDeferred, "to_json", deferred_to_json, -1);
+}
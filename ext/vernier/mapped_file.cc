@@ -0,0 +1,198 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vernier.hh"
+
+// A read-only file mapped into memory, for reading profiles written in the
+// vernier-bin format (see lib/vernier/binary_profile.rb) without loading
+// them. Values are little-endian and read at byte offsets, so only the
+// pages that are touched are ever read from disk.
+
+static VALUE rb_cMappedFile;
+
+class MappedFile {
+  public:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool closed = false;
+
+    ~MappedFile() {
+      unmap();
+    }
+
+    void unmap() {
+      if (data) {
+        munmap((void *)data, size);
+        data = nullptr;
+      }
+      closed = true;
+    }
+
+    // Raises unless length bytes starting at offset are in the file
+    const uint8_t *at(VALUE offset, size_t length) const {
+      if (closed) rb_raise(rb_eIOError, "closed mapped file");
+      long off = NUM2LONG(offset);
+      if (off < 0 || (size_t)off > size || length > size - off) {
+        rb_raise(rb_eIndexError, "offset %ld out of range for %zu byte file", off, size);
+      }
+      return data + off;
+    }
+
+    size_t array_length(VALUE count, size_t element_size) const {
+      long n = NUM2LONG(count);
+      if (n < 0) rb_raise(rb_eArgError, "negative count");
+      if ((size_t)n > size / element_size) {
+        rb_raise(rb_eIndexError, "count %ld out of range for %zu byte file", n, size);
+      }
+      return n * element_size;
+    }
+
+    template <typename T>
+    static T read_le(const uint8_t *p) {
+      uint64_t value = 0;
+      for (size_t i = 0; i < sizeof(T); i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+      }
+      return (T)value;
+    }
+};
+
+static void
+mapped_file_free(void *data) {
+    delete static_cast<MappedFile *>(data);
+}
+
+static size_t
+mapped_file_memsize(const void *data) {
+    // The mapping itself is shared with the page cache
+    return sizeof(MappedFile);
+}
+
+static const rb_data_type_t rb_mapped_file_type = {
+    .wrap_struct_name = "vernier/mapped_file",
+    .function = {
+        .dmark = NULL,
+        .dfree = mapped_file_free,
+        .dsize = mapped_file_memsize,
+    },
+};
+
+static MappedFile *
+get_mapped_file(VALUE obj) {
+    MappedFile *file;
+    TypedData_Get_Struct(obj, MappedFile, &rb_mapped_file_type, file);
+    return file;
+}
+
+static VALUE
+mapped_file_new(VALUE self, VALUE path) {
+    path = rb_get_path(path);
+
+    int fd = open(StringValueCStr(path), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) rb_sys_fail_str(path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int e = errno;
+        close(fd);
+        rb_syserr_fail_str(e, path);
+    }
+
+    MappedFile *file = new MappedFile();
+    file->size = st.st_size;
+    if (file->size > 0) {
+        void *mapped = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            int e = errno;
+            close(fd);
+            delete file;
+            rb_syserr_fail_str(e, path);
+        }
+        file->data = static_cast<const uint8_t *>(mapped);
+    }
+    close(fd);
+
+    return TypedData_Wrap_Struct(self, &rb_mapped_file_type, file);
+}
+
+static VALUE
+mapped_file_size(VALUE self) {
+    return SIZET2NUM(get_mapped_file(self)->size);
+}
+
+static VALUE
+mapped_file_close(VALUE self) {
+    get_mapped_file(self)->unmap();
+    return Qnil;
+}
+
+static VALUE
+mapped_file_bytes(VALUE self, VALUE offset, VALUE length) {
+    MappedFile *file = get_mapped_file(self);
+    long len = NUM2LONG(length);
+    if (len < 0) rb_raise(rb_eArgError, "negative length");
+    const uint8_t *p = file->at(offset, len);
+    return rb_str_new((const char *)p, len);
+}
+
+static VALUE
+mapped_file_int32(VALUE self, VALUE offset) {
+    const uint8_t *p = get_mapped_file(self)->at(offset, 4);
+    return INT2NUM(MappedFile::read_le<int32_t>(p));
+}
+
+static VALUE
+mapped_file_uint32(VALUE self, VALUE offset) {
+    const uint8_t *p = get_mapped_file(self)->at(offset, 4);
+    return UINT2NUM(MappedFile::read_le<uint32_t>(p));
+}
+
+static VALUE
+mapped_file_int64(VALUE self, VALUE offset) {
+    const uint8_t *p = get_mapped_file(self)->at(offset, 8);
+    return LL2NUM(MappedFile::read_le<int64_t>(p));
+}
+
+static VALUE
+mapped_file_uint64(VALUE self, VALUE offset) {
+    const uint8_t *p = get_mapped_file(self)->at(offset, 8);
+    return ULL2NUM(MappedFile::read_le<uint64_t>(p));
+}
+
+template <typename T, VALUE (*convert)(T)>
+static VALUE
+mapped_file_array(VALUE self, VALUE offset, VALUE count) {
+    MappedFile *file = get_mapped_file(self);
+    size_t length = file->array_length(count, sizeof(T));
+    const uint8_t *p = file->at(offset, length);
+
+    size_t n = length / sizeof(T);
+    VALUE ary = rb_ary_new_capa(n);
+    for (size_t i = 0; i < n; i++) {
+        rb_ary_push(ary, convert(MappedFile::read_le<T>(p + i * sizeof(T))));
+    }
+    return ary;
+}
+
+static VALUE int32_value(int32_t value) { return INT2NUM(value); }
+static VALUE uint32_value(uint32_t value) { return UINT2NUM(value); }
+static VALUE uint64_value(uint64_t value) { return ULL2NUM(value); }
+
+void
+Init_mapped_file() {
+  rb_cMappedFile = rb_define_class_under(rb_mVernier, "MappedFile", rb_cObject);
+  rb_undef_alloc_func(rb_cMappedFile);
+  rb_define_singleton_method(rb_cMappedFile, "new", mapped_file_new, 1);
+  rb_define_method(rb_cMappedFile, "size", mapped_file_size, 0);
+  rb_define_method(rb_cMappedFile, "close", mapped_file_close, 0);
+  rb_define_method(rb_cMappedFile, "bytes", mapped_file_bytes, 2);
+  rb_define_method(rb_cMappedFile, "int32", mapped_file_int32, 1);
+  rb_define_method(rb_cMappedFile, "uint32", mapped_file_uint32, 1);
+  rb_define_method(rb_cMappedFile, "int64", mapped_file_int64, 1);
+  rb_define_method(rb_cMappedFile, "uint64", mapped_file_uint64, 1);
+  rb_define_method(rb_cMappedFile, "int32_array", (mapped_file_array<int32_t, int32_value>), 2);
+  rb_define_method(rb_cMappedFile, "uint32_array", (mapped_file_array<uint32_t, uint32_value>), 2);
+  rb_define_method(rb_cMappedFile, "uint64_array", (mapped_file_array<uint64_t, uint64_value>), 2);
+}
@@ -82,12 +82,19 @@ class MemoryTracker : public PeriodicThread {
         }
 };
 
+static size_t
+memory_tracker_memsize(const void *data) {
+    MemoryTracker *memory_tracker = static_cast<MemoryTracker *>(const_cast<void *>(data));
+    const std::lock_guard<std::mutex> lock(memory_tracker->mutex);
+    return sizeof(MemoryTracker) + memory_tracker->results.capacity() * sizeof(MemoryTracker::Record);
+}
+
 static const rb_data_type_t rb_memory_tracker_type = {
     .wrap_struct_name = "vernier/memory_tracker",
     .function = {
         //.dmark = memory_tracker_mark,
         //.dfree = memory_tracker_free,
-        //.dsize = memory_tracker_memsize,
+        .dsize = memory_tracker_memsize,
     },
 };
 
@@ -0,0 +1,474 @@
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vernier.hh"
+#include "stack_table.hh"
+
+// A stack table built by merging other tables, for aggregating many
+// profiles into one. Unlike StackTable, frames are keyed by their func's
+// name, filename and first line and their line, rather than by Ruby frame
+// objects, so tables from profile files can be merged as well as live ones.
+// Each merged table's samples are summed into a weight per stack as it's
+// added, so memory is bounded by the number of distinct stacks rather than
+// by the number or size of the profiles merged. Weights can be kept in
+// separate series, such as a base and candidate profile to be compared.
+
+static VALUE rb_cMergedStackTable;
+
+class MergedStackTable {
+    std::unordered_map<std::string, int> string_index;
+    std::vector<const std::string *> strings;
+
+    std::unordered_map<std::string, int> func_index;
+    std::unordered_map<uint64_t, int> frame_index;
+    std::unordered_map<uint64_t, int> stack_index;
+
+    int intern(VALUE str) {
+        StringValue(str);
+        auto result = string_index.insert({std::string(RSTRING_PTR(str), RSTRING_LEN(str)), (int)strings.size()});
+        if (result.second) {
+            strings.push_back(&result.first->first);
+        }
+        return result.first->second;
+    }
+
+    static uint64_t pair_key(int a, int b) {
+        return (uint64_t)(uint32_t)a << 32 | (uint32_t)b;
+    }
+
+    static VALUE fetch_array(VALUE hash, const char *table, const char *column) {
+        VALUE columns = rb_hash_fetch(hash, sym(table));
+        Check_Type(columns, T_HASH);
+        VALUE array = rb_hash_fetch(columns, sym(column));
+        Check_Type(array, T_ARRAY);
+        return array;
+    }
+
+  public:
+    std::vector<int> func_names;
+    std::vector<int> func_filenames;
+    std::vector<int> func_first_lines;
+
+    std::vector<int> frame_funcs;
+    std::vector<int> frame_lines;
+
+    std::vector<int> stack_parents;
+    std::vector<int> stack_frames;
+    std::vector<std::vector<int64_t>> series_weights;
+
+    const std::string &string(int idx) const {
+        return *strings[idx];
+    }
+
+    size_t string_count() const {
+        return strings.size();
+    }
+
+    // The weight of each stack in a series, sized to the current stacks
+    std::vector<int64_t> &weights(size_t series) {
+        if (series >= series_weights.size()) {
+            series_weights.resize(series + 1);
+        }
+        series_weights[series].resize(stack_parents.size(), 0);
+        return series_weights[series];
+    }
+
+    // Sums a series' weights by func into self (the leaf func of each
+    // stack) and total (each func in a stack, once however often it
+    // recurses)
+    void func_weights(size_t series, std::vector<int64_t> &self, std::vector<int64_t> &total) {
+        const std::vector<int64_t> &stack_weights = weights(series);
+        self.assign(func_names.size(), 0);
+        total.assign(func_names.size(), 0);
+
+        // The last stack each func was counted for, to skip recursion
+        std::vector<int> seen(func_names.size(), -1);
+        for (size_t i = 0; i < stack_weights.size(); i++) {
+            int64_t weight = stack_weights[i];
+            if (weight == 0) continue;
+            self[frame_funcs[stack_frames[i]]] += weight;
+            for (int stack = i; stack >= 0; stack = stack_parents[stack]) {
+                int func = frame_funcs[stack_frames[stack]];
+                if (seen[func] == (int)i) continue;
+                seen[func] = i;
+                total[func] += weight;
+            }
+        }
+    }
+
+    // Adds the stacks of table, a hash shaped like StackTable#to_h, and
+    // sums the weights of threads' samples into them in series. threads is
+    // an array of [samples, weights] pairs as taken by each_weighted_sample.
+    void merge(VALUE table, VALUE threads, size_t series) {
+        VALUE names = fetch_array(table, "func_table", "name");
+        VALUE filenames = fetch_array(table, "func_table", "filename");
+        VALUE first_lines = fetch_array(table, "func_table", "first_line");
+        std::vector<int> funcs(RARRAY_LEN(names));
+        for (long i = 0; i < RARRAY_LEN(names); i++) {
+            int name = intern(rb_ary_entry(names, i));
+            int filename = intern(rb_ary_entry(filenames, i));
+            VALUE first_line_value = rb_ary_entry(first_lines, i);
+            int first_line = NIL_P(first_line_value) ? 0 : NUM2INT(first_line_value);
+
+            std::string key;
+            key.append((const char *)&name, sizeof(name));
+            key.append((const char *)&filename, sizeof(filename));
+            key.append((const char *)&first_line, sizeof(first_line));
+            auto result = func_index.insert({key, (int)func_names.size()});
+            if (result.second) {
+                func_names.push_back(name);
+                func_filenames.push_back(filename);
+                func_first_lines.push_back(first_line);
+            }
+            funcs[i] = result.first->second;
+        }
+
+        VALUE frame_func = fetch_array(table, "frame_table", "func");
+        VALUE frame_line = fetch_array(table, "frame_table", "line");
+        std::vector<int> frames(RARRAY_LEN(frame_func));
+        for (long i = 0; i < RARRAY_LEN(frame_func); i++) {
+            int func = NUM2INT(rb_ary_entry(frame_func, i));
+            if (func < 0 || (size_t)func >= funcs.size()) {
+                rb_raise(rb_eArgError, "invalid func index: %d", func);
+            }
+            VALUE line_value = rb_ary_entry(frame_line, i);
+            int line = NIL_P(line_value) ? 0 : NUM2INT(line_value);
+
+            auto result = frame_index.insert({pair_key(funcs[func], line), (int)frame_funcs.size()});
+            if (result.second) {
+                frame_funcs.push_back(funcs[func]);
+                frame_lines.push_back(line);
+            }
+            frames[i] = result.first->second;
+        }
+
+        VALUE parents = fetch_array(table, "stack_table", "parent");
+        VALUE stack_frame = fetch_array(table, "stack_table", "frame");
+        std::vector<int> stacks(RARRAY_LEN(parents));
+        for (long i = 0; i < RARRAY_LEN(parents); i++) {
+            VALUE parent_value = rb_ary_entry(parents, i);
+            int parent = NIL_P(parent_value) ? -1 : NUM2INT(parent_value);
+            if (parent >= i) {
+                rb_raise(rb_eArgError, "stack %ld comes before its parent", i);
+            }
+            int frame = NUM2INT(rb_ary_entry(stack_frame, i));
+            if (frame < 0 || (size_t)frame >= frames.size()) {
+                rb_raise(rb_eArgError, "invalid frame index: %d", frame);
+            }
+            int merged_parent = parent < 0 ? -1 : stacks[parent];
+
+            auto result = stack_index.insert({pair_key(merged_parent + 1, frames[frame]), (int)stack_parents.size()});
+            if (result.second) {
+                stack_parents.push_back(merged_parent);
+                stack_frames.push_back(frames[frame]);
+            }
+            stacks[i] = result.first->second;
+        }
+
+        std::vector<int64_t> &stack_weights = weights(series);
+        each_weighted_sample(threads, [&](int stack, int64_t weight) {
+            if (stack < 0 || (size_t)stack >= stacks.size()) {
+                rb_raise(rb_eArgError, "invalid stack index: %d", stack);
+            }
+            stack_weights[stacks[stack]] += weight;
+        });
+    }
+
+    size_t memsize() const {
+        size_t size = sizeof(MergedStackTable);
+        size += string_index.size() * (sizeof(std::string) + sizeof(int) + 2 * sizeof(void *));
+        size += func_index.size() * (sizeof(std::string) + sizeof(int) + 2 * sizeof(void *));
+        size += (frame_index.size() + stack_index.size()) * (sizeof(uint64_t) + sizeof(int) + 2 * sizeof(void *));
+        size += (func_names.capacity() + func_filenames.capacity() + func_first_lines.capacity()) * sizeof(int);
+        size += (frame_funcs.capacity() + frame_lines.capacity()) * sizeof(int);
+        size += (stack_parents.capacity() + stack_frames.capacity()) * sizeof(int);
+        for (const auto &stack_weights : series_weights) {
+            size += stack_weights.capacity() * sizeof(int64_t);
+        }
+        return size;
+    }
+};
+
+static void
+merged_stack_table_free(void *data) {
+    delete static_cast<MergedStackTable *>(data);
+}
+
+static size_t
+merged_stack_table_memsize(const void *data) {
+    return static_cast<const MergedStackTable *>(data)->memsize();
+}
+
+static const rb_data_type_t rb_merged_stack_table_type = {
+    .wrap_struct_name = "vernier/merged_stack_table",
+    .function = {
+        .dmark = NULL,
+        .dfree = merged_stack_table_free,
+        .dsize = merged_stack_table_memsize,
+    },
+};
+
+static MergedStackTable *
+get_merged_stack_table(VALUE obj) {
+    MergedStackTable *table;
+    TypedData_Get_Struct(obj, MergedStackTable, &rb_merged_stack_table_type, table);
+    return table;
+}
+
+static VALUE
+merged_stack_table_new(VALUE self) {
+    return TypedData_Wrap_Struct(self, &rb_merged_stack_table_type, new MergedStackTable());
+}
+
+static size_t
+series_index(VALUE series) {
+    if (NIL_P(series)) return 0;
+    int idx = NUM2INT(series);
+    if (idx < 0) {
+        rb_raise(rb_eArgError, "invalid series: %d", idx);
+    }
+    return idx;
+}
+
+static VALUE
+merged_stack_table_merge(int argc, VALUE *argv, VALUE self) {
+    VALUE table, threads, series;
+    rb_scan_args(argc, argv, "21", &table, &threads, &series);
+    Check_Type(table, T_HASH);
+    get_merged_stack_table(self)->merge(table, threads, series_index(series));
+    return self;
+}
+
+static VALUE
+int_array(const std::vector<int> &values) {
+    VALUE ary = rb_ary_new_capa(values.size());
+    for (int value : values) {
+        rb_ary_push(ary, INT2NUM(value));
+    }
+    return ary;
+}
+
+static VALUE
+int64_array(const std::vector<int64_t> &values) {
+    VALUE ary = rb_ary_new_capa(values.size());
+    for (int64_t value : values) {
+        rb_ary_push(ary, LL2NUM(value));
+    }
+    return ary;
+}
+
+// Returns [samples, weights]: each stack with any weight in the series, in
+// order, and its total weight
+static VALUE
+merged_stack_table_weights(int argc, VALUE *argv, VALUE self) {
+    VALUE series;
+    rb_scan_args(argc, argv, "01", &series);
+    MergedStackTable *table = get_merged_stack_table(self);
+    const std::vector<int64_t> &stack_weights = table->weights(series_index(series));
+    VALUE samples = rb_ary_new();
+    VALUE weights = rb_ary_new();
+    for (size_t i = 0; i < stack_weights.size(); i++) {
+        if (stack_weights[i] == 0) continue;
+        rb_ary_push(samples, INT2NUM(i));
+        rb_ary_push(weights, LL2NUM(stack_weights[i]));
+    }
+    return rb_ary_new_from_args(2, samples, weights);
+}
+
+// Returns [self, total], each series' weight by func index
+static VALUE
+merged_stack_table_func_weights(int argc, VALUE *argv, VALUE self) {
+    VALUE series;
+    rb_scan_args(argc, argv, "01", &series);
+    MergedStackTable *table = get_merged_stack_table(self);
+    std::vector<int64_t> self_weights, total_weights;
+    table->func_weights(series_index(series), self_weights, total_weights);
+    return rb_ary_new_from_args(2, int64_array(self_weights), int64_array(total_weights));
+}
+
+// Like StackTable#func_string_table, for Output::Firefox
+static VALUE
+merged_stack_table_func_string_table(VALUE self) {
+    MergedStackTable *table = get_merged_stack_table(self);
+
+    VALUE strings = rb_ary_new_capa(table->string_count());
+    for (size_t i = 0; i < table->string_count(); i++) {
+        const std::string &string = table->string(i);
+        rb_ary_push(strings, rb_utf8_str_new(string.data(), string.size()));
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("strings"), strings);
+    rb_hash_aset(hash, sym("name"), int_array(table->func_names));
+    rb_hash_aset(hash, sym("filename"), int_array(table->func_filenames));
+    return hash;
+}
+
+static VALUE
+merged_stack_table_folded(VALUE self, VALUE threads) {
+    MergedStackTable *table = get_merged_stack_table(self);
+
+    std::vector<int64_t> stack_weights(table->stack_parents.size(), 0);
+    each_weighted_sample(threads, [&](int stack, int64_t weight) {
+        if (stack < 0 || (size_t)stack >= stack_weights.size()) {
+            rb_raise(rb_eArgError, "invalid stack index: %d", stack);
+        }
+        stack_weights[stack] += weight;
+    });
+
+    std::vector<std::string> names;
+    names.reserve(table->func_names.size());
+    for (int name : table->func_names) {
+        names.push_back(table->string(name));
+    }
+
+    std::string output = fold_stacks(table->stack_parents, table->stack_frames, table->frame_funcs, std::move(names), stack_weights);
+    return rb_utf8_str_new(output.data(), output.size());
+}
+
+static VALUE
+merged_stack_table_to_h(VALUE self) {
+    MergedStackTable *table = get_merged_stack_table(self);
+
+    VALUE parent = rb_ary_new_capa(table->stack_parents.size());
+    for (int idx : table->stack_parents) {
+        rb_ary_push(parent, idx < 0 ? Qnil : INT2NUM(idx));
+    }
+
+    VALUE name = rb_ary_new_capa(table->func_names.size());
+    VALUE filename = rb_ary_new_capa(table->func_names.size());
+    for (size_t i = 0; i < table->func_names.size(); i++) {
+        const std::string &name_str = table->string(table->func_names[i]);
+        const std::string &filename_str = table->string(table->func_filenames[i]);
+        rb_ary_push(name, rb_utf8_str_new(name_str.data(), name_str.size()));
+        rb_ary_push(filename, rb_utf8_str_new(filename_str.data(), filename_str.size()));
+    }
+
+    VALUE stack_table_hash = rb_hash_new();
+    rb_hash_aset(stack_table_hash, sym("parent"), parent);
+    rb_hash_aset(stack_table_hash, sym("frame"), int_array(table->stack_frames));
+
+    VALUE frame_table_hash = rb_hash_new();
+    rb_hash_aset(frame_table_hash, sym("func"), int_array(table->frame_funcs));
+    rb_hash_aset(frame_table_hash, sym("line"), int_array(table->frame_lines));
+
+    VALUE func_table_hash = rb_hash_new();
+    rb_hash_aset(func_table_hash, sym("name"), name);
+    rb_hash_aset(func_table_hash, sym("filename"), filename);
+    rb_hash_aset(func_table_hash, sym("first_line"), int_array(table->func_first_lines));
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_table"), stack_table_hash);
+    rb_hash_aset(hash, sym("frame_table"), frame_table_hash);
+    rb_hash_aset(hash, sym("func_table"), func_table_hash);
+    return hash;
+}
+
+// As StackTable#packed_tables
+static VALUE
+merged_stack_table_packed_tables(VALUE self) {
+    MergedStackTable *table = get_merged_stack_table(self);
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_parent"), pack_int32s(table->stack_parents));
+    rb_hash_aset(hash, sym("stack_frame"), pack_int32s(table->stack_frames));
+    rb_hash_aset(hash, sym("frame_func"), pack_int32s(table->frame_funcs));
+    rb_hash_aset(hash, sym("frame_line"), pack_int32s(table->frame_lines));
+    rb_hash_aset(hash, sym("func_first_line"), pack_int32s(table->func_first_lines));
+    return hash;
+}
+
+static int
+check_index(VALUE idxval, size_t size) {
+    int idx = NUM2INT(idxval);
+    if (idx < 0 || (size_t)idx >= size) {
+        rb_raise(rb_eIndexError, "index %d out of range", idx);
+    }
+    return idx;
+}
+
+static VALUE
+merged_stack_table_stack_count(VALUE self) {
+    return SIZET2NUM(get_merged_stack_table(self)->stack_parents.size());
+}
+
+static VALUE
+merged_stack_table_frame_count(VALUE self) {
+    return SIZET2NUM(get_merged_stack_table(self)->frame_funcs.size());
+}
+
+static VALUE
+merged_stack_table_func_count(VALUE self) {
+    return SIZET2NUM(get_merged_stack_table(self)->func_names.size());
+}
+
+static VALUE
+merged_stack_table_stack_parent_idx(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    int parent = table->stack_parents[check_index(idxval, table->stack_parents.size())];
+    return parent < 0 ? Qnil : INT2NUM(parent);
+}
+
+static VALUE
+merged_stack_table_stack_frame_idx(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    return INT2NUM(table->stack_frames[check_index(idxval, table->stack_frames.size())]);
+}
+
+static VALUE
+merged_stack_table_frame_func_idx(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    return INT2NUM(table->frame_funcs[check_index(idxval, table->frame_funcs.size())]);
+}
+
+static VALUE
+merged_stack_table_frame_line_no(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    return INT2NUM(table->frame_lines[check_index(idxval, table->frame_lines.size())]);
+}
+
+static VALUE
+merged_stack_table_func_name(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    const std::string &name = table->string(table->func_names[check_index(idxval, table->func_names.size())]);
+    return rb_utf8_str_new(name.data(), name.size());
+}
+
+static VALUE
+merged_stack_table_func_filename(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    const std::string &filename = table->string(table->func_filenames[check_index(idxval, table->func_filenames.size())]);
+    return rb_utf8_str_new(filename.data(), filename.size());
+}
+
+static VALUE
+merged_stack_table_func_first_lineno(VALUE self, VALUE idxval) {
+    MergedStackTable *table = get_merged_stack_table(self);
+    return INT2NUM(table->func_first_lines[check_index(idxval, table->func_first_lines.size())]);
+}
+
+void
+Init_merged_stack_table() {
+  rb_cMergedStackTable = rb_define_class_under(rb_mVernier, "MergedStackTable", rb_cObject);
+  rb_undef_alloc_func(rb_cMergedStackTable);
+  rb_define_singleton_method(rb_cMergedStackTable, "new", merged_stack_table_new, 0);
+  rb_define_method(rb_cMergedStackTable, "merge", merged_stack_table_merge, -1);
+  rb_define_method(rb_cMergedStackTable, "weights", merged_stack_table_weights, -1);
+  rb_define_method(rb_cMergedStackTable, "func_weights", merged_stack_table_func_weights, -1);
+  rb_define_method(rb_cMergedStackTable, "func_string_table", merged_stack_table_func_string_table, 0);
+  rb_define_method(rb_cMergedStackTable, "folded", merged_stack_table_folded, 1);
+  rb_define_method(rb_cMergedStackTable, "to_h", merged_stack_table_to_h, 0);
+  rb_define_method(rb_cMergedStackTable, "packed_tables", merged_stack_table_packed_tables, 0);
+  rb_define_method(rb_cMergedStackTable, "stack_count", merged_stack_table_stack_count, 0);
+  rb_define_method(rb_cMergedStackTable, "frame_count", merged_stack_table_frame_count, 0);
+  rb_define_method(rb_cMergedStackTable, "func_count", merged_stack_table_func_count, 0);
+  rb_define_method(rb_cMergedStackTable, "stack_parent_idx", merged_stack_table_stack_parent_idx, 1);
+  rb_define_method(rb_cMergedStackTable, "stack_frame_idx", merged_stack_table_stack_frame_idx, 1);
+  rb_define_method(rb_cMergedStackTable, "frame_func_idx", merged_stack_table_frame_func_idx, 1);
+  rb_define_method(rb_cMergedStackTable, "frame_line_no", merged_stack_table_frame_line_no, 1);
+  rb_define_method(rb_cMergedStackTable, "func_name", merged_stack_table_func_name, 1);
+  rb_define_method(rb_cMergedStackTable, "func_filename", merged_stack_table_func_filename, 1);
+  rb_define_method(rb_cMergedStackTable, "func_path", merged_stack_table_func_filename, 1);
+  rb_define_method(rb_cMergedStackTable, "func_first_lineno", merged_stack_table_func_first_lineno, 1);
+}
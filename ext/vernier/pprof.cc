@@ -0,0 +1,379 @@
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vernier.hh"
+#include "stack_table.hh"
+
+#include "ruby/thread.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+// Encodes profiles in pprof's profile.proto format
+// (https://github.com/google/pprof/blob/main/proto/profile.proto). Each
+// frame of the StackTable becomes a Location with a single Line, and each
+// func a Function. Samples with the same stack and thread label are
+// combined. Everything is copied out of Ruby objects first, so that the
+// encoding and compression can happen without the GVL.
+
+// Appends protobuf fields to a buffer. Nested messages are built in their
+// own writer and appended with message().
+class ProtoWriter {
+  public:
+    std::string buf;
+
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            buf.push_back((char)((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        buf.push_back((char)value);
+    }
+
+    void tag(int field, int wire_type) {
+        varint((uint64_t)field << 3 | wire_type);
+    }
+
+    // Zero is the default, so it's left out
+    void int_field(int field, int64_t value) {
+        if (value == 0) return;
+        tag(field, 0);
+        varint((uint64_t)value);
+    }
+
+    void bytes_field(int field, const std::string &bytes) {
+        tag(field, 2);
+        varint(bytes.size());
+        buf.append(bytes);
+    }
+
+    void message(int field, const ProtoWriter &message) {
+        bytes_field(field, message.buf);
+    }
+
+    template <typename T>
+    void packed_field(int field, const std::vector<T> &values) {
+        if (values.empty()) return;
+        ProtoWriter packed;
+        for (T value : values) packed.varint((uint64_t)value);
+        bytes_field(field, packed.buf);
+    }
+};
+
+struct PprofEncoder {
+    // A run of samples from one thread whose values are added to one
+    // sample type, multiplied by scale. Without weights, each sample
+    // counts as one.
+    struct Series {
+        int label;
+        std::vector<int> stacks;
+        std::vector<int64_t> weights;
+        int value_index;
+        int64_t scale;
+    };
+
+    StackTable::Snapshot table;
+    std::vector<std::pair<int, int>> sample_types;
+    std::pair<int, int> period_type;
+    int64_t period = 0;
+    int64_t time_nanos = 0;
+    int64_t duration_nanos = 0;
+    int default_sample_type = 0;
+    int thread_label_key;
+    std::vector<Series> series;
+    bool gzip = false;
+
+    std::unordered_map<std::string, int> string_index;
+    std::vector<const std::string *> strings;
+
+    std::string output;
+    const char *error = nullptr;
+
+    PprofEncoder() {
+        intern("");
+        thread_label_key = intern("thread");
+    }
+
+    int intern(const std::string &str) {
+        auto result = string_index.insert({str, (int)strings.size()});
+        if (result.second) {
+            strings.push_back(&result.first->first);
+        }
+        return result.first->second;
+    }
+
+    struct SampleKey {
+        int stack;
+        int label;
+
+        bool operator==(const SampleKey &other) const {
+            return stack == other.stack && label == other.label;
+        }
+    };
+
+    struct SampleKeyHash {
+        size_t operator()(const SampleKey &key) const {
+            return std::hash<int64_t>()((int64_t)key.stack << 32 | (uint32_t)key.label);
+        }
+    };
+
+    void encode() {
+        // Combine samples by stack and thread, in the order they're first
+        // seen
+        std::unordered_map<SampleKey, size_t, SampleKeyHash> sample_index;
+        std::vector<SampleKey> keys;
+        std::vector<int64_t> values;
+        size_t width = sample_types.size();
+        for (const auto &run : series) {
+            for (size_t i = 0; i < run.stacks.size(); i++) {
+                int stack = run.stacks[i];
+                if (stack < 0 || (size_t)stack >= table.stack_parents.size()) continue;
+
+                SampleKey key = { stack, run.label };
+                auto result = sample_index.insert({key, keys.size()});
+                if (result.second) {
+                    keys.push_back(key);
+                    values.resize(values.size() + width, 0);
+                }
+                int64_t weight = run.weights.empty() ? 1 : run.weights[i];
+                values[result.first->second * width + run.value_index] += weight * run.scale;
+            }
+        }
+
+        ProtoWriter profile;
+
+        for (const auto &type : sample_types) {
+            ProtoWriter value_type;
+            value_type.int_field(1, type.first);
+            value_type.int_field(2, type.second);
+            profile.message(1, value_type);
+        }
+
+        std::vector<uint64_t> location_ids;
+        std::vector<int64_t> sample_values;
+        for (size_t i = 0; i < keys.size(); i++) {
+            location_ids.clear();
+            for (int stack = keys[i].stack; stack >= 0; stack = table.stack_parents[stack]) {
+                location_ids.push_back(table.stack_frames[stack] + 1);
+            }
+            sample_values.assign(values.begin() + i * width, values.begin() + (i + 1) * width);
+
+            ProtoWriter sample;
+            sample.packed_field(1, location_ids);
+            sample.packed_field(2, sample_values);
+            if (keys[i].label) {
+                ProtoWriter label;
+                label.int_field(1, thread_label_key);
+                label.int_field(2, keys[i].label);
+                sample.message(3, label);
+            }
+            profile.message(2, sample);
+        }
+
+        for (size_t frame = 0; frame < table.frame_funcs.size(); frame++) {
+            ProtoWriter line;
+            line.int_field(1, table.frame_funcs[frame] + 1);
+            line.int_field(2, table.frame_lines[frame]);
+
+            ProtoWriter location;
+            location.int_field(1, frame + 1);
+            location.message(4, line);
+            profile.message(4, location);
+        }
+
+        for (size_t func = 0; func < table.func_names.size(); func++) {
+            int name = intern(table.func_names[func]);
+
+            ProtoWriter function;
+            function.int_field(1, func + 1);
+            function.int_field(2, name);
+            function.int_field(3, name);
+            function.int_field(4, intern(table.func_filenames[func]));
+            function.int_field(5, table.func_first_linenos[func]);
+            profile.message(5, function);
+        }
+
+        // Every string has been interned by now
+        for (const std::string *str : strings) {
+            profile.bytes_field(6, *str);
+        }
+
+        profile.int_field(9, time_nanos);
+        profile.int_field(10, duration_nanos);
+
+        ProtoWriter period_value_type;
+        period_value_type.int_field(1, period_type.first);
+        period_value_type.int_field(2, period_type.second);
+        profile.message(11, period_value_type);
+        profile.int_field(12, period);
+        profile.int_field(14, default_sample_type);
+
+        if (gzip) {
+            compress(profile.buf);
+        } else {
+            output.swap(profile.buf);
+        }
+    }
+
+#ifdef HAVE_ZLIB_H
+    void compress(const std::string &input) {
+        z_stream stream = {};
+        // 16 added to the window bits asks for a gzip header
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error = "deflateInit2 failed";
+            return;
+        }
+
+        output.resize(deflateBound(&stream, input.size()));
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = input.size();
+        stream.next_out = (Bytef *)&output[0];
+        stream.avail_out = output.size();
+        int status = deflate(&stream, Z_FINISH);
+        output.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        if (status != Z_STREAM_END) {
+            error = "deflate failed";
+        }
+    }
+#else
+    void compress(const std::string &input) {
+        error = "vernier was built without zlib";
+    }
+#endif
+};
+
+static void *
+pprof_encode_without_gvl(void *data) {
+    static_cast<PprofEncoder *>(data)->encode();
+    return NULL;
+}
+
+static std::pair<int, int>
+value_type(PprofEncoder &encoder, VALUE pair) {
+    Check_Type(pair, T_ARRAY);
+    VALUE type = rb_ary_entry(pair, 0);
+    VALUE unit = rb_ary_entry(pair, 1);
+    return {
+        encoder.intern(std::string(StringValuePtr(type), RSTRING_LEN(type))),
+        encoder.intern(std::string(StringValuePtr(unit), RSTRING_LEN(unit))),
+    };
+}
+
+static int64_t
+hash_int(VALUE hash, const char *key) {
+    VALUE value = rb_hash_aref(hash, sym(key));
+    return NIL_P(value) ? 0 : NUM2LL(value);
+}
+
+struct PprofArgs {
+    PprofEncoder *encoder;
+    VALUE stack_table;
+    VALUE options;
+};
+
+static VALUE
+pprof_encode_body(VALUE data) {
+    PprofArgs *args = reinterpret_cast<PprofArgs *>(data);
+    PprofEncoder *encoder = args->encoder;
+    VALUE options = args->options;
+
+    encoder->table = get_stack_table(args->stack_table)->snapshot();
+
+    VALUE sample_types = rb_hash_fetch(options, sym("sample_types"));
+    Check_Type(sample_types, T_ARRAY);
+    for (long i = 0; i < RARRAY_LEN(sample_types); i++) {
+        encoder->sample_types.push_back(value_type(*encoder, RARRAY_AREF(sample_types, i)));
+    }
+    encoder->period_type = value_type(*encoder, rb_hash_fetch(options, sym("period_type")));
+    encoder->period = hash_int(options, "period");
+    encoder->time_nanos = hash_int(options, "time_nanos");
+    encoder->duration_nanos = hash_int(options, "duration_nanos");
+    encoder->gzip = RTEST(rb_hash_aref(options, sym("gzip")));
+
+    VALUE default_sample_type = rb_hash_aref(options, sym("default_sample_type"));
+    if (!NIL_P(default_sample_type)) {
+        encoder->default_sample_type = encoder->intern(std::string(StringValuePtr(default_sample_type), RSTRING_LEN(default_sample_type)));
+    }
+
+    VALUE series = rb_hash_fetch(options, sym("series"));
+    Check_Type(series, T_ARRAY);
+    for (long i = 0; i < RARRAY_LEN(series); i++) {
+        VALUE entry = RARRAY_AREF(series, i);
+        Check_Type(entry, T_ARRAY);
+
+        encoder->series.emplace_back();
+        PprofEncoder::Series &run = encoder->series.back();
+
+        VALUE label = rb_ary_entry(entry, 0);
+        run.label = NIL_P(label) ? 0 : encoder->intern(std::string(StringValuePtr(label), RSTRING_LEN(label)));
+
+        VALUE stacks = rb_ary_entry(entry, 1);
+        Check_Type(stacks, T_ARRAY);
+        run.stacks.reserve(RARRAY_LEN(stacks));
+        for (long j = 0; j < RARRAY_LEN(stacks); j++) {
+            run.stacks.push_back(NUM2INT(RARRAY_AREF(stacks, j)));
+        }
+
+        VALUE weights = rb_ary_entry(entry, 2);
+        if (!NIL_P(weights)) {
+            Check_Type(weights, T_ARRAY);
+            if (RARRAY_LEN(weights) != RARRAY_LEN(stacks)) {
+                rb_raise(rb_eArgError, "weights and stacks differ in length");
+            }
+            run.weights.reserve(RARRAY_LEN(weights));
+            for (long j = 0; j < RARRAY_LEN(weights); j++) {
+                run.weights.push_back(NUM2LL(RARRAY_AREF(weights, j)));
+            }
+        }
+
+        run.value_index = NUM2INT(rb_ary_entry(entry, 3));
+        if (run.value_index < 0 || (size_t)run.value_index >= encoder->sample_types.size()) {
+            rb_raise(rb_eArgError, "invalid sample type index: %d", run.value_index);
+        }
+        run.scale = NUM2LL(rb_ary_entry(entry, 4));
+    }
+
+    rb_thread_call_without_gvl(pprof_encode_without_gvl, encoder, NULL, NULL);
+
+    if (encoder->error) {
+        rb_raise(rb_eRuntimeError, "%s", encoder->error);
+    }
+    return rb_str_new(encoder->output.data(), encoder->output.size());
+}
+
+static VALUE
+pprof_encoder_free(VALUE data) {
+    delete reinterpret_cast<PprofEncoder *>(data);
+    return Qnil;
+}
+
+// Vernier::Pprof.encode(stack_table, options) where options has:
+//
+//   sample_types:  [[type, unit], ...]
+//   period_type:   [type, unit]
+//   default_sample_type: type shown by default, otherwise the last
+//   period, time_nanos, duration_nanos: integers
+//   series:        [[thread_name, stacks, weights or nil, sample type
+//                    index, scale], ...]
+//   gzip:          whether to gzip the output
+static VALUE
+pprof_encode(VALUE self, VALUE stack_table, VALUE options) {
+    Check_Type(options, T_HASH);
+
+    PprofArgs args = { new PprofEncoder(), stack_table, options };
+    return rb_ensure(pprof_encode_body, reinterpret_cast<VALUE>(&args), pprof_encoder_free, reinterpret_cast<VALUE>(args.encoder));
+}
+
+void Init_pprof() {
+  VALUE rb_mPprof = rb_define_module_under(rb_mVernier, "Pprof");
+  rb_define_singleton_method(rb_mPprof, "encode", pprof_encode, 2);
+#ifdef HAVE_ZLIB_H
+  rb_define_const(rb_mPprof, "GZIP", Qtrue);
+#else
+  rb_define_const(rb_mPprof, "GZIP", Qfalse);
+#endif
+}
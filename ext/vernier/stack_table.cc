@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "vernier.hh"
 #include "stack_table.hh"
 
@@ -9,6 +11,18 @@ stack_table_mark(void *data) {
     stack_table->mark_frames();
 }
 
+static size_t
+stack_table_memsize(const void *data) {
+    StackTable *stack_table = static_cast<StackTable *>(const_cast<void *>(data));
+    return stack_table->memsize();
+}
+
+static void
+stack_table_compact(void *data) {
+    StackTable *stack_table = static_cast<StackTable *>(data);
+    stack_table->compact_frames();
+}
+
 static void
 stack_table_free(void *data) {
     StackTable *stack_table = static_cast<StackTable *>(data);
@@ -20,7 +34,8 @@ static const rb_data_type_t rb_stack_table_type = {
     .function = {
         .dmark = stack_table_mark,
         .dfree = stack_table_free,
-        .dsize = nullptr,
+        .dsize = stack_table_memsize,
+        .dcompact = stack_table_compact,
     },
 };
 
@@ -108,12 +123,63 @@ StackTable::stack_table_convert(VALUE self, VALUE original_tableval, VALUE origi
     {
         const std::lock_guard<std::mutex> lock1(stack_table->stack_mutex);
         const std::lock_guard<std::mutex> lock2(original_table->stack_mutex);
-        StackNode *node = stack_table->convert_stack(*original_table, original_idx);
-        result_idx = node->index;
+        result_idx = stack_table->convert_stack(*original_table, original_idx);
     }
     return INT2NUM(result_idx);
 }
 
+VALUE
+StackTable::stack_table_convert_many(VALUE self, VALUE original_tableval, VALUE original_idxsval) {
+    StackTable *stack_table = get_stack_table(self);
+    StackTable *original_table = get_stack_table(original_tableval);
+    bool packed = RB_TYPE_P(original_idxsval, T_STRING);
+    if (!packed) Check_Type(original_idxsval, T_ARRAY);
+
+    int original_size;
+    {
+        const std::lock_guard<std::mutex> lock(original_table->stack_mutex);
+        original_size = original_table->stack_node_list.size();
+    }
+
+    // Read and check everything up front, since we can't raise or allocate
+    // Ruby objects with the locks held.
+    std::vector<int> indexes;
+    if (packed) {
+        indexes = unpack_int32s(original_idxsval);
+    } else {
+        long count = RARRAY_LEN(original_idxsval);
+        indexes.resize(count);
+        for (long i = 0; i < count; i++) {
+            indexes[i] = NUM2INT(RARRAY_AREF(original_idxsval, i));
+        }
+    }
+    for (int original_idx : indexes) {
+        if (original_idx >= original_size || original_idx < 0) {
+            rb_raise(rb_eRangeError, "index out of range");
+        }
+    }
+
+    if (stack_table != original_table) {
+        const std::lock_guard<std::mutex> lock1(stack_table->stack_mutex);
+        const std::lock_guard<std::mutex> lock2(original_table->stack_mutex);
+
+        std::vector<int> memo(original_size, -1);
+        std::vector<int> path;
+        for (auto &idx : indexes) {
+            idx = stack_table->convert_stack_memo(*original_table, idx, memo, path);
+        }
+    }
+
+    if (packed) {
+        return pack_int32s(indexes);
+    }
+    VALUE result = rb_ary_new_capa(indexes.size());
+    for (int idx : indexes) {
+        rb_ary_push(result, INT2NUM(idx));
+    }
+    return result;
+}
+
 VALUE
 StackTable::stack_table_frame_count(VALUE self) {
     StackTable *stack_table = get_stack_table(self);
@@ -126,10 +192,80 @@ VALUE
 StackTable::stack_table_func_count(VALUE self) {
     StackTable *stack_table = get_stack_table(self);
     stack_table->finalize();
-    int count = stack_table->func_map.size();
+    int count;
+    {
+        const std::lock_guard<std::mutex> lock(stack_table->stack_mutex);
+        count = stack_table->func_map.size();
+    }
     return INT2NUM(count);
 }
 
+struct MapStats {
+    size_t size;
+    size_t buckets;
+    size_t used_buckets;
+    size_t max_bucket_size;
+    double load_factor;
+
+    MapStats() {}
+
+    template <typename Map>
+    MapStats(const Map &map) :
+        size(map.size()),
+        buckets(map.bucket_count()),
+        used_buckets(0),
+        max_bucket_size(0),
+        load_factor(map.load_factor())
+    {
+        for (size_t i = 0; i < buckets; i++) {
+            size_t bucket_size = map.bucket_size(i);
+            if (bucket_size > 0) used_buckets++;
+            if (bucket_size > max_bucket_size) max_bucket_size = bucket_size;
+        }
+    }
+
+    VALUE to_hash() const {
+        VALUE hash = rb_hash_new();
+        rb_hash_aset(hash, ID2SYM(rb_intern("size")), ULL2NUM(size));
+        rb_hash_aset(hash, ID2SYM(rb_intern("buckets")), ULL2NUM(buckets));
+        rb_hash_aset(hash, ID2SYM(rb_intern("used_buckets")), ULL2NUM(used_buckets));
+        rb_hash_aset(hash, ID2SYM(rb_intern("max_bucket_size")), ULL2NUM(max_bucket_size));
+        rb_hash_aset(hash, ID2SYM(rb_intern("load_factor")), DBL2NUM(load_factor));
+        return hash;
+    }
+};
+
+VALUE
+StackTable::stack_table_hash_stats(VALUE self) {
+    StackTable *stack_table = get_stack_table(self);
+
+    size_t edge_count, edge_capacity, total_probes, max_probes;
+    MapStats func_stats;
+    {
+        // Collect everything first: allocating Ruby objects with the lock
+        // held could run GC, which takes it again to mark frames.
+        const std::lock_guard<std::mutex> lock(stack_table->stack_mutex);
+        const auto &edges = stack_table->stack_edges;
+        edges.probe_lengths(total_probes, max_probes);
+        edge_count = edges.size();
+        edge_capacity = edges.capacity();
+        func_stats = MapStats(stack_table->func_map.to_idx);
+    }
+
+    VALUE edge_stats = rb_hash_new();
+    rb_hash_aset(edge_stats, ID2SYM(rb_intern("size")), ULL2NUM(edge_count));
+    rb_hash_aset(edge_stats, ID2SYM(rb_intern("capacity")), ULL2NUM(edge_capacity));
+    rb_hash_aset(edge_stats, ID2SYM(rb_intern("load_factor")), DBL2NUM(edge_capacity ? (double)edge_count / edge_capacity : 0.0));
+    rb_hash_aset(edge_stats, ID2SYM(rb_intern("mean_probes")), DBL2NUM(edge_count ? (double)total_probes / edge_count : 0.0));
+    rb_hash_aset(edge_stats, ID2SYM(rb_intern("max_probes")), ULL2NUM(max_probes));
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("stack_edges")), edge_stats);
+    rb_hash_aset(stats, ID2SYM(rb_intern("frames")), MapStats(stack_table->frame_map.to_idx).to_hash());
+    rb_hash_aset(stats, ID2SYM(rb_intern("funcs")), func_stats.to_hash());
+    return stats;
+}
+
 static VALUE
 stack_table_finalize(VALUE self) {
     StackTable *stack_table = get_stack_table(self);
@@ -159,6 +295,7 @@ StackTable::stack_table_frame_func_idx(VALUE self, VALUE idxval) {
         return Qnil;
     } else {
         const auto &frame = stack_table->frame_map[idx];
+        const std::lock_guard<std::mutex> lock(stack_table->stack_mutex);
         int func_idx = stack_table->func_map.index(frame.frame);
         return INT2NUM(func_idx);
     }
@@ -173,22 +310,7 @@ StackTable::stack_table_func_name(VALUE self, VALUE idxval) {
     if (idx < 0 || idx >= table.size()) {
         return Qnil;
     } else {
-        const auto &func_info = table[idx];
-        std::string label = func_info.full_label();
-
-        // Ruby constants are in an arbitrary (ASCII compatible) encoding and
-        // method names are in an arbitrary (ASCII compatible) encoding. These
-        // can be mixed in the same program.
-        //
-        // However, by this point we've lost the chain of what the correct
-        // encoding should be. Oops!
-        //
-        // Instead we'll just guess at UTF-8 which should satisfy most. It won't
-        // necessarily be valid but that can be scrubbed on the Ruby side.
-        //
-        // In the future we might keep class and method name separate for
-        // longer, preserve encodings, and defer formatting to the Ruby side.
-        return rb_enc_interned_str(label.c_str(), label.length(), rb_utf8_encoding());
+        return stack_table->string_value(table[idx].name);
     }
 }
 
@@ -201,14 +323,7 @@ StackTable::stack_table_func_filename(VALUE self, VALUE idxval) {
     if (idx < 0 || idx >= table.size()) {
         return Qnil;
     } else {
-        const auto &func_info = table[idx];
-        std::string filename = func_info.absolute_path;
-        if (filename.empty()) filename = func_info.path;
-
-        // Technically filesystems are binary and then Ruby interprets that as
-        // default_external encoding. But to keep things simple for now we are
-        // going to assume UTF-8.
-        return rb_enc_interned_str(filename.c_str(), filename.length(), rb_utf8_encoding());
+        return stack_table->string_value(table[idx].filename);
     }
 }
 
@@ -221,13 +336,7 @@ StackTable::stack_table_func_path(VALUE self, VALUE idxval) {
     if (idx < 0 || idx >= table.size()) {
         return Qnil;
     } else {
-        const auto &func_info = table[idx];
-        std::string filename = func_info.path;
-
-        // Technically filesystems are binary and then Ruby interprets that as
-        // default_external encoding. But to keep things simple for now we are
-        // going to assume UTF-8.
-        return rb_enc_interned_str(filename.c_str(), filename.length(), rb_utf8_encoding());
+        return stack_table->string_value(table[idx].path);
     }
 }
 
@@ -240,13 +349,7 @@ StackTable::stack_table_func_absolute_path(VALUE self, VALUE idxval) {
     if (idx < 0 || idx >= table.size()) {
         return Qnil;
     } else {
-        const auto &func_info = table[idx];
-        std::string filename = func_info.absolute_path;
-
-        // Technically filesystems are binary and then Ruby interprets that as
-        // default_external encoding. But to keep things simple for now we are
-        // going to assume UTF-8.
-        return rb_enc_interned_str(filename.c_str(), filename.length(), rb_utf8_encoding());
+        return stack_table->string_value(table[idx].absolute_path);
     }
 }
 
@@ -264,16 +367,349 @@ StackTable::stack_table_func_first_lineno(VALUE self, VALUE idxval) {
     }
 }
 
+void
+StackTable::copy_tables(std::vector<int> &stack_parents, std::vector<int> &stack_frames,
+        std::vector<int> &frame_funcs, std::vector<int> &frame_lines) {
+    const std::lock_guard<std::mutex> lock(stack_mutex);
+
+    stack_parents.reserve(stack_node_list.size());
+    stack_frames.reserve(stack_node_list.size());
+    for (const auto &node : stack_node_list) {
+        stack_parents.push_back(node.parent);
+        stack_frames.push_back(frame_map.index(node.frame));
+    }
+    stack_node_list_finalized_idx = stack_node_list.size();
+
+    const auto &frames = frame_map.list;
+    frame_funcs.reserve(frames.size());
+    frame_lines.reserve(frames.size());
+    for (const auto &frame : frames) {
+        frame_funcs.push_back(func_map.index(frame.frame));
+        frame_lines.push_back(frame.line);
+    }
+}
+
+StackTable::Snapshot
+StackTable::snapshot() {
+    Snapshot snapshot;
+    copy_tables(snapshot.stack_parents, snapshot.stack_frames, snapshot.frame_funcs, snapshot.frame_lines);
+    finalize();
+
+    snapshot.func_names.reserve(func_info_list.size());
+    snapshot.func_filenames.reserve(func_info_list.size());
+    snapshot.func_first_linenos.reserve(func_info_list.size());
+    for (const auto &func_info : func_info_list) {
+        snapshot.func_names.push_back(strings[func_info.name]);
+        snapshot.func_filenames.push_back(strings[func_info.filename]);
+        snapshot.func_first_linenos.push_back(func_info.first_lineno);
+    }
+    return snapshot;
+}
+
+VALUE
+StackTable::stack_table_to_h(VALUE self) {
+    StackTable *stack_table = get_stack_table(self);
+
+    std::vector<int> stack_parents;
+    std::vector<int> stack_frames;
+    std::vector<int> frame_funcs;
+    std::vector<int> frame_lines;
+    stack_table->copy_tables(stack_parents, stack_frames, frame_funcs, frame_lines);
+
+    // Symbolicate any funcs we haven't seen yet. This must happen without
+    // holding the lock.
+    stack_table->finalize();
+
+    VALUE parent = rb_ary_new_capa(stack_parents.size());
+    for (int idx : stack_parents) {
+        rb_ary_push(parent, idx < 0 ? Qnil : INT2NUM(idx));
+    }
+    VALUE frame = rb_ary_new_capa(stack_frames.size());
+    for (int idx : stack_frames) {
+        rb_ary_push(frame, INT2NUM(idx));
+    }
+
+    VALUE func = rb_ary_new_capa(frame_funcs.size());
+    for (int idx : frame_funcs) {
+        rb_ary_push(func, INT2NUM(idx));
+    }
+    VALUE line = rb_ary_new_capa(frame_lines.size());
+    for (int lineno : frame_lines) {
+        rb_ary_push(line, INT2NUM(lineno));
+    }
+
+    const auto &funcs = stack_table->func_info_list;
+    VALUE name = rb_ary_new_capa(funcs.size());
+    VALUE filename = rb_ary_new_capa(funcs.size());
+    VALUE first_line = rb_ary_new_capa(funcs.size());
+    for (const auto &func_info : funcs) {
+        rb_ary_push(name, stack_table->string_value(func_info.name));
+        rb_ary_push(filename, stack_table->string_value(func_info.filename));
+        rb_ary_push(first_line, INT2NUM(func_info.first_lineno));
+    }
+
+    VALUE stack_table_hash = rb_hash_new();
+    rb_hash_aset(stack_table_hash, sym("parent"), parent);
+    rb_hash_aset(stack_table_hash, sym("frame"), frame);
+
+    VALUE frame_table_hash = rb_hash_new();
+    rb_hash_aset(frame_table_hash, sym("func"), func);
+    rb_hash_aset(frame_table_hash, sym("line"), line);
+
+    VALUE func_table_hash = rb_hash_new();
+    rb_hash_aset(func_table_hash, sym("name"), name);
+    rb_hash_aset(func_table_hash, sym("filename"), filename);
+    rb_hash_aset(func_table_hash, sym("first_line"), first_line);
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_table"), stack_table_hash);
+    rb_hash_aset(hash, sym("frame_table"), frame_table_hash);
+    rb_hash_aset(hash, sym("func_table"), func_table_hash);
+    return hash;
+}
+
+// The same tables as to_h, packed as little-endian int32 strings with -1
+// for the roots' parents, under the names StreamFile#stack_table uses.
+// Names and filenames are left to func_string_table.
+VALUE
+StackTable::stack_table_packed_tables(VALUE self) {
+    StackTable *stack_table = get_stack_table(self);
+
+    std::vector<int> stack_parents;
+    std::vector<int> stack_frames;
+    std::vector<int> frame_funcs;
+    std::vector<int> frame_lines;
+    stack_table->copy_tables(stack_parents, stack_frames, frame_funcs, frame_lines);
+    stack_table->finalize();
+
+    std::vector<int> func_first_lines;
+    func_first_lines.reserve(stack_table->func_info_list.size());
+    for (const auto &func_info : stack_table->func_info_list) {
+        func_first_lines.push_back(func_info.first_lineno);
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_parent"), pack_int32s(stack_parents));
+    rb_hash_aset(hash, sym("stack_frame"), pack_int32s(stack_frames));
+    rb_hash_aset(hash, sym("frame_func"), pack_int32s(frame_funcs));
+    rb_hash_aset(hash, sym("frame_line"), pack_int32s(frame_lines));
+    rb_hash_aset(hash, sym("func_first_line"), pack_int32s(func_first_lines));
+    return hash;
+}
+
+std::string
+fold_stacks(const std::vector<int> &stack_parents, const std::vector<int> &stack_frames,
+        const std::vector<int> &frame_funcs, std::vector<std::string> func_names,
+        const std::vector<int64_t> &stack_weights) {
+    // Number each stack by its node in a trie of funcs. Parents come
+    // before their children, so this is a single pass.
+    std::vector<int> stack_nodes(stack_parents.size());
+    std::vector<int> node_parents;
+    std::vector<int> node_funcs;
+    std::vector<int64_t> node_weights;
+    std::unordered_map<uint64_t, int> node_index;
+    for (size_t stack = 0; stack < stack_parents.size(); stack++) {
+        int parent = stack_parents[stack] < 0 ? -1 : stack_nodes[stack_parents[stack]];
+        int func = frame_funcs[stack_frames[stack]];
+        uint64_t key = (uint64_t)(uint32_t)(parent + 1) << 32 | (uint32_t)func;
+        auto result = node_index.insert({key, (int)node_parents.size()});
+        if (result.second) {
+            node_parents.push_back(parent);
+            node_funcs.push_back(func);
+            node_weights.push_back(0);
+        }
+        stack_nodes[stack] = result.first->second;
+        node_weights[result.first->second] += stack_weights[stack];
+    }
+
+    for (auto &name : func_names) {
+        std::replace(name.begin(), name.end(), ';', ':');
+        std::replace(name.begin(), name.end(), '\n', ' ');
+    }
+
+    std::string output;
+    std::vector<int> path;
+    for (size_t node = 0; node < node_parents.size(); node++) {
+        if (node_weights[node] == 0) continue;
+
+        path.clear();
+        for (int idx = node; idx >= 0; idx = node_parents[idx]) {
+            path.push_back(node_funcs[idx]);
+        }
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            if (it != path.rbegin()) output.push_back(';');
+            output.append(func_names[*it]);
+        }
+        output.push_back(' ');
+        output.append(std::to_string(node_weights[node]));
+        output.push_back('\n');
+    }
+    return output;
+}
+
+VALUE
+StackTable::stack_table_folded(VALUE self, VALUE threads) {
+    StackTable *stack_table = get_stack_table(self);
+    Check_Type(threads, T_ARRAY);
+
+    std::vector<int> stack_parents;
+    std::vector<int> stack_frames;
+    std::vector<int> frame_funcs;
+    std::vector<int> frame_lines;
+    stack_table->copy_tables(stack_parents, stack_frames, frame_funcs, frame_lines);
+    stack_table->finalize();
+
+    std::vector<int64_t> stack_weights(stack_parents.size(), 0);
+    each_weighted_sample(threads, [&](int stack, int64_t weight) {
+        if (stack < 0 || (size_t)stack >= stack_weights.size()) {
+            rb_raise(rb_eArgError, "invalid stack index: %d", stack);
+        }
+        stack_weights[stack] += weight;
+    });
+
+    std::vector<std::string> names;
+    names.reserve(stack_table->func_info_list.size());
+    for (const auto &func_info : stack_table->func_info_list) {
+        names.push_back(stack_table->strings[func_info.name]);
+    }
+
+    std::string output = fold_stacks(stack_parents, stack_frames, frame_funcs, std::move(names), stack_weights);
+    return rb_utf8_str_new(output.data(), output.size());
+}
+
+VALUE
+StackTable::stack_table_func_string_table(VALUE self) {
+    StackTable *stack_table = get_stack_table(self);
+    stack_table->finalize();
+
+    // Only the names and filenames are included, numbered in the order
+    // they're first used.
+    std::unordered_map<int, int> remap;
+    VALUE strings = rb_ary_new();
+    auto string_idx = [&](int id) {
+        auto result = remap.insert({id, (int)remap.size()});
+        if (result.second) {
+            rb_ary_push(strings, stack_table->string_value(id));
+        }
+        return INT2NUM(result.first->second);
+    };
+
+    const auto &funcs = stack_table->func_info_list;
+    VALUE name = rb_ary_new_capa(funcs.size());
+    VALUE filename = rb_ary_new_capa(funcs.size());
+    for (const auto &func_info : funcs) {
+        rb_ary_push(name, string_idx(func_info.name));
+        rb_ary_push(filename, string_idx(func_info.filename));
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("strings"), strings);
+    rb_hash_aset(hash, sym("name"), name);
+    rb_hash_aset(hash, sym("filename"), filename);
+    return hash;
+}
+
 VALUE stack_table_new(VALUE self) {
     return StackTable::stack_table_new();
 }
 
+static VALUE rb_cSymbolCache;
+
+SymbolCache *SymbolCache::instance = NULL;
+
+// The object wrapping SymbolCache::instance, or nil
+static VALUE symbol_cache_value = Qnil;
+
+static void
+symbol_cache_mark(void *data) {
+    SymbolCache *cache = static_cast<SymbolCache *>(data);
+    cache->mark();
+}
+
+static size_t
+symbol_cache_memsize(const void *data) {
+    const SymbolCache *cache = static_cast<const SymbolCache *>(data);
+    return cache->memsize();
+}
+
+static void
+symbol_cache_compact(void *data) {
+    SymbolCache *cache = static_cast<SymbolCache *>(data);
+    cache->compact();
+}
+
+static void
+symbol_cache_free(void *data) {
+    SymbolCache *cache = static_cast<SymbolCache *>(data);
+    if (SymbolCache::instance == cache) {
+        SymbolCache::instance = NULL;
+    }
+    delete cache;
+}
+
+static const rb_data_type_t rb_symbol_cache_type = {
+    .wrap_struct_name = "vernier/symbol_cache",
+    .function = {
+        .dmark = symbol_cache_mark,
+        .dfree = symbol_cache_free,
+        .dsize = symbol_cache_memsize,
+        .dcompact = symbol_cache_compact,
+    },
+};
+
+static VALUE
+symbol_cache_enable(int argc, VALUE *argv, VALUE self) {
+    VALUE capacity_v;
+    rb_scan_args(argc, argv, "01", &capacity_v);
+    long capacity = NIL_P(capacity_v) ? 10000 : NUM2LONG(capacity_v);
+    if (capacity < 0) {
+        rb_raise(rb_eArgError, "capacity must not be negative");
+    }
+    if ((unsigned long)capacity > SymbolCache::MAX_CAPACITY) {
+        rb_raise(rb_eArgError, "capacity must be at most %zu", SymbolCache::MAX_CAPACITY);
+    }
+
+    // Replaces any existing cache, which is freed once unreferenced
+    SymbolCache *cache = new SymbolCache(capacity);
+    symbol_cache_value = TypedData_Wrap_Struct(rb_cSymbolCache, &rb_symbol_cache_type, cache);
+    SymbolCache::instance = cache;
+    return Qnil;
+}
+
+static VALUE
+symbol_cache_disable(VALUE self) {
+    SymbolCache::instance = NULL;
+    symbol_cache_value = Qnil;
+    return Qnil;
+}
+
+static VALUE
+symbol_cache_enabled_p(VALUE self) {
+    return SymbolCache::instance ? Qtrue : Qfalse;
+}
+
+static VALUE
+symbol_cache_stats(VALUE self) {
+    SymbolCache *cache = SymbolCache::instance;
+    if (!cache) return Qnil;
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("size"), SIZET2NUM(cache->size()));
+    rb_hash_aset(hash, sym("capacity"), SIZET2NUM(cache->max_size()));
+    rb_hash_aset(hash, sym("hits"), SIZET2NUM(cache->hits));
+    rb_hash_aset(hash, sym("misses"), SIZET2NUM(cache->misses));
+    rb_hash_aset(hash, sym("evictions"), SIZET2NUM(cache->evictions));
+    rb_hash_aset(hash, sym("memsize"), SIZET2NUM(cache->memsize()));
+    return hash;
+}
+
 void Init_stack_table() {
   rb_cStackTable = rb_define_class_under(rb_mVernier, "StackTable", rb_cObject);
   rb_undef_alloc_func(rb_cStackTable);
   rb_define_singleton_method(rb_cStackTable, "new", stack_table_new, 0);
   rb_define_method(rb_cStackTable, "current_stack", stack_table_current_stack, -1);
   rb_define_method(rb_cStackTable, "convert", StackTable::stack_table_convert, 2);
+  rb_define_method(rb_cStackTable, "convert_many", StackTable::stack_table_convert_many, 2);
   rb_define_method(rb_cStackTable, "stack_parent_idx", stack_table_stack_parent_idx, 1);
   rb_define_method(rb_cStackTable, "stack_frame_idx", stack_table_stack_frame_idx, 1);
   rb_define_method(rb_cStackTable, "frame_line_no", StackTable::stack_table_frame_line_no, 1);
@@ -287,4 +723,17 @@ void Init_stack_table() {
   rb_define_method(rb_cStackTable, "frame_count", StackTable::stack_table_frame_count, 0);
   rb_define_method(rb_cStackTable, "func_count", StackTable::stack_table_func_count, 0);
   rb_define_method(rb_cStackTable, "finalize", stack_table_finalize, 0);
+  rb_define_method(rb_cStackTable, "to_h", StackTable::stack_table_to_h, 0);
+  rb_define_method(rb_cStackTable, "packed_tables", StackTable::stack_table_packed_tables, 0);
+  rb_define_method(rb_cStackTable, "func_string_table", StackTable::stack_table_func_string_table, 0);
+  rb_define_method(rb_cStackTable, "folded", StackTable::stack_table_folded, 1);
+  rb_define_method(rb_cStackTable, "hash_stats", StackTable::stack_table_hash_stats, 0);
+
+  rb_cSymbolCache = rb_define_class_under(rb_mVernier, "SymbolCache", rb_cObject);
+  rb_undef_alloc_func(rb_cSymbolCache);
+  rb_define_singleton_method(rb_cSymbolCache, "enable", symbol_cache_enable, -1);
+  rb_define_singleton_method(rb_cSymbolCache, "disable", symbol_cache_disable, 0);
+  rb_define_singleton_method(rb_cSymbolCache, "enabled?", symbol_cache_enabled_p, 0);
+  rb_define_singleton_method(rb_cSymbolCache, "stats", symbol_cache_stats, 0);
+  rb_gc_register_address(&symbol_cache_value);
 }
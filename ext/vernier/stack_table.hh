@@ -11,6 +11,46 @@
 #include "ruby/encoding.h"
 #include "ruby/debug.h"
 
+// Finalizer from splitmix64. VALUEs are aligned pointers and line numbers
+// are small, so keys built from them need their bits spread out before they
+// are reduced to a bucket index.
+inline uint64_t mix_hash(uint64_t x) noexcept {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+struct ValueHash {
+    std::size_t operator()(VALUE value) const noexcept {
+        return mix_hash(value);
+    }
+};
+
+// Approximate heap usage of standard containers, for dsize functions. Each
+// unordered_map element lives in its own node alongside a next pointer.
+template <typename T>
+size_t vector_memsize(const std::vector<T> &vec) {
+    return vec.capacity() * sizeof(T);
+}
+
+template <typename K, typename V, typename H>
+size_t unordered_map_memsize(const std::unordered_map<K, V, H> &map) {
+    return map.bucket_count() * sizeof(void *) + map.size() * (sizeof(std::pair<const K, V>) + sizeof(void *));
+}
+
+inline size_t string_memsize(const std::string &str) {
+    // Short strings are stored inline
+    const char *data = str.data();
+    const char *self = reinterpret_cast<const char *>(&str);
+    if (data >= self && data < self + sizeof(std::string)) {
+        return 0;
+    }
+    return str.capacity() + 1;
+}
+
 struct Frame {
     VALUE frame;
     int line;
@@ -30,7 +70,7 @@ namespace std {
     {
         std::size_t operator()(Frame const& s) const noexcept
         {
-            return s.frame ^ s.line;
+            return mix_hash(s.frame * 0x9E3779B97F4A7C15ULL + s.line);
         }
     };
 }
@@ -89,7 +129,47 @@ class RawSample {
     }
 };
 
-struct FuncInfo {
+// Strings used by FuncInfo, each stored once. Many functions share a path
+// or class name.
+class StringTable {
+    std::unordered_map<std::string, int> to_idx;
+    std::vector<const std::string *> list;
+
+    public:
+
+    int index(const std::string &str) {
+        auto it = to_idx.find(str);
+        if (it != to_idx.end()) {
+            return it->second;
+        }
+
+        int idx = list.size();
+        auto result = to_idx.insert({str, idx});
+        // Keys of an unordered_map don't move, so the list can point at them
+        list.push_back(&result.first->first);
+        return idx;
+    }
+
+    const std::string &operator[](int i) const {
+        return *list[i];
+    }
+
+    size_t size() const {
+        return list.size();
+    }
+
+    size_t memsize() const {
+        size_t size = unordered_map_memsize(to_idx) + vector_memsize(list);
+        for (const auto &entry : to_idx) {
+            size += string_memsize(entry.first);
+        }
+        return size;
+    }
+};
+
+// The symbols for a function, resolved from its frame. Allocates, so must
+// be built with the GVL.
+struct FuncSymbols {
     static int first_lineno_int(VALUE frame) {
         VALUE first_lineno = rb_profile_frame_first_lineno(frame);
         return NIL_P(first_lineno) ? 0 : FIX2INT(first_lineno);
@@ -104,28 +184,22 @@ struct FuncInfo {
         }
     }
 
-    std::string full_label() const {
-        std::string output;
-        if (!method_name.empty()) {
-            output.append(classpath);
-            output.append(is_singleton ? "." : "#");
-            output.append(method_name);
-        } else {
-            output.append(label);
-        }
-        return output;
-    }
-
-    FuncInfo(VALUE frame) :
+    explicit FuncSymbols(VALUE frame) :
         label(convert_rstring(rb_profile_frame_label(frame))),
         base_label(convert_rstring(rb_profile_frame_base_label(frame))),
         classpath(convert_rstring(rb_profile_frame_classpath(frame))),
+        path(convert_rstring(rb_profile_frame_path(frame))),
         absolute_path(convert_rstring(rb_profile_frame_absolute_path(frame))),
         method_name(convert_rstring(rb_profile_frame_method_name(frame))),
-        path(convert_rstring(rb_profile_frame_path(frame))),
         first_lineno(first_lineno_int(frame)),
         is_singleton(RTEST(rb_profile_frame_singleton_method_p(frame)))
-    { }
+    {}
+
+    size_t memsize() const {
+        return string_memsize(label) + string_memsize(base_label) +
+            string_memsize(classpath) + string_memsize(path) +
+            string_memsize(absolute_path) + string_memsize(method_name);
+    }
 
     std::string label;
     std::string base_label;
@@ -137,10 +211,170 @@ struct FuncInfo {
     bool is_singleton;
 };
 
-template <typename K>
+struct FuncInfo {
+    std::string full_label(const StringTable &strings) const {
+        std::string output;
+        if (!strings[method_name].empty()) {
+            output.append(strings[classpath]);
+            output.append(is_singleton ? "." : "#");
+            output.append(strings[method_name]);
+        } else {
+            output.append(strings[label]);
+        }
+        return output;
+    }
+
+    FuncInfo(const FuncSymbols &symbols, StringTable &strings) :
+        label(strings.index(symbols.label)),
+        base_label(strings.index(symbols.base_label)),
+        classpath(strings.index(symbols.classpath)),
+        path(strings.index(symbols.path)),
+        absolute_path(strings.index(symbols.absolute_path)),
+        method_name(strings.index(symbols.method_name)),
+        first_lineno(symbols.first_lineno),
+        is_singleton(symbols.is_singleton)
+    {
+        name = strings.index(full_label(strings));
+        filename = strings[absolute_path].empty() ? path : absolute_path;
+    }
+
+    FuncInfo(VALUE frame, StringTable &strings) : FuncInfo(FuncSymbols(frame), strings) {}
+
+    // Ids in the StackTable's StringTable
+    int label;
+    int base_label;
+    int classpath;
+    int path;
+    int absolute_path;
+    int method_name;
+
+    // Derived from the above: the label shown for this function, and its
+    // absolute path if it has one or its path otherwise.
+    int name;
+    int filename;
+
+    int first_lineno;
+    bool is_singleton;
+};
+
+// Process-wide cache of resolved FuncSymbols keyed by frame, shared by every
+// StackTable so that repeated profiles of the same code don't resolve the
+// same functions again. Holds at most capacity entries and evicts with the
+// CLOCK algorithm. Cached frames are marked (movably), so an entry's frame
+// can't be freed and its address reused while it is cached.
+//
+// Only accessed with the GVL held.
+class SymbolCache {
+    struct Entry {
+        VALUE frame;
+        FuncSymbols symbols;
+        bool referenced;
+    };
+
+    std::vector<Entry> entries;
+    std::unordered_map<VALUE, size_t, ValueHash> index;
+    size_t capacity;
+    size_t hand = 0;
+
+    public:
+
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+
+    // The cache used by new lookups, or NULL when disabled
+    static SymbolCache *instance;
+
+    // Largest capacity accepted by SymbolCache.enable
+    static const size_t MAX_CAPACITY = 1 << 20;
+
+    // Entries are reserved up front for caches up to this size. Larger ones
+    // grow as they fill, so that memory isn't claimed for methods which may
+    // never be seen.
+    static const size_t MAX_RESERVE = 1 << 14;
+
+    SymbolCache(size_t capacity) : capacity(capacity) {
+        entries.reserve(capacity < MAX_RESERVE ? capacity : MAX_RESERVE);
+    }
+
+    FuncInfo lookup(VALUE frame, StringTable &strings) {
+        auto it = index.find(frame);
+        if (it != index.end()) {
+            hits++;
+            Entry &entry = entries[it->second];
+            entry.referenced = true;
+            return FuncInfo(entry.symbols, strings);
+        }
+
+        misses++;
+        FuncSymbols symbols(frame);
+        FuncInfo func_info(symbols, strings);
+        if (capacity > 0) {
+            insert(frame, std::move(symbols));
+        }
+        return func_info;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    size_t max_size() const {
+        return capacity;
+    }
+
+    void mark() {
+        for (auto &entry : entries) {
+            rb_gc_mark_movable(entry.frame);
+        }
+    }
+
+    void compact() {
+        index.clear();
+        for (size_t i = 0; i < entries.size(); i++) {
+            entries[i].frame = rb_gc_location(entries[i].frame);
+            index[entries[i].frame] = i;
+        }
+    }
+
+    size_t memsize() const {
+        size_t size = vector_memsize(entries) + unordered_map_memsize(index);
+        for (const auto &entry : entries) {
+            size += entry.symbols.memsize();
+        }
+        return size;
+    }
+
+    private:
+
+    void insert(VALUE frame, FuncSymbols &&symbols) {
+        if (entries.size() < capacity) {
+            index[frame] = entries.size();
+            entries.push_back(Entry{frame, std::move(symbols), false});
+            return;
+        }
+
+        // Sweep the hand past recently used entries, giving each a second
+        // chance, until one that hasn't been used since the last pass.
+        while (entries[hand].referenced) {
+            entries[hand].referenced = false;
+            hand = (hand + 1) % capacity;
+        }
+
+        Entry &victim = entries[hand];
+        index.erase(victim.frame);
+        evictions++;
+
+        victim = Entry{frame, std::move(symbols), false};
+        index[frame] = hand;
+        hand = (hand + 1) % capacity;
+    }
+};
+
+template <typename K, typename Hash = std::hash<K>>
 class IndexMap {
     public:
-        std::unordered_map<K, int> to_idx;
+        std::unordered_map<K, int, Hash> to_idx;
         std::vector<K> list;
 
         const K& operator[](int i) const noexcept {
@@ -168,52 +402,190 @@ class IndexMap {
             list.clear();
             to_idx.clear();
         }
+
+        size_t memsize() const {
+            return vector_memsize(list) + unordered_map_memsize(to_idx);
+        }
+
+        // Rebuilds the lookup table after keys in list were updated in place
+        void reindex() {
+            to_idx.clear();
+            for (int i = 0; i < list.size(); i++) {
+                to_idx.insert({list[i], i});
+            }
+        }
+};
+
+// Open-addressing hash table holding every edge of the stack trie, keyed by
+// (parent stack index, frame). Storing all edges in one contiguous table
+// avoids a separately allocated hash table per node and keeps lookups to a
+// few adjacent cache lines.
+class StackEdgeTable {
+    struct Edge {
+        VALUE frame;
+        int line;
+        int parent;
+        int child;
+    };
+
+    std::vector<Edge> edges;
+    size_t count = 0;
+    int shift = 64;
+
+    static uint64_t hash(int parent, Frame frame) {
+        uint64_t key = ((uint64_t)(uint32_t)frame.line << 32) | (uint32_t)parent;
+        uint64_t h = (uint64_t)frame.frame * 0x9E3779B97F4A7C15ULL;
+        h ^= key * 0xC2B2AE3D27D4EB4FULL;
+        return h ^ (h >> 29);
+    }
+
+    size_t slot(uint64_t h) const {
+        // Fibonacci hashing: take the top bits, which are the best mixed
+        return shift == 64 ? 0 : h >> shift;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Edge> old_edges;
+        old_edges.swap(edges);
+
+        edges.assign(capacity, Edge{0, 0, 0, -1});
+        shift = 64 - __builtin_ctzll(capacity);
+
+        size_t mask = capacity - 1;
+        for (const auto &edge : old_edges) {
+            if (edge.child < 0) continue;
+            size_t i = slot(hash(edge.parent, Frame{edge.frame, edge.line}));
+            while (edges[i].child >= 0) {
+                i = (i + 1) & mask;
+            }
+            edges[i] = edge;
+        }
+    }
+
+    public:
+
+    // Returns the child of parent for frame. If there is no such edge yet,
+    // records one pointing at new_child and returns new_child.
+    int find_or_insert(int parent, Frame frame, int new_child) {
+        // Keep the load factor under 2/3
+        if ((count + 1) * 3 > edges.size() * 2) {
+            rehash(edges.empty() ? 1024 : edges.size() * 2);
+        }
+
+        size_t mask = edges.size() - 1;
+        size_t i = slot(hash(parent, frame));
+        while (true) {
+            Edge &edge = edges[i];
+            if (edge.child < 0) {
+                edge = Edge{frame.frame, frame.line, parent, new_child};
+                count++;
+                return new_child;
+            }
+            if (edge.frame == frame.frame && edge.line == frame.line && edge.parent == parent) {
+                return edge.child;
+            }
+            i = (i + 1) & mask;
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t capacity() const {
+        return edges.size();
+    }
+
+    // Removes every edge and frees the table
+    void clear() {
+        std::vector<Edge>().swap(edges);
+        count = 0;
+        shift = 64;
+    }
+
+    size_t memsize() const {
+        return vector_memsize(edges);
+    }
+
+    // Updates frames moved by GC compaction. Their hashes change with them,
+    // so every edge is reinserted.
+    void update_references() {
+        if (edges.empty()) return;
+
+        for (auto &edge : edges) {
+            if (edge.child < 0) continue;
+            edge.frame = rb_gc_location(edge.frame);
+        }
+        rehash(edges.size());
+    }
+
+    // Walks the table and reports how far each edge sits from its home
+    // slot. A lookup for an edge takes (distance + 1) probes. For debugging
+    // only, this isn't tracked during profiling.
+    void probe_lengths(size_t &total, size_t &max) const {
+        total = 0;
+        max = 0;
+        size_t mask = edges.size() - 1;
+        for (size_t i = 0; i < edges.size(); i++) {
+            const Edge &edge = edges[i];
+            if (edge.child < 0) continue;
+            size_t home = slot(hash(edge.parent, Frame{edge.frame, edge.line}));
+            size_t probes = ((i - home) & mask) + 1;
+            total += probes;
+            if (probes > max) max = probes;
+        }
+    }
 };
 
 struct StackTable {
     private:
 
     IndexMap<Frame> frame_map;
-
-    IndexMap<VALUE> func_map;
     std::vector<FuncInfo> func_info_list;
 
+    StringTable strings;
+    // Ruby strings for ids in strings, created as they're needed
+    std::vector<VALUE> string_values;
+
     struct StackNode {
-        std::unordered_map<Frame, int> children;
         Frame frame;
         int parent;
         int index;
 
         StackNode(Frame frame, int index, int parent) : frame(frame), index(index), parent(parent) {}
-
-        // root
-        StackNode() : frame(Frame{0, 0}), index(-1), parent(-1) {}
     };
 
-    // This mutex guards the StackNodes only. The rest of the maps and vectors
-    // should be guarded by the GVL
+    // This mutex guards the StackNodes, their edges and func_map. The rest of
+    // the maps and vectors should be guarded by the GVL
     std::mutex stack_mutex;
 
-    StackNode root_stack_node;
+    // Every distinct frame VALUE referenced by a StackNode, in the order
+    // they were first seen. Doubles as the func table and as the set of
+    // objects to mark.
+    IndexMap<VALUE, ValueHash> func_map;
+
+    StackEdgeTable stack_edges;
     std::vector<StackNode> stack_node_list;
     int stack_node_list_finalized_idx = 0;
 
-    StackNode *next_stack_node(StackNode *node, Frame frame) {
-        auto search = node->children.find(frame);
-        if (search == node->children.end()) {
-            // insert a new node
-            int next_node_idx = stack_node_list.size();
-            node->children[frame] = next_node_idx;
+    // Copies the stack and frame tables, for use once the lock is released
+    void copy_tables(std::vector<int> &stack_parents, std::vector<int> &stack_frames,
+            std::vector<int> &frame_funcs, std::vector<int> &frame_lines);
+
+    // Returns the index of the child of parent_idx (-1 for the root) for
+    // frame, inserting a new node if needed.
+    int next_stack_index(int parent_idx, Frame frame) {
+        int next_node_idx = stack_node_list.size();
+        int node_idx = stack_edges.find_or_insert(parent_idx, frame, next_node_idx);
+        if (node_idx == next_node_idx) {
+            func_map.index(frame.frame);
             stack_node_list.emplace_back(
                     frame,
                     next_node_idx,
-                    node->index
+                    parent_idx
                     );
-            return &stack_node_list[next_node_idx];
-        } else {
-            int node_idx = search->second;
-            return &stack_node_list[node_idx];
         }
+        return node_idx;
     }
 
     public:
@@ -225,12 +597,12 @@ struct StackTable {
 
         const std::lock_guard<std::mutex> lock(stack_mutex);
 
-        StackNode *node = &root_stack_node;
+        int node_idx = -1;
         for (int i = 0; i < stack.size(); i++) {
             Frame frame = stack.frame(i);
-            node = next_stack_node(node, frame);
+            node_idx = next_stack_index(node_idx, frame);
         }
-        return node->index;
+        return node_idx;
     }
 
     int stack_parent(int stack_idx) {
@@ -259,44 +631,252 @@ struct StackTable {
             for (int i = stack_node_list_finalized_idx; i < stack_node_list.size(); i++) {
                 const auto &stack_node = stack_node_list[i];
                 frame_map.index(stack_node.frame);
-                func_map.index(stack_node.frame.frame);
-                stack_node_list_finalized_idx = i;
             }
+            stack_node_list_finalized_idx = stack_node_list.size();
         }
 
-        for (int i = func_info_list.size(); i < func_map.size(); i++) {
-            const auto &func = func_map[i];
+        symbolicate(SIZE_MAX);
+    }
+
+    // Builds FuncInfo for up to max_funcs functions which don't have one
+    // yet. Allocates, so must be called with the GVL. Returns whether any
+    // are left.
+    bool symbolicate(size_t max_funcs) {
+        for (size_t i = 0; i < max_funcs; i++) {
+            VALUE func;
+            {
+                const std::lock_guard<std::mutex> lock(stack_mutex);
+                if (func_info_list.size() >= func_map.size()) return false;
+                func = func_map[func_info_list.size()];
+            }
+
             // must not hold a mutex here
-            func_info_list.push_back(FuncInfo(func));
+            SymbolCache *cache = SymbolCache::instance;
+            func_info_list.push_back(cache ? cache->lookup(func, strings) : FuncInfo(func, strings));
+        }
+
+        const std::lock_guard<std::mutex> lock(stack_mutex);
+        return func_info_list.size() < func_map.size();
+    }
+
+    // Calls fn with the parent (-1 for roots), func index and line of each
+    // stack from index from on. Returns the number of stacks.
+    template <typename F>
+    int each_stack_from(int from, F fn) {
+        const std::lock_guard<std::mutex> lock(stack_mutex);
+        for (int i = from; i < stack_node_list.size(); i++) {
+            const StackNode &node = stack_node_list[i];
+            fn(node.parent, func_map.to_idx.find(node.frame.frame)->second, node.frame.line);
+        }
+        return stack_node_list.size();
+    }
+
+    // Calls fn with each string from id from on, returning the number of
+    // strings. Must be called with the GVL.
+    template <typename F>
+    int each_string_from(int from, F fn) const {
+        for (int i = from; i < strings.size(); i++) {
+            fn(strings[i]);
+        }
+        return strings.size();
+    }
+
+    // Calls fn with the name and filename (as ids in strings) and first line
+    // of each symbolicated func from index from on, returning the number
+    // symbolicated. Must be called with the GVL.
+    template <typename F>
+    int each_func_from(int from, F fn) const {
+        for (int i = from; i < func_info_list.size(); i++) {
+            const FuncInfo &info = func_info_list[i];
+            fn(info.name, info.filename, info.first_lineno);
         }
+        return func_info_list.size();
+    }
+
+    size_t memsize() {
+        size_t size = sizeof(StackTable);
+        {
+            const std::lock_guard<std::mutex> lock(stack_mutex);
+            size += stack_edges.memsize();
+            size += vector_memsize(stack_node_list);
+            size += func_map.memsize();
+        }
+
+        size += frame_map.memsize();
+        size += vector_memsize(func_info_list);
+        size += strings.memsize();
+        size += vector_memsize(string_values);
+        return size;
+    }
+
+    // Returns the Ruby string for an id in strings. Each is only created
+    // once per table.
+    VALUE string_value(int id) {
+        if (id >= string_values.size()) {
+            string_values.resize(strings.size(), Qnil);
+        }
+
+        VALUE value = string_values[id];
+        if (NIL_P(value)) {
+            const std::string &str = strings[id];
+
+            // Ruby constants are in an arbitrary (ASCII compatible) encoding
+            // and method names are in an arbitrary (ASCII compatible)
+            // encoding. These can be mixed in the same program. Technically
+            // filesystems are binary and then Ruby interprets that as
+            // default_external encoding.
+            //
+            // However, by this point we've lost the chain of what the
+            // correct encoding should be. Oops!
+            //
+            // Instead we'll just guess at UTF-8 which should satisfy most. It
+            // won't necessarily be valid but that can be scrubbed on the Ruby
+            // side.
+            //
+            // In the future we might keep class and method name separate for
+            // longer, preserve encodings, and defer formatting to the Ruby
+            // side.
+            value = rb_enc_interned_str(str.c_str(), str.length(), rb_utf8_encoding());
+            string_values[id] = value;
+        }
+        return value;
     }
 
     void mark_frames() {
+        for (VALUE value : string_values) {
+            rb_gc_mark_movable(value);
+        }
+
         const std::lock_guard<std::mutex> lock(stack_mutex);
 
-        for (auto stack_node: stack_node_list) {
-            rb_gc_mark(stack_node.frame.frame);
+        for (VALUE frame : func_map.list) {
+            rb_gc_mark_movable(frame);
         }
     }
 
-    StackNode *convert_stack(StackTable &other, int original_idx) {
-        if (original_idx < 0) {
-            return &root_stack_node;
+    void compact_frames() {
+        for (auto &value : string_values) {
+            value = rb_gc_location(value);
+        }
+
+        const std::lock_guard<std::mutex> lock(stack_mutex);
+
+        for (auto &frame : func_map.list) {
+            frame = rb_gc_location(frame);
+        }
+        func_map.reindex();
+
+        for (auto &frame : frame_map.list) {
+            frame.frame = rb_gc_location(frame.frame);
         }
+        frame_map.reindex();
+
+        for (auto &stack_node : stack_node_list) {
+            stack_node.frame.frame = rb_gc_location(stack_node.frame.frame);
+        }
+        stack_edges.update_references();
+    }
+
+    // Removes every stack which isn't marked in used, or an ancestor of one
+    // which is, and renumbers the rest keeping their order. Frames and funcs
+    // are kept. Returns the new index of each old one, or -1 if it was
+    // removed. Must be called with stack_mutex held, and the caller must
+    // remap any stack indexes held elsewhere.
+    std::vector<int> retain_stacks_locked(std::vector<bool> &used) {
+        used.resize(stack_node_list.size(), false);
+
+        // Parents always come before their children
+        for (int i = (int)stack_node_list.size() - 1; i >= 0; i--) {
+            int parent = stack_node_list[i].parent;
+            if (used[i] && parent >= 0) {
+                used[parent] = true;
+            }
+        }
+
+        std::vector<StackNode> old_nodes;
+        old_nodes.swap(stack_node_list);
+        stack_edges.clear();
+
+        std::vector<int> remap(old_nodes.size(), -1);
+        int finalized_idx = 0;
+        for (int i = 0; i < old_nodes.size(); i++) {
+            if (!used[i]) continue;
+
+            const StackNode &node = old_nodes[i];
+            int parent = node.parent < 0 ? -1 : remap[node.parent];
+            int idx = stack_node_list.size();
+            stack_edges.find_or_insert(parent, node.frame, idx);
+            stack_node_list.emplace_back(node.frame, idx, parent);
+            remap[i] = idx;
+
+            if (i < stack_node_list_finalized_idx) {
+                finalized_idx = idx + 1;
+            }
+        }
+        stack_node_list_finalized_idx = finalized_idx;
+        stack_node_list.shrink_to_fit();
+
+        return remap;
+    }
 
-        StackNode &original_node = other.stack_node_list[original_idx];
-        StackNode *parent_node = convert_stack(other, original_node.parent);
-        StackNode *node = next_stack_node(parent_node, original_node.frame);
+    int convert_stack(StackTable &other, int original_idx) {
+        if (original_idx < 0) {
+            return -1;
+        }
 
-        return node;
+        const StackNode &original_node = other.stack_node_list[original_idx];
+        int parent_idx = convert_stack(other, original_node.parent);
+        return next_stack_index(parent_idx, original_node.frame);
     }
 
+    // A copy of the tables which can be read without the GVL, for
+    // exporters. Stack parents are -1 for roots.
+    struct Snapshot {
+        std::vector<int> stack_parents;
+        std::vector<int> stack_frames;
+        std::vector<int> frame_funcs;
+        std::vector<int> frame_lines;
+        std::vector<std::string> func_names;
+        std::vector<std::string> func_filenames;
+        std::vector<int> func_first_linenos;
+    };
+
+    // Symbolicates any new funcs, so must be called with the GVL
+    Snapshot snapshot();
+
     static VALUE stack_table_new();
+    // Like convert_stack, but remembers every node converted in memo
+    // (indexed by the other table's stack index, -1 if not yet converted)
+    // so that prefixes shared between stacks are only converted once. path
+    // is scratch space.
+    int convert_stack_memo(StackTable &other, int original_idx, std::vector<int> &memo, std::vector<int> &path) {
+        // Collect the part of the stack not converted yet, leaf first
+        path.clear();
+        int idx = original_idx;
+        while (idx >= 0 && memo[idx] < 0) {
+            path.push_back(idx);
+            idx = other.stack_node_list[idx].parent;
+        }
+
+        int node_idx = idx < 0 ? -1 : memo[idx];
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            node_idx = next_stack_index(node_idx, other.stack_node_list[*it].frame);
+            memo[*it] = node_idx;
+        }
+        return node_idx;
+    }
+
     static VALUE stack_table_convert(VALUE self, VALUE other, VALUE original_stack);
+    static VALUE stack_table_convert_many(VALUE self, VALUE other, VALUE original_stacks);
 
     static VALUE stack_table_stack_count(VALUE self);
     static VALUE stack_table_frame_count(VALUE self);
     static VALUE stack_table_func_count(VALUE self);
+    static VALUE stack_table_hash_stats(VALUE self);
+    static VALUE stack_table_to_h(VALUE self);
+    static VALUE stack_table_packed_tables(VALUE self);
+    static VALUE stack_table_func_string_table(VALUE self);
+    static VALUE stack_table_folded(VALUE self, VALUE threads);
 
     static VALUE stack_table_frame_line_no(VALUE self, VALUE idxval);
     static VALUE stack_table_frame_func_idx(VALUE self, VALUE idxval);
@@ -311,4 +891,75 @@ struct StackTable {
 
 StackTable *get_stack_table(VALUE obj);
 
+// Reads a string of little-endian int32s, as Array#pack("l<*") writes
+inline std::vector<int> unpack_int32s(VALUE str) {
+    StringValue(str);
+    long count = RSTRING_LEN(str) / 4;
+    const unsigned char *p = (const unsigned char *)RSTRING_PTR(str);
+    std::vector<int> values(count);
+    for (long i = 0; i < count; i++, p += 4) {
+        values[i] = (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+    return values;
+}
+
+inline VALUE pack_int32s(const std::vector<int> &values) {
+    std::string buf;
+    buf.reserve(values.size() * 4);
+    for (int value : values) {
+        for (size_t i = 0; i < 4; i++) {
+            buf.push_back((char)((uint32_t)value >> (8 * i)));
+        }
+    }
+    return rb_str_new(buf.data(), buf.size());
+}
+
+// Calls fn with each stack index and weight of the samples in threads, an
+// array of [samples, weights] pairs. Each pair is either arrays or packed as
+// little-endian int32 and uint32 strings.
+template <typename F>
+void each_weighted_sample(VALUE threads, F fn) {
+    Check_Type(threads, T_ARRAY);
+    for (long t = 0; t < RARRAY_LEN(threads); t++) {
+        VALUE thread = RARRAY_AREF(threads, t);
+        Check_Type(thread, T_ARRAY);
+        VALUE samples = rb_ary_entry(thread, 0);
+        VALUE weights = rb_ary_entry(thread, 1);
+
+        if (RB_TYPE_P(samples, T_STRING)) {
+            StringValue(weights);
+            long count = RSTRING_LEN(samples) / 4;
+            if (RSTRING_LEN(weights) / 4 != count) {
+                rb_raise(rb_eArgError, "samples and weights differ in length");
+            }
+            const unsigned char *stacks = (const unsigned char *)RSTRING_PTR(samples);
+            const unsigned char *stack_weights = (const unsigned char *)RSTRING_PTR(weights);
+            for (long i = 0; i < count; i++) {
+                const unsigned char *s = stacks + i * 4, *w = stack_weights + i * 4;
+                uint32_t stack = (uint32_t)s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+                uint32_t weight = (uint32_t)w[0] | (uint32_t)w[1] << 8 | (uint32_t)w[2] << 16 | (uint32_t)w[3] << 24;
+                fn((int32_t)stack, (int64_t)weight);
+            }
+        } else {
+            Check_Type(samples, T_ARRAY);
+            Check_Type(weights, T_ARRAY);
+            if (RARRAY_LEN(weights) != RARRAY_LEN(samples)) {
+                rb_raise(rb_eArgError, "samples and weights differ in length");
+            }
+            for (long i = 0; i < RARRAY_LEN(samples); i++) {
+                fn(NUM2INT(RARRAY_AREF(samples, i)), (int64_t)NUM2LL(RARRAY_AREF(weights, i)));
+            }
+        }
+    }
+}
+
+// Returns "folded" stacks: a line per distinct stack of func names, root
+// first and joined by ";", followed by a space and its total weight. Stacks
+// which only differ by line fold together, so output is sized by the
+// distinct stacks of funcs rather than by samples. Stacks must come after
+// their parents.
+std::string fold_stacks(const std::vector<int> &stack_parents, const std::vector<int> &stack_frames,
+        const std::vector<int> &frame_funcs, std::vector<std::string> func_names,
+        const std::vector<int64_t> &stack_weights);
+
 #endif
@@ -33,6 +33,14 @@
 # define PTR2NUM(x)   (rb_int2inum((intptr_t)(void *)(x)))
 #endif
 
+#if defined(HAVE_TIMER_CREATE) && defined(HAVE_CONST_SIGEV_THREAD_ID)
+#define HAVE_CPU_TIMERS 1
+// Older glibc doesn't provide this alias
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
 // Internal TracePoint events we'll monitor during profiling
 #define RUBY_INTERNAL_EVENTS \
   RUBY_INTERNAL_EVENT_GC_START | \
@@ -53,6 +61,7 @@ static VALUE rb_cVernierResult;
 static VALUE rb_mVernierMarkerType;
 static VALUE rb_cVernierCollector;
 static VALUE rb_cTimeCollector;
+static VALUE rb_cStreamFile;
 
 static VALUE sym_state, sym_gc_by, sym_fiber_id;
 
@@ -72,38 +81,14 @@ static const char *gvl_event_name(rb_event_flag_t event) {
     return "no-event";
 }
 
-// Based very loosely on the design of Gecko's SigHandlerCoordinator
-// This is used for communication between the profiler thread and the signal
-// handlers in the observed thread.
-struct LiveSample {
-    RawSample sample;
-
-    SignalSafeSemaphore sem_complete;
-
-    // Wait for a sample to be collected by the signal handler on another thread
-    void wait() {
-        sem_complete.wait();
-    }
-
-    int size() const {
-        return sample.size();
-    }
-
-    Frame frame(int i) const {
-        return sample.frame(i);
-    }
-
-    // Called from a signal handler in the observed thread in order to take a
-    // sample and signal to the proifiler thread that the sample is ready.
-    //
-    // CRuby doesn't guarantee that rb_profile_frames can be used as
-    // async-signal-safe but in practice it seems to be.
-    // sem_post is safe in an async-signal-safe context.
-    void sample_current_thread() {
-        sample.sample();
-        sem_complete.post();
+// Appends value to buf as little-endian bytes, for the binary strings
+// Result unpacks with String#unpack
+template <typename T>
+static void pack_le(std::string &buf, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        buf.push_back((char)((uint64_t)value >> (8 * i)));
     }
-};
+}
 
 class SampleTranslator {
     public:
@@ -116,7 +101,29 @@ class SampleTranslator {
         SampleTranslator() : len(0), last_stack_index(-1) {
         }
 
-        int translate(StackTable &frame_list, const RawSample &sample) {
+        // Forgets the cached prefix. Needed after GC compaction, since the
+        // cached frames may have moved, and after the StackTable is
+        // renumbered.
+        void clear() {
+            len = 0;
+            last_stack_index = -1;
+        }
+
+        // Takes the lock translate_locked expects, for translating several
+        // samples at once.
+        static std::unique_lock<std::mutex> lock(StackTable &frame_list) {
+            return std::unique_lock<std::mutex>(frame_list.stack_mutex);
+        }
+
+        template <typename Sample>
+        int translate(StackTable &frame_list, const Sample &sample) {
+            const auto guard = lock(frame_list);
+            return translate_locked(frame_list, sample);
+        }
+
+        // Must be called with the StackTable's lock held
+        template <typename Sample>
+        int translate_locked(StackTable &frame_list, const Sample &sample) {
             int i = 0;
             for (; i < len && i < sample.size(); i++) {
                 if (frames[i] != sample.frame(i)) {
@@ -124,19 +131,18 @@ class SampleTranslator {
                 }
             }
 
-            const std::lock_guard<std::mutex> lock(frame_list.stack_mutex);
-            StackTable::StackNode *node = i == 0 ? &frame_list.root_stack_node : &frame_list.stack_node_list[frame_indexes[i - 1]];
+            int node_idx = i == 0 ? -1 : frame_indexes[i - 1];
 
             for (; i < sample.size(); i++) {
                 Frame frame = sample.frame(i);
-                node = frame_list.next_stack_node(node, frame);
+                node_idx = frame_list.next_stack_index(node_idx, frame);
 
                 frames[i] = frame;
-                frame_indexes[i] = node->index;
+                frame_indexes[i] = node_idx;
             }
             len = i;
 
-            last_stack_index = node->index;
+            last_stack_index = node_idx;
             return last_stack_index;
         }
 };
@@ -212,36 +218,60 @@ class Marker {
 
     MarkerInfo extra_info;
 
-    VALUE to_array() const {
-        VALUE record[6] = {0};
-        record[0] = INT2NUM(type);
-        record[1] = INT2NUM(phase);
-        record[2] = ULL2NUM(timestamp.nanoseconds());
-
-        if (phase == Marker::Phase::INTERVAL) {
-            record[3] = ULL2NUM(finish.nanoseconds());
-        }
-        else {
-            record[3] = Qnil;
-        }
-        record[4] = stack_index == -1 ? Qnil : INT2NUM(stack_index);
+    // Appends the marker's type, phase, timestamp, finish (-1 unless it's
+    // an interval) and stack index (-1 for none) to a PackedMarkers buffer
+    void pack(std::string &buf) const {
+        pack_le<int32_t>(buf, type);
+        pack_le<int32_t>(buf, phase);
+        pack_le<int64_t>(buf, timestamp.nanoseconds());
+        pack_le<int64_t>(buf, phase == Marker::Phase::INTERVAL ? (int64_t)finish.nanoseconds() : -1);
+        pack_le<int32_t>(buf, stack_index);
+    }
 
+    VALUE extra_info_hash() const {
         if (type == Marker::MARKER_GC_PAUSE) {
             VALUE hash = rb_hash_new();
-            record[5] = hash;
-
             rb_hash_aset(hash, sym_gc_by, extra_info.gc_data.gc_by);
             rb_hash_aset(hash, sym_state, extra_info.gc_data.gc_state);
+            return hash;
         } else if (type == Marker::MARKER_FIBER_SWITCH) {
             VALUE hash = rb_hash_new();
-            record[5] = hash;
-
             rb_hash_aset(hash, sym_fiber_id, extra_info.fiber_data.fiber_id);
+            return hash;
         }
-        return rb_ary_new_from_values(6, record);
+        return Qnil;
     }
 };
 
+// Markers handed to Result packed as Marker::pack records in a binary
+// string under :markers, with any extra info at the same index of the
+// :marker_info array. Result unpacks them when they're first needed.
+class PackedMarkers {
+    std::string bytes;
+    VALUE info;
+    long count = 0;
+
+    public:
+        // Stores the info array in hash right away, so that it's kept
+        // alive while markers are added
+        PackedMarkers(VALUE hash) : info(rb_ary_new()) {
+            rb_hash_aset(hash, sym("marker_info"), info);
+        }
+
+        void push(const Marker &marker) {
+            marker.pack(bytes);
+            VALUE extra_info = marker.extra_info_hash();
+            if (!NIL_P(extra_info)) {
+                rb_ary_store(info, count, extra_info);
+            }
+            count++;
+        }
+
+        void write(VALUE hash) const {
+            rb_hash_aset(hash, sym("markers"), rb_str_new(bytes.data(), bytes.size()));
+        }
+};
+
 class MarkerTable {
     public:
         std::mutex mutex;
@@ -259,12 +289,58 @@ class MarkerTable {
             list.push_back({ type, Marker::INSTANT, TimeStamp::Now(), TimeStamp(), stack_index, extra_info });
         }
 
-        VALUE to_array() const {
-            VALUE ary = rb_ary_new();
+        size_t memsize() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return vector_memsize(list);
+        }
+
+        // Drops markers which ended before time
+        void discard_before(TimeStamp time) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            list.erase(std::remove_if(list.begin(), list.end(), [&](const Marker &marker) {
+                TimeStamp end = marker.phase == Marker::INTERVAL ? marker.finish : marker.timestamp;
+                return end < time;
+            }), list.end());
+        }
+
+        // Calls fn with each marker's stack index
+        template <typename F>
+        void each_stack_index(F fn) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &marker : list) {
+                if (marker.stack_index >= 0) {
+                    fn(marker.stack_index);
+                }
+            }
+        }
+
+        // Calls fn with a reference to each marker's stack index, so that
+        // it can be updated
+        template <typename F>
+        void update_stack_indexes(F fn) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (auto &marker : list) {
+                if (marker.stack_index >= 0) {
+                    fn(marker.stack_index);
+                }
+            }
+        }
+
+        // Moves markers out to taken, except those with extra info, which
+        // holds Ruby objects
+        void take_plain(std::vector<Marker> &taken) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            auto plain = std::stable_partition(list.begin(), list.end(), [](const Marker &marker) {
+                return marker.type == Marker::MARKER_GC_PAUSE || marker.type == Marker::MARKER_FIBER_SWITCH;
+            });
+            taken.assign(plain, list.end());
+            list.erase(plain, list.end());
+        }
+
+        void write_result(PackedMarkers &packed) const {
             for (auto& marker: list) {
-                rb_ary_push(ary, marker.to_array());
+                packed.push(marker);
             }
-            return ary;
         }
 };
 
@@ -330,90 +406,1305 @@ class ObjectSampleList {
             weights.push_back(1);
         }
 
+        // Drops samples taken before time. Samples are recorded in order.
+        void discard_before(TimeStamp time) {
+            size_t n = std::lower_bound(timestamps.begin(), timestamps.end(), time) - timestamps.begin();
+            stacks.erase(stacks.begin(), stacks.begin() + n);
+            timestamps.erase(timestamps.begin(), timestamps.begin() + n);
+            weights.erase(weights.begin(), weights.begin() + n);
+        }
+
+        // Removes every sample from the list, calling fn with each one's
+        // stack index, timestamp and weight in order
+        template <typename F>
+        void take(F fn) {
+            for (size_t i = 0; i < stacks.size(); i++) {
+                fn(stacks[i], timestamps[i], weights[i]);
+            }
+            stacks.clear();
+            timestamps.clear();
+            weights.clear();
+        }
+
+        size_t memsize() const {
+            return vector_memsize(stacks) + vector_memsize(timestamps) + vector_memsize(weights);
+        }
+
+        // Packs the samples into result's :allocations like SampleList's
         void write_result(VALUE result) const {
+            std::string packed_stacks, packed_weights, packed_timestamps;
+            for (auto& stack_index: this->stacks) {
+                pack_le<int32_t>(packed_stacks, stack_index);
+            }
+            for (auto& weight: this->weights) {
+                pack_le<uint32_t>(packed_weights, weight);
+            }
+            for (auto& timestamp: this->timestamps) {
+                pack_le<uint64_t>(packed_timestamps, timestamp.nanoseconds());
+            }
+
             VALUE allocations = rb_hash_new();
             rb_hash_aset(result, sym("allocations"), allocations);
+            rb_hash_aset(allocations, sym("samples"), rb_str_new(packed_stacks.data(), packed_stacks.size()));
+            rb_hash_aset(allocations, sym("weights"), rb_str_new(packed_weights.data(), packed_weights.size()));
+            rb_hash_aset(allocations, sym("timestamps"), rb_str_new(packed_timestamps.data(), packed_timestamps.size()));
+        }
+};
 
-            VALUE samples = rb_ary_new();
-            rb_hash_aset(allocations, sym("samples"), samples);
-            for (auto& stack_index: this->stacks) {
-                rb_ary_push(samples, INT2NUM(stack_index));
+// Bytes appended in fixed size chunks, so that growing never reallocates
+// and copies what's already been written.
+class ChunkedBytes {
+    static const size_t CHUNK_SIZE = 4096;
+
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+    size_t length = 0;
+
+    public:
+        void push_back(uint8_t byte) {
+            if (length == chunks.size() * CHUNK_SIZE) {
+                chunks.emplace_back(new uint8_t[CHUNK_SIZE]);
             }
+            chunks[length / CHUNK_SIZE][length % CHUNK_SIZE] = byte;
+            length++;
+        }
 
-            VALUE weights = rb_ary_new();
-            rb_hash_aset(allocations, sym("weights"), weights);
-            for (auto& weight: this->weights) {
-                rb_ary_push(weights, INT2NUM(weight));
+        // LEB128: 7 bits per byte, low bits first, high bit set on all but
+        // the last byte
+        void push_varint(uint64_t value) {
+            while (value >= 0x80) {
+                push_back((value & 0x7f) | 0x80);
+                value >>= 7;
             }
+            push_back(value);
+        }
 
-            VALUE timestamps = rb_ary_new();
-            rb_hash_aset(allocations, sym("timestamps"), timestamps);
-            for (auto& timestamp: this->timestamps) {
-                rb_ary_push(timestamps, ULL2NUM(timestamp.nanoseconds()));
+        uint8_t operator[](size_t i) const {
+            return chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        size_t memsize() const {
+            return vector_memsize(chunks) + chunks.size() * CHUNK_SIZE;
+        }
+
+        // Empties the buffer, keeping its chunks to be reused
+        void clear() {
+            length = 0;
+        }
+
+        void append(const ChunkedBytes &other) {
+            for (size_t i = 0; i < other.size(); i++) {
+                push_back(other[i]);
+            }
+        }
+
+        void append(const std::string &str) {
+            for (char c : str) {
+                push_back(c);
             }
         }
+
+        // Returns false if writing failed, with errno set
+        bool write(FILE *file) const {
+            for (size_t offset = 0; offset < length; offset += CHUNK_SIZE) {
+                size_t len = length - offset;
+                if (len > CHUNK_SIZE) len = CHUNK_SIZE;
+                if (fwrite(chunks[offset / CHUNK_SIZE].get(), 1, len, file) != len) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        class Reader {
+            const ChunkedBytes &bytes;
+            size_t pos = 0;
+
+            public:
+                Reader(const ChunkedBytes &bytes) : bytes(bytes) {}
+
+                bool done() const {
+                    return pos >= bytes.size();
+                }
+
+                uint64_t varint() {
+                    uint64_t value = 0;
+                    for (int shift = 0; ; shift += 7) {
+                        uint8_t byte = bytes[pos++];
+                        value |= (uint64_t)(byte & 0x7f) << shift;
+                        if (!(byte & 0x80)) return value;
+                    }
+                }
+        };
 };
 
+// Samples for one thread, stored compactly since a long profile can hold
+// millions of them. Each is encoded as three varints: the stack index, the
+// (zigzag) difference from the previous sample's timestamp, and the weight
+// shifted left two bits with the category in the low bits. That's usually
+// 6-7 bytes rather than 20 for separate vectors.
+//
+// The last sample is kept decoded, since its weight is incremented when the
+// next sample has the same stack.
 class SampleList {
     public:
+        struct Sample {
+            int stack_index;
+            TimeStamp timestamp;
+            Category category;
+            int weight;
+        };
 
-        std::vector<int> stacks;
-        std::vector<TimeStamp> timestamps;
-        std::vector<Category> categories;
-        std::vector<int> weights;
+    private:
+        ChunkedBytes encoded;
+        size_t encoded_count = 0;
+        uint64_t last_encoded_ns = 0;
 
-        size_t size() {
-            return stacks.size();
+        Sample last;
+        bool has_last = false;
+
+        void encode(const Sample &sample) {
+            encode(encoded, last_encoded_ns, sample);
+            encoded_count++;
         }
 
-        bool empty() {
+    public:
+        // Appends sample to out, with its timestamp relative to the
+        // previous one encoded in last_ns
+        template <typename Writer>
+        static void encode(Writer &out, uint64_t &last_ns, const Sample &sample) {
+            uint64_t ns = sample.timestamp.nanoseconds();
+            int64_t delta = (int64_t)(ns - last_ns);
+            last_ns = ns;
+
+            out.push_varint(sample.stack_index);
+            out.push_varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            out.push_varint(((uint64_t)sample.weight << 2) | sample.category);
+        }
+
+        size_t size() const {
+            return encoded_count + has_last;
+        }
+
+        bool empty() const {
             return size() == 0;
         }
 
-        void record_sample(int stack_index, TimeStamp time, Category category) {
+        void record_sample(int stack_index, TimeStamp time, Category category, int weight = 1) {
           // FIXME: probably better to avoid generating -1 higher up.
           // Currently this happens when we measure an empty stack. Ideally we would have a better representation
           if (stack_index < 0)
             return;
 
-          if (!empty() && stacks.back() == stack_index &&
-              categories.back() == category) {
+          if (has_last && last.stack_index == stack_index &&
+              last.category == category) {
             // We don't compare timestamps for de-duplication
-            weights.back() += 1;
+            last.weight += weight;
             } else {
-                stacks.push_back(stack_index);
-                timestamps.push_back(time);
-                categories.push_back(category);
-                weights.push_back(1);
+                if (has_last) {
+                    encode(last);
+                }
+                last = Sample{stack_index, time, category, weight};
+                has_last = true;
+            }
+        }
+
+        // Decodes samples written with encode() from reader until done
+        template <typename Reader, typename F>
+        static void decode(Reader &reader, F fn) {
+            uint64_t ns = 0;
+            while (!reader.done()) {
+                Sample sample;
+                sample.stack_index = reader.varint();
+                uint64_t zigzag = reader.varint();
+                ns += (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+                sample.timestamp = TimeStamp::from_nanoseconds(ns);
+                uint64_t weight_category = reader.varint();
+                sample.category = (Category)(weight_category & 3);
+                sample.weight = weight_category >> 2;
+                fn(sample);
+            }
+        }
+
+        // Calls fn with each sample in order
+        template <typename F>
+        void each(F fn) const {
+            ChunkedBytes::Reader reader(encoded);
+            decode(reader, fn);
+            if (has_last) {
+                fn(last);
+            }
+        }
+
+        // Removes samples from the list, calling fn with each in order. The
+        // last sample is kept unless all is set, since its weight may still
+        // grow.
+        template <typename F>
+        void take(F fn, bool all = false) {
+            SampleList old;
+            std::swap(*this, old);
+            ChunkedBytes::Reader reader(old.encoded);
+            decode(reader, fn);
+            if (old.has_last) {
+                if (all) {
+                    fn(old.last);
+                } else {
+                    last = old.last;
+                    has_last = true;
+                }
+            }
+        }
+
+        // Re-records every sample fn returns true for, after fn has had a
+        // chance to update it
+        template <typename F>
+        void rewrite(F fn) {
+            SampleList old;
+            std::swap(*this, old);
+            old.each([&](const Sample &sample) {
+                Sample updated = sample;
+                if (fn(updated)) {
+                    record_sample(updated.stack_index, updated.timestamp, updated.category, updated.weight);
+                }
+            });
+        }
+
+        // Drops samples taken before time
+        void discard_before(TimeStamp time) {
+            rewrite([&](Sample &sample) {
+                return sample.timestamp >= time;
+            });
+        }
+
+        // Calls fn with each sample's stack index
+        template <typename F>
+        void each_stack_index(F fn) const {
+            each([&](const Sample &sample) {
+                fn(sample.stack_index);
+            });
+        }
+
+        // Calls fn with a reference to each sample's stack index, so that it
+        // can be updated. Re-encodes every sample.
+        template <typename F>
+        void update_stack_indexes(F fn) {
+            rewrite([&](Sample &sample) {
+                fn(sample.stack_index);
+                return true;
+            });
+        }
+
+        size_t memsize() const {
+            return encoded.memsize();
+        }
+
+        // Samples packed for Result as little-endian strings of int32
+        // stack indexes, uint32 weights, uint64 timestamps and uint8
+        // categories, which it unpacks when they're first needed
+        struct Packed {
+            std::string samples, weights, timestamps, sample_categories;
+
+            void push(const Sample &sample) {
+                pack_le<int32_t>(samples, sample.stack_index);
+                pack_le<uint32_t>(weights, sample.weight);
+                pack_le<uint64_t>(timestamps, sample.timestamp.nanoseconds());
+                pack_le<uint8_t>(sample_categories, sample.category);
+            }
+
+            void write(VALUE hash) const {
+                rb_hash_aset(hash, sym("samples"), rb_str_new(samples.data(), samples.size()));
+                rb_hash_aset(hash, sym("weights"), rb_str_new(weights.data(), weights.size()));
+                rb_hash_aset(hash, sym("timestamps"), rb_str_new(timestamps.data(), timestamps.size()));
+                rb_hash_aset(hash, sym("sample_categories"), rb_str_new(sample_categories.data(), sample_categories.size()));
+            }
+        };
+
+        // Appends to packed, which may already hold earlier samples
+        void write_result(Packed &packed) const {
+            each([&](const Sample &sample) {
+                packed.push(sample);
+            });
+        }
+};
+
+// Append-only file a TimeCollector writes a profile to while it runs when
+// given a stream path, so that a long profile doesn't keep its samples and
+// markers in memory, and so that a profile of a process which never stops
+// profiling can still be read. After the magic, it's a series of records:
+// a tag byte, the varint length of the rest of the record, then varints:
+//
+//   'H' started_at, interval (µs), allocation_interval and 1 in cpu mode
+//   'N' thread, tid, started_at, Ruby object id and flags (THREAD_*)
+//   'K' first stack, then each stack's parent + 1, func and line
+//   'T' first string, then each string's length and bytes
+//   'U' first func, then each func's name, filename (as strings) and first
+//       line
+//   'S' thread, then samples encoded as in SampleList
+//   'A' thread, then allocation samples encoded as in SampleList
+//   'M' thread, then each marker's type, phase, timestamp, finish and stack
+//       index + 1
+//   'F' thread count, then each thread's tid, started_at and stopped_at
+//
+// Threads are numbered by their position in the ThreadTable, and stacks,
+// strings and funcs as in the collector's StackTable. Each is written once,
+// on the first flush after it's seen, except that funcs wait until they've
+// been symbolicated. The footer ('F') is written last, at stop, so a file
+// without one was cut short.
+class SampleStream {
+    public:
+        static constexpr const char *MAGIC = "VERNIER-STREAM-1";
+        static const size_t MAGIC_LEN = 16;
+
+        enum ThreadFlags {
+            THREAD_MAIN = 1,
+            THREAD_START = 2,
+        };
+
+        std::string path;
+
+        // Records waiting to be written by flush
+        ChunkedBytes buffer;
+
+    private:
+        FILE *file;
+        int error = 0;
+
+        // The record being built
+        ChunkedBytes record;
+
+        // How much of each table has been written
+        size_t thread_count = 0;
+        int stack_count = 0;
+        int string_count = 0;
+        int func_count = 0;
+
+        // Moves the record built so far to buffer if keep is set, or
+        // drops it
+        void finish_record(char tag, bool keep) {
+            if (keep) {
+                buffer.push_back(tag);
+                buffer.push_varint(record.size());
+                buffer.append(record);
+            }
+            record.clear();
+        }
+
+    public:
+        // Takes ownership of file, opened for writing path
+        SampleStream(FILE *file, std::string path) : path(path), file(file) {
+            if (fwrite(MAGIC, 1, MAGIC_LEN, file) != MAGIC_LEN) {
+                error = errno;
+            }
+        }
+
+        ~SampleStream() {
+            if (file) fclose(file);
+        }
+
+        void add_header(TimeStamp started_at, TimeStamp interval, unsigned int allocation_interval, bool cpu_mode) {
+            record.push_varint(started_at.nanoseconds());
+            record.push_varint(interval.microseconds());
+            record.push_varint(allocation_interval);
+            record.push_varint(cpu_mode);
+            finish_record('H', true);
+        }
+
+        // Threads written so far. The next one added is numbered this.
+        size_t threads_added() const {
+            return thread_count;
+        }
+
+        void add_thread(native_thread_id_t tid, TimeStamp started_at, VALUE ruby_thread_id, int flags) {
+            record.push_varint(thread_count++);
+            record.push_varint(tid);
+            record.push_varint(started_at.nanoseconds());
+            // Object ids are Fixnums, which don't need the GVL to read
+            record.push_varint(FIXNUM_P(ruby_thread_id) ? FIX2ULONG(ruby_thread_id) : 0);
+            record.push_varint(flags);
+            finish_record('N', true);
+        }
+
+        void add_stacks(StackTable &stack_table) {
+            int first = stack_count;
+            record.push_varint(first);
+            stack_count = stack_table.each_stack_from(first, [&](int parent, int func, int line) {
+                record.push_varint(parent + 1);
+                record.push_varint(func);
+                record.push_varint((uint32_t)line);
+            });
+            finish_record('K', stack_count > first);
+        }
+
+        // Adds funcs symbolicated since the last call, and the strings
+        // they use. Must be called with the GVL.
+        void add_funcs(const StackTable &stack_table) {
+            int first = string_count;
+            record.push_varint(first);
+            string_count = stack_table.each_string_from(first, [&](const std::string &str) {
+                record.push_varint(str.size());
+                record.append(str);
+            });
+            finish_record('T', string_count > first);
+
+            first = func_count;
+            record.push_varint(first);
+            func_count = stack_table.each_func_from(first, [&](int name, int filename, int first_lineno) {
+                record.push_varint(name);
+                record.push_varint(filename);
+                record.push_varint((uint32_t)first_lineno);
+            });
+            finish_record('U', func_count > first);
+        }
+
+        void add_samples(int thread_serial, SampleList &samples, bool all) {
+            size_t count = 0;
+            uint64_t last_ns = 0;
+            record.push_varint(thread_serial);
+            samples.take([&](SampleList::Sample sample) {
+                SampleList::encode(record, last_ns, sample);
+                count++;
+            }, all);
+            finish_record('S', count > 0);
+        }
+
+        void add_allocations(int thread_serial, ObjectSampleList &allocations) {
+            if (allocations.empty()) return;
+            uint64_t last_ns = 0;
+            record.push_varint(thread_serial);
+            allocations.take([&](int stack_index, TimeStamp timestamp, int weight) {
+                SampleList::encode(record, last_ns, SampleList::Sample{stack_index, timestamp, CATEGORY_NORMAL, weight});
+            });
+            finish_record('A', true);
+        }
+
+        void add_markers(int thread_serial, const std::vector<Marker> &markers) {
+            if (markers.empty()) return;
+            record.push_varint(thread_serial);
+            for (const Marker &marker : markers) {
+                record.push_varint(marker.type);
+                record.push_varint(marker.phase);
+                record.push_varint(marker.timestamp.nanoseconds());
+                record.push_varint(marker.finish.nanoseconds());
+                record.push_varint(marker.stack_index < 0 ? 0 : marker.stack_index + 1);
+            }
+            finish_record('M', true);
+        }
+
+        // Writes out the buffered records, all the way to the file so that
+        // they survive the process dying. Errors are remembered and raised
+        // by check_error, since this runs on the profiler thread.
+        void flush() {
+            if (!error && (!buffer.write(file) || fflush(file) != 0)) {
+                error = errno;
+            }
+            buffer.clear();
+        }
+
+        template <typename Threads>
+        void finish(const Threads &threads) {
+            record.push_varint(threads.size());
+            for (const auto &thread : threads) {
+                record.push_varint(thread->native_tid);
+                record.push_varint(thread->started_at.nanoseconds());
+                record.push_varint(thread->stopped_at.nanoseconds());
+            }
+            finish_record('F', true);
+            flush();
+            if (fclose(file) != 0 && !error) {
+                error = errno;
+            }
+            file = nullptr;
+        }
+
+        // Raises the first error writing the file, if there was one
+        void check_error() const {
+            if (error) {
+                rb_syserr_fail(error, path.c_str());
+            }
+        }
+
+        size_t memsize() const {
+            return sizeof(SampleStream) + buffer.memsize() + record.memsize();
+        }
+};
+
+// Reads a file written by SampleStream, as Vernier::StreamFile. Nothing
+// but the header and threads is read up front: each thread's samples and
+// markers are read when they're asked for, so that a Result backed by the
+// file only loads what's used. A file which was cut short is read up to
+// its last complete record.
+class StreamFile {
+    FILE *file;
+    off_t size;
+
+    class Reader {
+        FILE *file;
+        size_t remaining = SIZE_MAX;
+        bool eof = false;
+
+        public:
+            Reader(FILE *file) : file(file) {}
+
+            // Makes done() true after len more bytes
+            void limit(size_t len) {
+                remaining = len;
+            }
+
+            bool done() const {
+                return remaining == 0 || eof;
+            }
+
+            bool failed() const {
+                return eof;
+            }
+
+            uint64_t varint() {
+                uint64_t value = 0;
+                for (int shift = 0; shift < 64; shift += 7) {
+                    int byte = getc(file);
+                    if (byte == EOF) {
+                        eof = true;
+                        return 0;
+                    }
+                    remaining--;
+                    value |= (uint64_t)(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) return value;
+                }
+                return value;
+            }
+
+            void bytes(std::string &out, size_t len) {
+                out.resize(len);
+                if (len > remaining || fread(&out[0], 1, len, file) != len) {
+                    eof = true;
+                    out.clear();
+                    return;
+                }
+                remaining -= len;
+            }
+    };
+
+    // Calls fn with the tag of each complete record and a reader limited
+    // to the rest of it
+    template <typename F>
+    void each_record(F fn) {
+        fseeko(file, SampleStream::MAGIC_LEN, SEEK_SET);
+        Reader reader(file);
+        int tag;
+        while ((tag = getc(file)) != EOF) {
+            reader.limit(SIZE_MAX);
+            uint64_t len = reader.varint();
+            off_t start = ftello(file);
+            if (reader.failed() || len > (uint64_t)(size - start)) break;
+
+            reader.limit(len);
+            fn(tag, reader);
+            fseeko(file, start + len, SEEK_SET);
+        }
+        clearerr(file);
+    }
+
+    public:
+        struct ThreadInfo {
+            uint64_t tid = 0;
+            uint64_t started_at = 0;
+            uint64_t stopped_at = 0;
+            uint64_t object_id = 0;
+            int flags = 0;
+        };
+
+        // The StackTable's tables, as written. Stacks are (func, line)
+        // pairs rather than frames.
+        struct Tables {
+            std::vector<int> stack_parents, stack_funcs, stack_lines;
+            std::vector<std::string> strings;
+            std::vector<int> func_names, func_filenames, func_first_linenos;
+        };
+
+        bool has_header = false;
+        uint64_t started_at = 0;
+        uint64_t interval = 0;
+        uint64_t allocation_interval = 0;
+        bool cpu_mode = false;
+
+        std::vector<ThreadInfo> threads;
+        bool complete = false;
+
+        // Takes ownership of file, which must hold a stream after the magic
+        StreamFile(FILE *file) : file(file) {
+            fseeko(file, 0, SEEK_END);
+            size = ftello(file);
+
+            each_record([&](int tag, Reader &reader) {
+                if (tag == 'H') {
+                    has_header = true;
+                    started_at = reader.varint();
+                    interval = reader.varint();
+                    allocation_interval = reader.varint();
+                    cpu_mode = reader.varint();
+                } else if (tag == 'N') {
+                    size_t serial = reader.varint();
+                    if (serial >= threads.size()) threads.resize(serial + 1);
+                    ThreadInfo &thread = threads[serial];
+                    thread.tid = reader.varint();
+                    thread.started_at = reader.varint();
+                    thread.object_id = reader.varint();
+                    thread.flags = reader.varint();
+                } else if (tag == 'F') {
+                    size_t count = reader.varint();
+                    if (count > threads.size()) threads.resize(count);
+                    for (size_t i = 0; i < count && !reader.done(); i++) {
+                        threads[i].tid = reader.varint();
+                        threads[i].started_at = reader.varint();
+                        threads[i].stopped_at = reader.varint();
+                    }
+                    complete = true;
+                }
+            });
+        }
+
+        ~StreamFile() {
+            fclose(file);
+        }
+
+        // Reads the samples, allocation samples and markers for the thread
+        // numbered serial, appending them to the packed buffers
+        void read_thread(uint64_t serial, SampleList::Packed &samples, SampleList::Packed &allocations, std::string &markers) {
+            each_record([&](int tag, Reader &reader) {
+                if (tag != 'S' && tag != 'A' && tag != 'M') return;
+                if (reader.varint() != serial) return;
+
+                if (tag == 'M') {
+                    while (!reader.done()) {
+                        Marker marker;
+                        marker.type = (Marker::Type)reader.varint();
+                        marker.phase = (Marker::Phase)reader.varint();
+                        marker.timestamp = TimeStamp::from_nanoseconds(reader.varint());
+                        marker.finish = TimeStamp::from_nanoseconds(reader.varint());
+                        marker.stack_index = (int)reader.varint() - 1;
+                        marker.pack(markers);
+                    }
+                } else {
+                    SampleList::Packed &packed = tag == 'S' ? samples : allocations;
+                    SampleList::decode(reader, [&](const SampleList::Sample &sample) {
+                        packed.push(sample);
+                    });
+                }
+            });
+        }
+
+        // Reads the stacks, strings and funcs. Records which don't follow
+        // on from those before them are skipped.
+        void read_tables(Tables &tables) {
+            each_record([&](int tag, Reader &reader) {
+                if (tag != 'K' && tag != 'T' && tag != 'U') return;
+                size_t first = reader.varint();
+
+                if (tag == 'K') {
+                    if (first != tables.stack_parents.size()) return;
+                    while (!reader.done()) {
+                        tables.stack_parents.push_back((int)reader.varint() - 1);
+                        tables.stack_funcs.push_back(reader.varint());
+                        tables.stack_lines.push_back((int32_t)reader.varint());
+                    }
+                } else if (tag == 'T') {
+                    if (first != tables.strings.size()) return;
+                    while (!reader.done()) {
+                        size_t len = reader.varint();
+                        tables.strings.emplace_back();
+                        reader.bytes(tables.strings.back(), len);
+                    }
+                } else {
+                    if (first != tables.func_names.size()) return;
+                    while (!reader.done()) {
+                        tables.func_names.push_back(reader.varint());
+                        tables.func_filenames.push_back(reader.varint());
+                        tables.func_first_linenos.push_back((int32_t)reader.varint());
+                    }
+                }
+            });
+        }
+
+        size_t memsize() const {
+            return sizeof(StreamFile) + vector_memsize(threads);
+        }
+};
+
+static void
+stream_file_free(void *data) {
+    delete static_cast<StreamFile *>(data);
+}
+
+static size_t
+stream_file_memsize(const void *data) {
+    return static_cast<const StreamFile *>(data)->memsize();
+}
+
+static const rb_data_type_t rb_stream_file_type = {
+    .wrap_struct_name = "vernier/stream_file",
+    .function = {
+        .dmark = NULL,
+        .dfree = stream_file_free,
+        .dsize = stream_file_memsize,
+    },
+};
+
+static StreamFile *
+get_stream_file(VALUE obj) {
+    StreamFile *file;
+    TypedData_Get_Struct(obj, StreamFile, &rb_stream_file_type, file);
+    return file;
+}
+
+static VALUE
+stream_file_open(VALUE path) {
+    path = rb_get_path(path);
+
+    FILE *file = fopen(StringValueCStr(path), "rb");
+    if (!file) rb_sys_fail_str(path);
+
+    char magic[SampleStream::MAGIC_LEN];
+    if (fread(magic, 1, SampleStream::MAGIC_LEN, file) != SampleStream::MAGIC_LEN ||
+            memcmp(magic, SampleStream::MAGIC, SampleStream::MAGIC_LEN) != 0) {
+        fclose(file);
+        rb_raise(rb_eArgError, "%" PRIsVALUE " is not a vernier stream", path);
+    }
+
+    return TypedData_Wrap_Struct(rb_cStreamFile, &rb_stream_file_type, new StreamFile(file));
+}
+
+static VALUE
+stream_file_new(VALUE self, VALUE path) {
+    return stream_file_open(path);
+}
+
+// Whether the file has its footer, written at stop
+static VALUE
+stream_file_complete_p(VALUE self) {
+    return get_stream_file(self)->complete ? Qtrue : Qfalse;
+}
+
+static VALUE
+stream_file_meta(VALUE self) {
+    StreamFile *file = get_stream_file(self);
+    VALUE meta = rb_hash_new();
+    if (file->has_header) {
+        rb_hash_aset(meta, sym("mode"), file->cpu_mode ? sym("cpu") : sym("wall"));
+        rb_hash_aset(meta, sym("started_at"), ULL2NUM(file->started_at));
+        rb_hash_aset(meta, sym("interval"), ULL2NUM(file->interval));
+        rb_hash_aset(meta, sym("allocation_interval"), ULL2NUM(file->allocation_interval));
+    }
+    return meta;
+}
+
+static VALUE
+stream_file_threads(VALUE self) {
+    StreamFile *file = get_stream_file(self);
+    VALUE threads = rb_ary_new_capa(file->threads.size());
+    for (const auto &thread : file->threads) {
+        VALUE hash = rb_hash_new();
+        rb_hash_aset(hash, sym("tid"), ULL2NUM(thread.tid));
+        rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread.started_at));
+        if (thread.stopped_at != 0) {
+            rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(thread.stopped_at));
+        }
+        rb_hash_aset(hash, sym("object_id"), ULL2NUM(thread.object_id));
+        rb_hash_aset(hash, sym("is_main"), (thread.flags & SampleStream::THREAD_MAIN) ? Qtrue : Qfalse);
+        rb_hash_aset(hash, sym("is_start"), (thread.flags & SampleStream::THREAD_START) ? Qtrue : Qfalse);
+        rb_ary_push(threads, hash);
+    }
+    return threads;
+}
+
+// Returns a thread's samples, allocation samples and markers packed as in
+// TimeCollector's results
+static VALUE
+stream_file_thread_data(VALUE self, VALUE serial) {
+    StreamFile *file = get_stream_file(self);
+    SampleList::Packed samples, allocations;
+    std::string markers;
+    file->read_thread(NUM2ULL(serial), samples, allocations, markers);
+
+    VALUE packed = rb_hash_new();
+    samples.write(packed);
+    rb_hash_aset(packed, sym("markers"), rb_str_new(markers.data(), markers.size()));
+
+    VALUE allocations_hash = rb_hash_new();
+    rb_hash_aset(packed, sym("allocations"), allocations_hash);
+    rb_hash_aset(allocations_hash, sym("samples"), rb_str_new(allocations.samples.data(), allocations.samples.size()));
+    rb_hash_aset(allocations_hash, sym("weights"), rb_str_new(allocations.weights.data(), allocations.weights.size()));
+    rb_hash_aset(allocations_hash, sym("timestamps"), rb_str_new(allocations.timestamps.data(), allocations.timestamps.size()));
+    return packed;
+}
+
+template <typename T>
+static VALUE
+int_array(const std::vector<T> &values) {
+    VALUE ary = rb_ary_new_capa(values.size());
+    for (T value : values) {
+        rb_ary_push(ary, INT2NUM(value));
+    }
+    return ary;
+}
+
+// Returns the stack, frame and func tables as arrays, with a frame for each
+// distinct func and line. Funcs which were never symbolicated, as when the
+// process died first, are named "<unknown>".
+static VALUE
+stream_file_stack_table(VALUE self) {
+    StreamFile::Tables tables;
+    get_stream_file(self)->read_tables(tables);
+
+    std::vector<int> stack_frames, frame_funcs, frame_lines;
+    std::unordered_map<uint64_t, int> frame_index;
+    int func_count = tables.func_names.size();
+    for (size_t i = 0; i < tables.stack_funcs.size(); i++) {
+        int func = tables.stack_funcs[i];
+        int line = tables.stack_lines[i];
+        uint64_t key = (uint64_t)func << 32 | (uint32_t)line;
+        auto it = frame_index.find(key);
+        if (it == frame_index.end()) {
+            it = frame_index.insert({key, (int)frame_funcs.size()}).first;
+            frame_funcs.push_back(func);
+            frame_lines.push_back(line);
+        }
+        stack_frames.push_back(it->second);
+        if (func >= func_count) func_count = func + 1;
+    }
+
+    if (func_count > tables.func_names.size()) {
+        int unknown = tables.strings.size();
+        tables.strings.push_back("<unknown>");
+        tables.strings.push_back("");
+        tables.func_names.resize(func_count, unknown);
+        tables.func_filenames.resize(func_count, unknown + 1);
+        tables.func_first_linenos.resize(func_count, 0);
+    }
+
+    VALUE strings = rb_ary_new_capa(tables.strings.size());
+    for (const auto &str : tables.strings) {
+        rb_ary_push(strings, rb_utf8_str_new(str.data(), str.size()));
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_parent"), int_array(tables.stack_parents));
+    rb_hash_aset(hash, sym("stack_frame"), int_array(stack_frames));
+    rb_hash_aset(hash, sym("frame_func"), int_array(frame_funcs));
+    rb_hash_aset(hash, sym("frame_line"), int_array(frame_lines));
+    rb_hash_aset(hash, sym("func_name"), int_array(tables.func_names));
+    rb_hash_aset(hash, sym("func_filename"), int_array(tables.func_filenames));
+    rb_hash_aset(hash, sym("func_first_line"), int_array(tables.func_first_linenos));
+    rb_hash_aset(hash, sym("strings"), strings);
+    return hash;
+}
+
+// A view of frames captured by rb_profile_frames, which stores the leaf
+// frame first. Indexed from the root like RawSample.
+struct RawFrames {
+    const VALUE *frames;
+    const int *lines;
+    int len;
+
+    int size() const {
+        return len;
+    }
+
+    Frame frame(int i) const {
+        int idx = len - i - 1;
+        return Frame{frames[idx], lines[idx]};
+    }
+};
+
+// Preallocated single-producer/single-consumer ring of samples for one
+// thread.
+//
+// The producer is the signal handler in the sampled thread (or the profiler
+// thread itself for samples with a known stack, like idle ones). It writes
+// frames straight into the ring without locking or allocating. The consumer
+// is the profiler thread, which later translates everything pending into the
+// StackTable in a single batch.
+class SampleBuffer {
+    public:
+        static const int FRAME_CAPACITY = 4 * RawSample::MAX_LEN;
+        static const int ENTRY_CAPACITY = 1024;
+
+        struct Entry {
+            TimeStamp timestamp;
+            Category category;
+            int weight;
+
+            // Index of an already known stack, used when frames_len is 0
+            int stack_index;
+
+            int frames_start;
+            int frames_len;
+
+            // Value of frames_head after this entry was written. Consuming
+            // the entry frees the ring up to this point.
+            uint64_t frames_end;
+        };
+
+    private:
+        std::unique_ptr<VALUE[]> frames;
+        std::unique_ptr<int[]> lines;
+        std::unique_ptr<Entry[]> entries;
+
+        // Monotonic counters. The producer only writes the heads and the
+        // consumer only writes the tails.
+        std::atomic<uint64_t> entries_head{0};
+        std::atomic<uint64_t> entries_tail{0};
+        std::atomic<uint64_t> frames_head{0};
+        std::atomic<uint64_t> frames_tail{0};
+
+        bool allocated() const {
+            return entries != nullptr;
+        }
+
+        bool entries_full() const {
+            return entries_head.load(std::memory_order_relaxed) - entries_tail.load(std::memory_order_acquire) >= ENTRY_CAPACITY;
+        }
+
+        void push(const Entry &entry, uint64_t new_frames_head) {
+            uint64_t head = entries_head.load(std::memory_order_relaxed);
+            entries[head % ENTRY_CAPACITY] = entry;
+            frames_head.store(new_frames_head, std::memory_order_release);
+            entries_head.store(head + 1, std::memory_order_release);
+        }
+
+    public:
+        // Samples lost because the consumer fell behind
+        std::atomic<uint64_t> dropped{0};
+
+        // Must be called before anything is recorded. Not async-signal-safe.
+        void allocate() {
+            if (allocated()) return;
+
+            frames = std::unique_ptr<VALUE[]>(new VALUE[FRAME_CAPACITY]);
+            lines = std::unique_ptr<int[]>(new int[FRAME_CAPACITY]);
+            entries = std::unique_ptr<Entry[]>(new Entry[ENTRY_CAPACITY]);
+        }
+
+        // Records a sample whose stack has already been translated
+        void record(int stack_index, TimeStamp time, Category category) {
+            allocate();
+
+            if (entries_full()) {
+                dropped++;
+                return;
+            }
+
+            uint64_t head = frames_head.load(std::memory_order_relaxed);
+            push(Entry{time, category, 1, stack_index, 0, 0, head}, head);
+        }
+
+        // Captures the current thread's stack into the ring. Called from a
+        // signal handler so must be async-signal-safe (as far as
+        // rb_profile_frames is). Returns whether a sample was recorded.
+        bool record_current_thread(TimeStamp time, int weight = 1) {
+            if (!allocated()) return false;
+
+            if (!ruby_native_thread_p() || rb_during_gc()) {
+                return false;
+            }
+
+            if (entries_full()) {
+                dropped++;
+                return false;
+            }
+
+            // rb_profile_frames needs MAX_LEN contiguous slots. If there
+            // isn't enough room before the end of the ring we skip the
+            // remainder and start again from the beginning.
+            uint64_t head = frames_head.load(std::memory_order_relaxed);
+            uint64_t tail = frames_tail.load(std::memory_order_acquire);
+            uint64_t pos = head % FRAME_CAPACITY;
+            uint64_t skip = FRAME_CAPACITY - pos < RawSample::MAX_LEN ? FRAME_CAPACITY - pos : 0;
+            if (FRAME_CAPACITY - (head - tail) < skip + RawSample::MAX_LEN) {
+                dropped++;
+                return false;
+            }
+
+            int start = (pos + skip) % FRAME_CAPACITY;
+            int len = rb_profile_frames(0, RawSample::MAX_LEN, &frames[start], &lines[start]);
+            if (len <= 0) {
+                return false;
+            }
+
+            uint64_t new_head = head + skip + len;
+            push(Entry{time, CATEGORY_NORMAL, weight, -1, start, len, new_head}, new_head);
+            return true;
+        }
+
+        size_t memsize() const {
+            if (!allocated()) return 0;
+            return FRAME_CAPACITY * (sizeof(VALUE) + sizeof(int)) + ENTRY_CAPACITY * sizeof(Entry);
+        }
+
+        // Whether the consumer should drain soon to avoid dropping samples
+        bool should_drain() const {
+            if (!allocated()) return false;
+
+            uint64_t pending_entries = entries_head.load(std::memory_order_acquire) - entries_tail.load(std::memory_order_relaxed);
+            uint64_t pending_frames = frames_head.load(std::memory_order_acquire) - frames_tail.load(std::memory_order_relaxed);
+            return pending_entries * 2 >= ENTRY_CAPACITY || pending_frames * 2 >= FRAME_CAPACITY;
+        }
+
+        // Calls fn(entry, frames) for every pending entry in order, then
+        // releases them back to the producer.
+        template <typename F>
+        void consume(F fn) {
+            if (!allocated()) return;
+
+            uint64_t tail = entries_tail.load(std::memory_order_relaxed);
+            uint64_t head = entries_head.load(std::memory_order_acquire);
+            for (; tail < head; tail++) {
+                const Entry &entry = entries[tail % ENTRY_CAPACITY];
+                RawFrames raw = { &frames[entry.frames_start], &lines[entry.frames_start], entry.frames_len };
+                fn(entry, raw);
+
+                frames_tail.store(entry.frames_end, std::memory_order_release);
+                entries_tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+
+        // Marks frames which have been captured but not yet translated
+        void mark() const {
+            if (!allocated()) return;
+
+            uint64_t tail = entries_tail.load(std::memory_order_acquire);
+            uint64_t head = entries_head.load(std::memory_order_acquire);
+            for (; tail < head; tail++) {
+                const Entry &entry = entries[tail % ENTRY_CAPACITY];
+                for (int i = 0; i < entry.frames_len; i++) {
+                    rb_gc_mark(frames[entry.frames_start + i]);
+                }
+            }
+        }
+};
+
+// Based very loosely on the design of Gecko's SigHandlerCoordinator
+// This is used for communication between the profiler thread and the signal
+// handlers in the observed thread.
+struct LiveSample {
+    // Where the signal handler writes the captured frames
+    SampleBuffer *buffer = nullptr;
+    TimeStamp timestamp;
+
+    // The thread we expect to receive the signal. The signal handler uses this
+    // to find its own slot when several threads are being sampled at once.
+    pthread_t pthread_id = 0;
+
+    // Whether the signal was successfully delivered (and so whether the
+    // profiler thread should wait for a reply)
+    bool sent = false;
+
+    SignalSafeSemaphore sem_complete;
+
+    // Wait for a sample to be collected by the signal handler on another thread
+    void wait() {
+        sem_complete.wait();
+    }
+
+    // Called from a signal handler in the observed thread in order to take a
+    // sample and signal to the proifiler thread that the sample is ready.
+    //
+    // CRuby doesn't guarantee that rb_profile_frames can be used as
+    // async-signal-safe but in practice it seems to be.
+    // sem_post is safe in an async-signal-safe context.
+    void sample_current_thread() {
+        buffer->record_current_thread(timestamp);
+        sem_complete.post();
+    }
+};
+
+class GlobalSignalHandler {
+    // Slots for the threads currently being sampled. Only valid while
+    // record_samples is waiting on replies.
+    static LiveSample **live_samples;
+    static size_t live_samples_count;
+
+    // Buffers of threads sampled by their own CPU time timers. The timer's
+    // signal carries the slot index, since the buffer could be freed before
+    // a queued signal is delivered.
+    //
+    // While the signal handler is writing a sample it takes the pointer out
+    // of its slot, so unregister_cpu_timer can wait for it to finish.
+    //
+    // A slot can be reused while a signal for its previous timer is still
+    // queued, so the signal also carries the slot's generation, and signals
+    // from an earlier generation are dropped.
+    static const int CPU_TIMER_SLOT_BITS = 12;
+    static const int MAX_CPU_TIMERS = 1 << CPU_TIMER_SLOT_BITS;
+    static const unsigned CPU_TIMER_GENERATION_MASK = INT_MAX >> CPU_TIMER_SLOT_BITS;
+    static std::atomic_bool cpu_timer_used[MAX_CPU_TIMERS];
+    static std::atomic<unsigned> cpu_timer_generations[MAX_CPU_TIMERS];
+    static std::atomic<SampleBuffer *> cpu_timer_buffers[MAX_CPU_TIMERS];
+
+    public:
+        static GlobalSignalHandler *get_instance() {
+            static GlobalSignalHandler instance;
+            return &instance;
+        }
+
+        // Returns a value to pass to the timer's signal, identifying its
+        // slot and generation, or -1 if all slots are in use.
+        static int register_cpu_timer(SampleBuffer *buffer) {
+            for (int i = 0; i < MAX_CPU_TIMERS; i++) {
+                if (!cpu_timer_used[i].exchange(true)) {
+                    unsigned generation = (cpu_timer_generations[i].load() + 1) & CPU_TIMER_GENERATION_MASK;
+                    // Stored before the buffer, so a handler which sees the
+                    // buffer also sees its generation
+                    cpu_timer_generations[i].store(generation);
+                    cpu_timer_buffers[i].store(buffer);
+                    return i | (int)(generation << CPU_TIMER_SLOT_BITS);
+                }
+            }
+            return -1;
+        }
+
+        // Must only be called after the timer has been deleted. On return no
+        // signal handler is using the buffer and none will in the future.
+        static void unregister_cpu_timer(int timer_id) {
+            int slot = timer_id & (MAX_CPU_TIMERS - 1);
+            while (!cpu_timer_buffers[slot].exchange(nullptr)) {
+                // A signal handler is currently writing to the buffer
+            }
+            cpu_timer_used[slot].store(false);
+        }
+
+        void install() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            count++;
+
+            if (count == 1) setup_signal_handler();
+        }
+
+        void uninstall() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            count--;
+
+            if (count == 0) clear_signal_handler();
+        }
+
+        // Signals every thread in samples at once, then waits for all of them
+        // to reply. The time this takes is the slowest thread's signal latency
+        // rather than the sum of all of them.
+        //
+        // Each sample's `sent` is set to whether its thread was signalled.
+        void record_samples(std::vector<LiveSample *> &samples) {
+            if (samples.empty()) return;
+
+            const std::lock_guard<std::mutex> lock(mutex);
+
+            live_samples = samples.data();
+            live_samples_count = samples.size();
+
+            for (auto *sample : samples) {
+                assert(sample->pthread_id);
+
+                int rc = pthread_kill(sample->pthread_id, SIGPROF);
+                if (rc) {
+                    fprintf(stderr, "VERNIER BUG: pthread_kill of %lu failed (%i)\n", (unsigned long)sample->pthread_id, rc);
+                    sample->sent = false;
+                } else {
+                    sample->sent = true;
+                }
+            }
+
+            for (auto *sample : samples) {
+                if (sample->sent) {
+                    sample->wait();
+                }
+            }
+
+            live_samples = NULL;
+            live_samples_count = 0;
+        }
+
+    private:
+        std::mutex mutex;
+        int count;
+
+        // CPU clock timers are only checked on scheduler ticks, so one
+        // signal may stand for several intervals. Those are reported as
+        // overruns and added to the sample's weight.
+        static void record_cpu_sample(int timer_id, int overrun) {
+            if (timer_id < 0) return;
+            int slot = timer_id & (MAX_CPU_TIMERS - 1);
+            unsigned generation = (unsigned)timer_id >> CPU_TIMER_SLOT_BITS;
+
+            SampleBuffer *buffer = cpu_timer_buffers[slot].exchange(nullptr);
+            if (!buffer) {
+                // The timer was stopped after this signal was queued
+                return;
+            }
+
+            // Otherwise the timer was stopped after this signal was queued,
+            // and its slot was given to another thread's timer
+            if (cpu_timer_generations[slot].load() == generation) {
+                buffer->record_current_thread(TimeStamp::Now(), 1 + overrun);
+            }
+
+            cpu_timer_buffers[slot].store(buffer);
+        }
+
+        static void signal_handler(int sig, siginfo_t* sinfo, void* ucontext) {
+#ifdef HAVE_CPU_TIMERS
+            if (sinfo->si_code == SI_TIMER) {
+                record_cpu_sample(sinfo->si_value.sival_int, sinfo->si_overrun);
+                return;
             }
-        }
+#endif
 
-        void write_result(VALUE result) const {
-            VALUE samples = rb_ary_new();
-            rb_hash_aset(result, sym("samples"), samples);
-            for (auto& stack_index: this->stacks) {
-                rb_ary_push(samples, INT2NUM(stack_index));
-            }
+            assert(live_samples);
 
-            VALUE weights = rb_ary_new();
-            rb_hash_aset(result, sym("weights"), weights);
-            for (auto& weight: this->weights) {
-                rb_ary_push(weights, INT2NUM(weight));
+            pthread_t current = pthread_self();
+            for (size_t i = 0; i < live_samples_count; i++) {
+                LiveSample *sample = live_samples[i];
+                if (pthread_equal(sample->pthread_id, current)) {
+                    sample->sample_current_thread();
+                }
             }
+        }
 
-            VALUE timestamps = rb_ary_new();
-            rb_hash_aset(result, sym("timestamps"), timestamps);
-            for (auto& timestamp: this->timestamps) {
-                rb_ary_push(timestamps, ULL2NUM(timestamp.nanoseconds()));
-            }
+        void setup_signal_handler() {
+            struct sigaction sa;
+            sa.sa_sigaction = signal_handler;
+            sa.sa_flags = SA_RESTART | SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGPROF, &sa, NULL);
+        }
 
-            VALUE sample_categories = rb_ary_new();
-            rb_hash_aset(result, sym("sample_categories"), sample_categories);
-            for (auto& cat: this->categories) {
-                rb_ary_push(sample_categories, INT2NUM(cat));
-            }
+        void clear_signal_handler() {
+            struct sigaction sa;
+            sa.sa_handler = SIG_IGN;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGPROF, &sa, NULL);
         }
 };
+LiveSample **GlobalSignalHandler::live_samples;
+size_t GlobalSignalHandler::live_samples_count;
+std::atomic_bool GlobalSignalHandler::cpu_timer_used[GlobalSignalHandler::MAX_CPU_TIMERS];
+std::atomic<unsigned> GlobalSignalHandler::cpu_timer_generations[GlobalSignalHandler::MAX_CPU_TIMERS];
+std::atomic<SampleBuffer *> GlobalSignalHandler::cpu_timer_buffers[GlobalSignalHandler::MAX_CPU_TIMERS];
+
+// Memory used by a collector's own data structures, in bytes. The
+// StackTable is a separate object and reports its own size.
+struct MemoryUsage {
+    size_t collector = 0;
+    size_t samples = 0;
+    size_t allocation_samples = 0;
+    size_t markers = 0;
+    size_t sample_buffers = 0;
+
+    size_t total() const {
+        return collector + samples + allocation_samples + markers + sample_buffers;
+    }
+};
 
 class Thread {
     public:
@@ -442,6 +1733,18 @@ class Thread {
         int stack_on_suspend_idx;
         SampleTranslator translator;
 
+        // Samples waiting to be translated into the StackTable
+        SampleBuffer sample_buffer;
+
+        // Slot the signal handler uses when this thread is sampled
+        LiveSample live_sample;
+
+#ifdef HAVE_CPU_TIMERS
+        // Timer on this thread's CPU clock, used in cpu mode
+        timer_t cpu_timer;
+        int cpu_timer_id = -1;
+#endif
+
         unique_ptr<MarkerTable> markers;
 
         // FIXME: don't use pthread at start
@@ -454,6 +1757,63 @@ class Thread {
             if (state == State::STARTED) {
                 markers->record(Marker::Type::MARKER_GVL_THREAD_STARTED);
             }
+
+            live_sample.buffer = &sample_buffer;
+        }
+
+        ~Thread() {
+            stop_cpu_timer();
+        }
+
+        // Starts delivering SIGPROF to this thread every time it has used
+        // interval of CPU time. Must be called from the thread itself.
+        void start_cpu_timer(TimeStamp interval) {
+#ifdef HAVE_CPU_TIMERS
+            if (cpu_timer_id >= 0) return;
+
+            sample_buffer.allocate();
+
+            int timer_id = GlobalSignalHandler::register_cpu_timer(&sample_buffer);
+            if (timer_id < 0) {
+                fprintf(stderr, "VERNIER: too many threads for cpu mode, not sampling tid %lu\n", (unsigned long)get_native_thread_id());
+                return;
+            }
+
+            struct sigevent sev = {};
+            sev.sigev_notify = SIGEV_THREAD_ID;
+            sev.sigev_signo = SIGPROF;
+            sev.sigev_value.sival_int = timer_id;
+            sev.sigev_notify_thread_id = get_native_thread_id();
+
+            if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &cpu_timer) != 0) {
+                perror("VERNIER: timer_create");
+                GlobalSignalHandler::unregister_cpu_timer(timer_id);
+                return;
+            }
+
+            struct itimerspec its;
+            its.it_interval = interval.timespec();
+            its.it_value = interval.timespec();
+            if (timer_settime(cpu_timer, 0, &its, NULL) != 0) {
+                perror("VERNIER: timer_settime");
+                timer_delete(cpu_timer);
+                GlobalSignalHandler::unregister_cpu_timer(timer_id);
+                return;
+            }
+
+            cpu_timer_id = timer_id;
+#endif
+        }
+
+        // Can be called from any thread
+        void stop_cpu_timer() {
+#ifdef HAVE_CPU_TIMERS
+            if (cpu_timer_id < 0) return;
+
+            timer_delete(cpu_timer);
+            GlobalSignalHandler::unregister_cpu_timer(cpu_timer_id);
+            cpu_timer_id = -1;
+#endif
         }
 
         void record_newobj(VALUE obj, StackTable &frame_list) {
@@ -538,6 +1898,7 @@ class Thread {
                     markers->record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
                     markers->record(Marker::Type::MARKER_GVL_THREAD_EXITED);
 
+                    stop_cpu_timer();
                     stopped_at = now;
 
                     break;
@@ -547,11 +1908,11 @@ class Thread {
             state_changed_at = now;
         }
 
-        bool is_main() {
+        bool is_main() const {
             return rb_thread_main() == ruby_thread;
         }
 
-        bool is_start(VALUE start_thread) {
+        bool is_start(VALUE start_thread) const {
             return start_thread == ruby_thread;
         }
 
@@ -559,7 +1920,61 @@ class Thread {
             return state != State::STOPPED;
         }
 
+        // Translates everything waiting in sample_buffer and appends it to
+        // samples. Must be called with the StackTable's lock held.
+        void drain_samples_locked(StackTable &frame_list) {
+            sample_buffer.consume([&](const SampleBuffer::Entry &entry, const RawFrames &frames) {
+                int stack_index = entry.stack_index;
+                if (entry.frames_len > 0) {
+                    stack_index = translator.translate_locked(frame_list, frames);
+                }
+                samples.record_sample(stack_index, entry.timestamp, entry.category, entry.weight);
+            });
+        }
+
+        // Moves samples, allocation samples and plain markers into
+        // stream's buffer. The last sample is kept unless all is set. Must
+        // be called with the ThreadTable's lock held.
+        void take_for_stream(SampleStream &stream, int serial, bool all) {
+            stream.add_samples(serial, samples, all);
+            stream.add_allocations(serial, allocation_samples);
+
+            std::vector<Marker> taken;
+            markers->take_plain(taken);
+            stream.add_markers(serial, taken);
+        }
+
+        // Calls fn with every stack index this Thread holds. Must be called
+        // with the GVL and the ThreadTable's lock held.
+        template <typename F>
+        void each_stack_index(F fn) {
+            samples.each_stack_index(fn);
+            for (int stack_index : allocation_samples.stacks) fn(stack_index);
+            markers->each_stack_index(fn);
+            if (stack_on_suspend_idx >= 0) fn(stack_on_suspend_idx);
+        }
+
+        // Calls fn with a reference to every stack index this Thread holds,
+        // so that it can be updated. Must be called with the GVL and the
+        // ThreadTable's lock held.
+        template <typename F>
+        void update_stack_indexes(F fn) {
+            samples.update_stack_indexes(fn);
+            for (int &stack_index : allocation_samples.stacks) fn(stack_index);
+            markers->update_stack_indexes(fn);
+            if (stack_on_suspend_idx >= 0) fn(stack_on_suspend_idx);
+        }
+
         void mark() {
+            sample_buffer.mark();
+        }
+
+        void add_memory_usage(MemoryUsage &usage) {
+            usage.collector += sizeof(Thread) + sizeof(MarkerTable);
+            usage.samples += samples.memsize();
+            usage.allocation_samples += allocation_samples.memsize();
+            usage.markers += markers->memsize();
+            usage.sample_buffers += sample_buffer.memsize();
         }
 };
 
@@ -570,15 +1985,41 @@ class ThreadTable {
         std::vector<std::unique_ptr<Thread> > list;
         std::mutex mutex;
 
+        // When non-zero, each thread samples itself using a timer on its own
+        // CPU clock, started the first time it runs.
+        TimeStamp cpu_interval;
+
         ThreadTable(StackTable &frame_list) : frame_list(frame_list) {
         }
 
+        void stop_cpu_timers() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (auto &thread : list) {
+                thread->stop_cpu_timer();
+            }
+        }
+
         void mark() {
             for (const auto &thread : list) {
                 thread->mark();
             }
         }
 
+        void compact() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &thread : list) {
+                thread->translator.clear();
+            }
+        }
+
+        void add_memory_usage(MemoryUsage &usage) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            usage.collector += vector_memsize(list);
+            for (const auto &thread : list) {
+                thread->add_memory_usage(usage);
+            }
+        }
+
         void initial(VALUE th) {
             set_state(Thread::State::INITIAL, th);
         }
@@ -667,6 +2108,10 @@ class ThreadTable {
             if (thread.state == Thread::State::RUNNING) {
                 thread.pthread_id = pthread_self();
                 thread.native_tid = get_native_thread_id();
+
+                if (!cpu_interval.zero()) {
+                    thread.start_cpu_timer(cpu_interval);
+                }
             } else {
                 thread.pthread_id = 0;
                 thread.native_tid = 0;
@@ -689,6 +2134,10 @@ class BaseCollector {
     StackTable *stack_table;
     VALUE stack_table_value;
 
+    // False when the StackTable was passed in, and may be shared with
+    // other collectors or results
+    bool owns_stack_table = true;
+
     VALUE start_thread;
     TimeStamp started_at;
 
@@ -738,6 +2187,16 @@ class BaseCollector {
         rb_raise(rb_eRuntimeError, "collector doesn't support manual sampling");
     };
 
+    // Symbolicates up to max_funcs new functions in the StackTable. Must be
+    // called with the GVL. Returns whether any are left.
+    virtual bool symbolicate(size_t max_funcs) {
+        return stack_table->symbolicate(max_funcs);
+    }
+
+    virtual int compact_stack_table(TimeStamp discard_before) {
+        rb_raise(rb_eRuntimeError, "collector doesn't support stack table compaction");
+    };
+
     virtual void mark() {
         //frame_list.mark_frames();
         rb_gc_mark(stack_table_value);
@@ -745,75 +2204,63 @@ class BaseCollector {
 
     virtual void compact() {
     };
-};
-
-class GlobalSignalHandler {
-    static LiveSample *live_sample;
-
-    public:
-        static GlobalSignalHandler *get_instance() {
-            static GlobalSignalHandler instance;
-            return &instance;
-        }
 
-        void install() {
-            const std::lock_guard<std::mutex> lock(mutex);
-            count++;
+    virtual void add_memory_usage(MemoryUsage &usage) {
+        usage.collector += sizeof(BaseCollector);
+    }
+};
 
-            if (count == 1) setup_signal_handler();
-        }
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+// Symbolicates new functions for running collectors from a postponed job
+// while profiling, a batch at a time, so that stop() only has to handle
+// whatever is left. The profiler thread triggers the job after translating
+// samples.
+class BackgroundSymbolicator {
+    static const size_t BATCH_SIZE = 256;
 
-        void uninstall() {
-            const std::lock_guard<std::mutex> lock(mutex);
-            count--;
+    // Only accessed with the GVL held
+    static std::vector<BaseCollector *> collectors;
+    static rb_postponed_job_handle_t job;
 
-            if (count == 0) clear_signal_handler();
+    static void run(void *data) {
+        bool remaining = false;
+        for (auto collector : collectors) {
+            remaining |= collector->symbolicate(BATCH_SIZE);
         }
 
-        bool record_sample(LiveSample &sample, pthread_t pthread_id) {
-            const std::lock_guard<std::mutex> lock(mutex);
-
-            assert(pthread_id);
-
-            live_sample = &sample;
-            int rc = pthread_kill(pthread_id, SIGPROF);
-            if (rc) {
-                fprintf(stderr, "VERNIER BUG: pthread_kill of %lu failed (%i)\n", (unsigned long)pthread_id, rc);
-                live_sample = NULL;
-                return false;
-            } else {
-                sample.wait();
-                live_sample = NULL;
-                return true;
-            }
+        // Yield between batches rather than symbolicating everything at once
+        if (remaining) {
+            trigger();
         }
+    }
 
-    private:
-        std::mutex mutex;
-        int count;
+    public:
 
-        static void signal_handler(int sig, siginfo_t* sinfo, void* ucontext) {
-            assert(live_sample);
-            live_sample->sample_current_thread();
+    static void add(BaseCollector *collector) {
+        if (job == POSTPONED_JOB_HANDLE_INVALID) {
+            job = rb_postponed_job_preregister(0, run, NULL);
         }
+        collectors.push_back(collector);
+    }
 
-        void setup_signal_handler() {
-            struct sigaction sa;
-            sa.sa_sigaction = signal_handler;
-            sa.sa_flags = SA_RESTART | SA_SIGINFO;
-            sigemptyset(&sa.sa_mask);
-            sigaction(SIGPROF, &sa, NULL);
+    static void remove(BaseCollector *collector) {
+        auto it = std::find(collectors.begin(), collectors.end(), collector);
+        if (it != collectors.end()) {
+            collectors.erase(it);
         }
+    }
 
-        void clear_signal_handler() {
-            struct sigaction sa;
-            sa.sa_handler = SIG_IGN;
-            sa.sa_flags = SA_RESTART;
-            sigemptyset(&sa.sa_mask);
-            sigaction(SIGPROF, &sa, NULL);
+    // Safe to call from any thread
+    static void trigger() {
+        if (job != POSTPONED_JOB_HANDLE_INVALID) {
+            rb_postponed_job_trigger(job);
         }
+    }
 };
-LiveSample *GlobalSignalHandler::live_sample;
+
+std::vector<BaseCollector *> BackgroundSymbolicator::collectors;
+rb_postponed_job_handle_t BackgroundSymbolicator::job = POSTPONED_JOB_HANDLE_INVALID;
+#endif
 
 class TimeCollector : public BaseCollector {
     class TimeCollectorThread : public PeriodicThread {
@@ -834,15 +2281,25 @@ class TimeCollector : public BaseCollector {
 
     pthread_t sample_thread;
 
-    atomic_bool running;
+    atomic_bool running{false};
     SignalSafeSemaphore thread_stopped;
 
     TimeStamp interval;
     unsigned int allocation_interval;
     unsigned int allocation_tick = 0;
 
+    // In cpu mode threads sample themselves from timers on their own CPU
+    // clocks and the profiler thread only translates what they record.
+    bool cpu_mode;
+
     VALUE tp_newobj = Qnil;
 
+    // Set when streaming samples and markers to a file rather than keeping
+    // them until stop
+    std::unique_ptr<SampleStream> stream;
+    TimeStamp last_stream_flush;
+    static constexpr uint64_t STREAM_FLUSH_MS = 100;
+
     static void newobj_i(VALUE tpval, void *data) {
         TimeCollector *collector = static_cast<TimeCollector *>(data);
         rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
@@ -854,7 +2311,21 @@ class TimeCollector : public BaseCollector {
     TimeCollectorThread collector_thread;
 
     public:
-    TimeCollector(VALUE stack_table, TimeStamp interval, unsigned int allocation_interval) : BaseCollector(stack_table), interval(interval), allocation_interval(allocation_interval), threads(*get_stack_table(stack_table)), collector_thread(*this, interval) {
+    TimeCollector(VALUE stack_table, TimeStamp interval, unsigned int allocation_interval, bool cpu_mode = false, SampleStream *stream = nullptr) : BaseCollector(stack_table), interval(interval), allocation_interval(allocation_interval), cpu_mode(cpu_mode), stream(stream), threads(*get_stack_table(stack_table)), collector_thread(*this, cpu_mode ? drain_interval(interval) : interval) {
+    }
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    ~TimeCollector() {
+        // A collector freed without being stopped is still registered
+        BackgroundSymbolicator::remove(this);
+    }
+#endif
+
+    // How often the profiler thread checks for samples to translate in cpu
+    // mode, where it doesn't need to wake up for every sample.
+    static TimeStamp drain_interval(TimeStamp interval) {
+        TimeStamp min = TimeStamp::from_milliseconds(10);
+        return interval < min ? min : interval;
     }
 
     void record_newobj(VALUE obj) {
@@ -888,6 +2359,75 @@ class TimeCollector : public BaseCollector {
         threads.mutex.unlock();
     }
 
+    // Drops samples and markers from before discard_before, unless it's
+    // zero, then removes every stack no longer referenced from the
+    // StackTable, renumbering the rest. Returns how many were removed.
+    int compact_stack_table(TimeStamp discard_before) {
+        if (!running) {
+            rb_raise(rb_eRuntimeError, "collector not running");
+        }
+        if (!owns_stack_table) {
+            rb_raise(rb_eRuntimeError, "can't compact a StackTable passed to the collector");
+        }
+        if (stream) {
+            // Stack indexes already written can't be renumbered
+            rb_raise(rb_eRuntimeError, "can't compact the StackTable while streaming");
+        }
+
+        // Excludes the profiler thread and GVL hooks. Holding the GVL
+        // excludes allocation and fiber hooks.
+        const std::lock_guard<std::mutex> threads_lock(threads.mutex);
+
+        // Leaves no translated stacks waiting in the sample buffers
+        drain_samples();
+
+        if (!discard_before.zero()) {
+            for (auto &threadptr : threads.list) {
+                threadptr->samples.discard_before(discard_before);
+                threadptr->allocation_samples.discard_before(discard_before);
+                threadptr->markers->discard_before(discard_before);
+            }
+            gc_markers.discard_before(discard_before);
+        }
+
+        std::vector<bool> used;
+        auto use = [&](int stack_index) {
+            if (stack_index < 0) return;
+            if (stack_index >= used.size()) used.resize(stack_index + 1, false);
+            used[stack_index] = true;
+        };
+        for (auto &threadptr : threads.list) {
+            threadptr->each_stack_index(use);
+        }
+        gc_markers.each_stack_index(use);
+
+        const auto lock = SampleTranslator::lock(*stack_table);
+        std::vector<int> remap = stack_table->retain_stacks_locked(used);
+
+        auto update = [&](int &stack_index) {
+            if (stack_index >= 0) stack_index = remap[stack_index];
+        };
+        for (auto &threadptr : threads.list) {
+            threadptr->update_stack_indexes(update);
+        }
+        gc_markers.update_stack_indexes(update);
+        for (auto &threadptr : threads.list) {
+            threadptr->translator.clear();
+        }
+
+        return std::count(used.begin(), used.end(), false);
+    }
+
+    // Also adds the new functions to the stream, so that it names them
+    bool symbolicate(size_t max_funcs) {
+        bool remaining = BaseCollector::symbolicate(max_funcs);
+        if (stream) {
+            const std::lock_guard<std::mutex> lock(threads.mutex);
+            stream->add_funcs(*stack_table);
+        }
+        return remaining;
+    }
+
     void write_meta(VALUE meta, VALUE result) {
         BaseCollector::write_meta(meta, result);
         rb_hash_aset(meta, sym("interval"), ULL2NUM(interval.microseconds()));
@@ -897,21 +2437,92 @@ class TimeCollector : public BaseCollector {
 
     private:
 
-    void record_sample(const RawSample &sample, TimeStamp time, Thread &thread, Category category) {
-        if (!sample.empty()) {
-            int stack_index = thread.translator.translate(*stack_table, sample);
-            thread.samples.record_sample(
-                    stack_index,
-                    time,
-                    category
-                    );
+    // Translates every thread's pending samples, taking the StackTable lock
+    // once for the whole batch. Must be called with threads.mutex held.
+    void drain_samples() {
+        {
+            const auto lock = SampleTranslator::lock(*stack_table);
+            for (auto &threadptr : threads.list) {
+                threadptr->drain_samples_locked(*stack_table);
+            }
+        }
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+        if (running) {
+            BackgroundSymbolicator::trigger();
+        }
+#endif
+    }
+
+    // Adds new threads and stacks to the stream, then moves out each
+    // thread's finished samples and markers. The last sample is kept unless
+    // all is set. Must be called with threads.mutex held, after
+    // drain_samples.
+    void take_for_stream(bool all) {
+        // Threads are numbered by their position, which doesn't change
+        // since the list is only appended to
+        for (size_t i = stream->threads_added(); i < threads.list.size(); i++) {
+            Thread &thread = *threads.list[i];
+            int flags = 0;
+            if (thread.is_main()) flags |= SampleStream::THREAD_MAIN;
+            if (thread.is_start(start_thread)) flags |= SampleStream::THREAD_START;
+            stream->add_thread(thread.native_tid, thread.started_at, thread.ruby_thread_id, flags);
+        }
+        stream->add_stacks(*stack_table);
+
+        for (int i = 0; i < threads.list.size(); i++) {
+            threads.list[i]->take_for_stream(*stream, i, all);
+        }
+    }
+
+    // Every STREAM_FLUSH_MS, translates each thread's pending samples and
+    // writes out everything finished since the last flush
+    void flush_stream() {
+        TimeStamp now = TimeStamp::Now();
+        if (now - last_stream_flush < TimeStamp::from_milliseconds(STREAM_FLUSH_MS)) {
+            return;
+        }
+        last_stream_flush = now;
+
+        // Only filling the buffer needs the lock, not writing it out
+        {
+            const std::lock_guard<std::mutex> lock(threads.mutex);
+            drain_samples();
+            take_for_stream(false);
+        }
+        stream->flush();
+    }
+
+    // Threads being sampled this iteration. Kept as members so that the
+    // profiler thread doesn't reallocate them every tick.
+    std::vector<LiveSample *> pending_samples;
+    std::vector<Thread *> pending_threads;
+
+    // Translation into the StackTable is deferred until some thread's
+    // buffer is filling up, so that it doesn't add to sampling latency.
+    // Must be called with threads.mutex held.
+    void drain_samples_if_needed() {
+        for (auto &threadptr : threads.list) {
+            if (threadptr->sample_buffer.should_drain()) {
+                drain_samples();
+                return;
+            }
         }
     }
 
     void run_iteration() {
-        TimeStamp sample_start = TimeStamp::Now();
+        if (cpu_mode) {
+            threads.mutex.lock();
+            drain_samples_if_needed();
+            threads.mutex.unlock();
 
-        LiveSample sample;
+            if (stream) {
+                flush_stream();
+            }
+            return;
+        }
+
+        TimeStamp sample_start = TimeStamp::Now();
 
         threads.mutex.lock();
         for (auto &threadptr : threads.list) {
@@ -921,25 +2532,18 @@ class TimeCollector : public BaseCollector {
             //if (thread.state == Thread::State::RUNNING || (thread.state == Thread::State::SUSPENDED && thread.stack_on_suspend_idx < 0)) {
             if (thread.state == Thread::State::RUNNING) {
                 //fprintf(stderr, "sampling %p on tid:%i\n", thread.ruby_thread, thread.native_tid);
-                bool signal_sent = GlobalSignalHandler::get_instance()->record_sample(sample, thread.pthread_id);
-
-                if (!signal_sent) {
-                    // The thread has died. We probably should have caught
-                    // that by the GVL instrumentation, but let's try to get
-                    // it to a consistent state and stop profiling it.
-                    thread.set_state(Thread::State::STOPPED);
-                } else if (sample.sample.empty()) {
-                    // fprintf(stderr, "skipping GC sample\n");
-                } else {
-                    record_sample(sample.sample, sample_start, thread, CATEGORY_NORMAL);
-                }
+                thread.sample_buffer.allocate();
+                thread.live_sample.pthread_id = thread.pthread_id;
+                thread.live_sample.timestamp = sample_start;
+                pending_samples.push_back(&thread.live_sample);
+                pending_threads.push_back(&thread);
             } else if (thread.state == Thread::State::SUSPENDED) {
-                thread.samples.record_sample(
+                thread.sample_buffer.record(
                         thread.stack_on_suspend_idx,
                         sample_start,
                         CATEGORY_IDLE);
             } else if (thread.state == Thread::State::READY) {
-                thread.samples.record_sample(
+                thread.sample_buffer.record(
                         thread.stack_on_suspend_idx,
                         sample_start,
                         CATEGORY_STALLED);
@@ -947,7 +2551,29 @@ class TimeCollector : public BaseCollector {
             }
         }
 
+        GlobalSignalHandler::get_instance()->record_samples(pending_samples);
+
+        for (auto *threadptr : pending_threads) {
+            auto &thread = *threadptr;
+
+            if (!thread.live_sample.sent) {
+                // The thread has died. We probably should have caught
+                // that by the GVL instrumentation, but let's try to get
+                // it to a consistent state and stop profiling it.
+                thread.set_state(Thread::State::STOPPED);
+            }
+        }
+
+        pending_samples.clear();
+        pending_threads.clear();
+
+        drain_samples_if_needed();
+
         threads.mutex.unlock();
+
+        if (stream) {
+            flush_stream();
+        }
     }
 
     static void internal_thread_event_cb(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass) {
@@ -1048,6 +2674,18 @@ class TimeCollector : public BaseCollector {
 
         GlobalSignalHandler::get_instance()->install();
 
+        if (stream) {
+            stream->add_header(started_at, interval, allocation_interval, cpu_mode);
+        }
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+        BackgroundSymbolicator::add(this);
+#endif
+
+        if (cpu_mode) {
+            threads.cpu_interval = interval;
+        }
+
         running = true;
 
         collector_thread.start();
@@ -1068,9 +2706,15 @@ class TimeCollector : public BaseCollector {
 
     VALUE stop() {
         BaseCollector::stop();
+        running = false;
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+        BackgroundSymbolicator::remove(this);
+#endif
 
         collector_thread.stop();
 
+        threads.stop_cpu_timers();
         GlobalSignalHandler::get_instance()->uninstall();
 
         if (RTEST(tp_newobj)) {
@@ -1082,8 +2726,21 @@ class TimeCollector : public BaseCollector {
         rb_remove_event_hook(internal_gc_event_cb);
         rb_remove_event_hook(internal_thread_event_cb);
 
+        threads.mutex.lock();
+        drain_samples();
+        if (stream) {
+            take_for_stream(true);
+        }
+        threads.mutex.unlock();
+
         stack_table->finalize();
 
+        if (stream) {
+            const std::lock_guard<std::mutex> lock(threads.mutex);
+            stream->add_funcs(*stack_table);
+            stream->finish(threads.list);
+        }
+
         VALUE result = build_collector_result();
 
         reset();
@@ -1097,37 +2754,71 @@ class TimeCollector : public BaseCollector {
         VALUE threads = rb_hash_new();
         rb_ivar_set(result, rb_intern("@threads"), threads);
 
-        rb_ivar_set(result, rb_intern("@gc_markers"), this->gc_markers.to_array());
+        VALUE packed_gc_markers = rb_hash_new();
+        rb_ivar_set(result, rb_intern("@packed_gc_markers"), packed_gc_markers);
+        {
+            PackedMarkers packed(packed_gc_markers);
+            this->gc_markers.write_result(packed);
+            packed.write(packed_gc_markers);
+        }
+
+        // What was streamed is left in the file, to be read by Result
+        // when it's needed
+        VALUE stream_file = Qnil;
+        if (stream) {
+            std::unique_ptr<SampleStream> finished = std::move(stream);
+            finished->check_error();
+            stream_file = stream_file_open(rb_str_new(finished->path.data(), finished->path.size()));
+            rb_ivar_set(result, rb_intern("@stream"), stream_file);
+        }
 
-        for (const auto& thread: this->threads.list) {
+        for (int i = 0; i < this->threads.list.size(); i++) {
+            const Thread &thread = *this->threads.list[i];
             VALUE hash = rb_hash_new();
-            thread->samples.write_result(hash);
-            thread->allocation_samples.write_result(hash);
-            rb_hash_aset(hash, sym("markers"), thread->markers->to_array());
-            rb_hash_aset(hash, sym("tid"), ULL2NUM(thread->native_tid));
-            rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread->started_at.nanoseconds()));
-            if (!thread->stopped_at.zero()) {
-                rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(thread->stopped_at.nanoseconds()));
+            VALUE packed = rb_hash_new();
+            rb_hash_aset(hash, sym("packed"), packed);
+            if (!NIL_P(stream_file)) {
+                rb_hash_aset(packed, sym("stream_serial"), INT2NUM(i));
+            }
+
+            SampleList::Packed samples;
+            thread.samples.write_result(samples);
+            samples.write(packed);
+
+            thread.allocation_samples.write_result(packed);
+
+            PackedMarkers markers(packed);
+            thread.markers->write_result(markers);
+            markers.write(packed);
+
+            rb_hash_aset(hash, sym("tid"), ULL2NUM(thread.native_tid));
+            rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread.started_at.nanoseconds()));
+            if (!thread.stopped_at.zero()) {
+                rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(thread.stopped_at.nanoseconds()));
             }
-            rb_hash_aset(hash, sym("is_main"), thread->is_main() ? Qtrue : Qfalse);
-            rb_hash_aset(hash, sym("is_start"), thread->is_start(BaseCollector::start_thread) ? Qtrue : Qfalse);
+            rb_hash_aset(hash, sym("is_main"), thread.is_main() ? Qtrue : Qfalse);
+            rb_hash_aset(hash, sym("is_start"), thread.is_start(BaseCollector::start_thread) ? Qtrue : Qfalse);
 
-            rb_hash_aset(threads, thread->ruby_thread_id, hash);
+            rb_hash_aset(threads, thread.ruby_thread_id, hash);
         }
 
         return result;
     }
 
     void mark() {
-        stack_table->mark_frames();
         rb_gc_mark(stack_table_value);
         threads.mark();
+    }
 
-        //for (int i = 0; i < queued_length; i++) {
-        //    rb_gc_mark(queued_frames[i]);
-        //}
+    void compact() {
+        threads.compact();
+    }
 
-        // FIXME: How can we best mark buffered or pending frames?
+    void add_memory_usage(MemoryUsage &usage) {
+        usage.collector += sizeof(TimeCollector);
+        if (stream) usage.collector += stream->memsize();
+        usage.markers += gc_markers.memsize();
+        threads.add_memory_usage(usage);
     }
 };
 
@@ -1143,6 +2834,14 @@ collector_free(void *data) {
     delete collector;
 }
 
+static size_t
+collector_memsize(const void *data) {
+    BaseCollector *collector = static_cast<BaseCollector *>(const_cast<void *>(data));
+    MemoryUsage usage;
+    collector->add_memory_usage(usage);
+    return usage.total();
+}
+
 static void
 collector_compact(void *data) {
     BaseCollector *collector = static_cast<BaseCollector *>(data);
@@ -1154,7 +2853,7 @@ static const rb_data_type_t rb_collector_type = {
     .function = {
         .dmark = collector_mark,
         .dfree = collector_free,
-        .dsize = nullptr,
+        .dsize = collector_memsize,
         .dcompact = collector_compact,
     },
 };
@@ -1184,11 +2883,57 @@ collector_stop(VALUE self) {
     return result;
 }
 
+static VALUE
+collector_compact_stack_table(int argc, VALUE *argv, VALUE self) {
+    auto *collector = get_collector(self);
+
+    VALUE discard_before_v;
+    rb_scan_args(argc, argv, "01", &discard_before_v);
+    TimeStamp discard_before = NIL_P(discard_before_v) ? TimeStamp::Zero() : TimeStamp::from_nanoseconds(NUM2ULL(discard_before_v));
+
+    return INT2NUM(collector->compact_stack_table(discard_before));
+}
+
+static VALUE
+collector_memory_usage(VALUE self) {
+    auto *collector = get_collector(self);
+
+    MemoryUsage usage;
+    collector->add_memory_usage(usage);
+    size_t stack_table = collector->stack_table->memsize();
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym("stack_table"), ULL2NUM(stack_table));
+    rb_hash_aset(hash, sym("samples"), ULL2NUM(usage.samples));
+    rb_hash_aset(hash, sym("allocation_samples"), ULL2NUM(usage.allocation_samples));
+    rb_hash_aset(hash, sym("markers"), ULL2NUM(usage.markers));
+    rb_hash_aset(hash, sym("sample_buffers"), ULL2NUM(usage.sample_buffers));
+    rb_hash_aset(hash, sym("collector"), ULL2NUM(usage.collector));
+    rb_hash_aset(hash, sym("total"), ULL2NUM(stack_table + usage.total()));
+    return hash;
+}
+
 static VALUE collector_new(VALUE self, VALUE mode, VALUE options) {
     BaseCollector *collector;
 
-    VALUE stack_table = StackTable::stack_table_new();
-    if (mode == sym("wall")) {
+    // A StackTable passed in is reused as-is, keeping the stacks and
+    // functions it already has from earlier sessions
+    VALUE stack_table = rb_hash_aref(options, sym("stack_table"));
+    if (NIL_P(stack_table)) {
+        stack_table = StackTable::stack_table_new();
+    } else {
+        get_stack_table(stack_table); // raises TypeError for anything else
+    }
+    bool owns_stack_table = NIL_P(rb_hash_aref(options, sym("stack_table")));
+
+    if (mode == sym("wall") || mode == sym("cpu")) {
+        bool cpu_mode = mode == sym("cpu");
+#ifndef HAVE_CPU_TIMERS
+        if (cpu_mode) {
+            rb_raise(rb_eNotImpError, "cpu mode is not supported on this platform");
+        }
+#endif
+
         VALUE intervalv = rb_hash_aref(options, sym("interval"));
         TimeStamp interval;
         if (NIL_P(intervalv)) {
@@ -1207,10 +2952,23 @@ static VALUE collector_new(VALUE self, VALUE mode, VALUE options) {
         } else {
             allocation_interval = NUM2UINT(allocation_intervalv);
         }
-        collector = new TimeCollector(stack_table, interval, allocation_interval);
+        // Opened here so that a bad path raises before anything is set up
+        SampleStream *stream = nullptr;
+        VALUE stream_path = rb_hash_aref(options, sym("stream"));
+        if (!NIL_P(stream_path)) {
+            stream_path = rb_get_path(stream_path);
+            FILE *file = fopen(StringValueCStr(stream_path), "wb");
+            if (!file) {
+                rb_sys_fail_str(stream_path);
+            }
+            stream = new SampleStream(file, StringValueCStr(stream_path));
+        }
+
+        collector = new TimeCollector(stack_table, interval, allocation_interval, cpu_mode, stream);
     } else {
         rb_raise(rb_eArgError, "invalid mode");
     }
+    collector->owns_stack_table = owns_stack_table;
     VALUE obj = TypedData_Wrap_Struct(self, &rb_collector_type, collector);
     rb_ivar_set(obj, rb_intern("@stack_table"), stack_table);
     rb_funcall(obj, rb_intern("initialize"), 2, mode, options);
@@ -1254,11 +3012,27 @@ Init_vernier(void)
   rb_define_singleton_method(rb_cTimeCollector, "new", collector_new, 2);
   rb_define_method(rb_cTimeCollector, "start", collector_start, 0);
   rb_define_private_method(rb_cTimeCollector, "finish",  collector_stop, 0);
+  rb_define_method(rb_cTimeCollector, "memory_usage", collector_memory_usage, 0);
+  rb_define_method(rb_cTimeCollector, "compact_stack_table", collector_compact_stack_table, -1);
+
+  rb_cStreamFile = rb_define_class_under(rb_mVernier, "StreamFile", rb_cObject);
+  rb_undef_alloc_func(rb_cStreamFile);
+  rb_define_singleton_method(rb_cStreamFile, "new", stream_file_new, 1);
+  rb_define_method(rb_cStreamFile, "complete?", stream_file_complete_p, 0);
+  rb_define_method(rb_cStreamFile, "meta", stream_file_meta, 0);
+  rb_define_method(rb_cStreamFile, "threads", stream_file_threads, 0);
+  rb_define_method(rb_cStreamFile, "thread_data", stream_file_thread_data, 1);
+  rb_define_method(rb_cStreamFile, "stack_table", stream_file_stack_table, 0);
 
   Init_consts(rb_mVernierMarkerPhase);
   Init_memory();
   Init_stack_table();
   Init_heap_tracker();
+  Init_json_writer();
+  Init_mapped_file();
+  Init_pprof();
+  Init_merged_stack_table();
+  Init_firefox_tables();
 
   //static VALUE gc_hook = Data_Wrap_Struct(rb_cObject, collector_mark, NULL, &_collector);
   //rb_global_variable(&gc_hook);
@@ -13,5 +13,10 @@ extern VALUE rb_mVernier;
 void Init_memory();
 void Init_stack_table();
 void Init_heap_tracker();
+void Init_json_writer();
+void Init_mapped_file();
+void Init_pprof();
+void Init_merged_stack_table();
+void Init_firefox_tables();
 
 #endif /* VERNIER_H */
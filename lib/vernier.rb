@@ -14,6 +14,11 @@ require "vernier/output/top"
 require "vernier/output/file_listing"
 require "vernier/output/filename_filter"
 require "vernier/output/markdown"
+require "vernier/output/binary"
+require "vernier/output/pprof"
+require "vernier/output/folded"
+require "vernier/merged_profile"
+require "vernier/diff_profile"
 require "vernier/vernier"
 
 module Vernier
@@ -17,6 +17,7 @@ module Vernier
     @options.freeze
 
     def self.start
+      mode = options.fetch(:mode, "wall").to_sym
       interval = options.fetch(:interval, 500).to_i
       allocation_interval = options.fetch(:allocation_interval, 0).to_i
       hooks = options.fetch(:hooks, "").split(",")
@@ -28,7 +29,7 @@ module Vernier
 
       STDERR.puts("starting profiler with interval #{interval} and allocation interval #{allocation_interval}")
 
-      @collector = Vernier::Collector.new(:wall, interval:, allocation_interval:, hooks:, metadata:)
+      @collector = Vernier::Collector.new(mode, interval:, allocation_interval:, hooks:, metadata:)
       @collector.start
     end
 
@@ -53,6 +54,12 @@ module Vernier
           ".vernier.cpuprofile"
         when "markdown", "md"
           ".vernier.md"
+        when "folded"
+          ".vernier.folded"
+        when "pprof"
+          ".vernier.pb.gz"
+        when "vernier-bin"
+          ".vernier.bin"
         else
           ".vernier.json.gz"
         end
@@ -0,0 +1,243 @@
+# frozen_string_literal: true
+
+require "json"
+require_relative "stack_table_helpers"
+require "vernier/vernier"
+
+module Vernier
+  # Reads profiles written with Result#write(format: "vernier-bin"). The file
+  # is mapped rather than loaded, and nothing is parsed up front: tables are
+  # read straight out of the mapping as they're accessed, so viewing a large
+  # profile only reads the parts that are used.
+  #
+  # The format is little-endian throughout. A 16 byte header of "VERNIERB",
+  # a uint32 version and a uint32 section count is followed by a directory
+  # of 32 byte entries, each a NUL-padded 16 byte name and uint64 offset and
+  # size. Sections are 8 byte aligned:
+  #
+  #   meta             JSON
+  #   strings          uint32 count, uint32 offsets[count + 1], then bytes
+  #   stack_parent     int32 per stack, -1 for roots
+  #   stack_frame      int32 per stack
+  #   frame_func       int32 per frame
+  #   frame_line       int32 per frame
+  #   func_name        uint32 string index per func
+  #   func_filename    uint32 string index per func
+  #   func_first_line  int32 per func
+  #   threads          THREAD records
+  #   samples          int32 stack index per sample, all threads in order
+  #   weights          uint32 per sample
+  #   timestamps       uint64 per sample
+  #   markers          MARKER records, all threads in order
+  class BinaryProfile
+    MAGIC = "VERNIERB".b
+    VERSION = 1
+    HEADER_SIZE = 16
+    DIRECTORY_ENTRY_SIZE = 32
+
+    # tid, name, flags, started_at, first sample, sample count, first
+    # marker, marker count
+    THREAD = "Q<L<L<Q<Q<Q<L<L<"
+    THREAD_SIZE = 48
+    THREAD_MAIN = 1
+    THREAD_START = 2
+
+    # name, phase, start, finish (-1 for none), data (a JSON string index,
+    # or NO_STRING) and padding
+    MARKER = "L<L<Q<q<L<L<"
+    MARKER_SIZE = 32
+    NO_STRING = 0xffff_ffff
+
+    def self.binary?(filename)
+      File.binread(filename, MAGIC.bytesize) == MAGIC
+    end
+
+    def self.read_file(filename)
+      new(MappedFile.new(filename))
+    end
+
+    attr_reader :file
+
+    def initialize(file)
+      @file = file
+      unless file.size >= HEADER_SIZE && file.bytes(0, MAGIC.bytesize) == MAGIC
+        raise ArgumentError, "not a vernier-bin profile"
+      end
+      version = file.uint32(8)
+      unless version == VERSION
+        raise ArgumentError, "unsupported vernier-bin version #{version}"
+      end
+
+      @sections = {}
+      file.uint32(12).times do |i|
+        entry = HEADER_SIZE + i * DIRECTORY_ENTRY_SIZE
+        name = file.bytes(entry, 16).delete("\0")
+        @sections[name] = [file.uint64(entry + 16), file.uint64(entry + 24)]
+      end
+    end
+
+    # Returns the offset and size of a section
+    def section(name)
+      @sections.fetch(name) { raise ArgumentError, "vernier-bin profile has no #{name} section" }
+    end
+
+    def meta
+      @meta ||= JSON.parse(@file.bytes(*section("meta")), symbolize_names: true)
+    end
+
+    def strings
+      @strings ||= StringTable.new(self)
+    end
+
+    def stack_table
+      @stack_table ||= StackTable.new(self)
+    end
+
+    def threads
+      @threads ||= begin
+        offset, size = section("threads")
+        Array.new(size / THREAD_SIZE) do |i|
+          Thread.new(self, @file.bytes(offset + i * THREAD_SIZE, THREAD_SIZE).unpack(THREAD))
+        end
+      end
+    end
+
+    def main_thread
+      threads.detect(&:main_thread?)
+    end
+
+    # [samples, weights] for each thread, as packed int32 and uint32 strings
+    def sample_weights
+      threads.map { [_1.packed_column("samples"), _1.packed_column("weights")] }
+    end
+
+    def inspect
+      "#<#{self.class} #{threads.size} threads, #{stack_table.stack_count} stacks>"
+    end
+
+    class StringTable
+      def initialize(profile)
+        @file = profile.file
+        offset, _size = profile.section("strings")
+        @count = @file.uint32(offset)
+        @offsets = offset + 4
+        @data = @offsets + (@count + 1) * 4
+        @cache = {}
+      end
+
+      attr_reader :count
+
+      def [](idx)
+        @cache[idx] ||= begin
+          raise IndexError, "string #{idx} out of range" unless idx >= 0 && idx < @count
+          start = @file.uint32(@offsets + idx * 4)
+          finish = @file.uint32(@offsets + idx * 4 + 4)
+          @file.bytes(@data + start, finish - start).force_encoding(Encoding::UTF_8)
+        end
+      end
+    end
+
+    class StackTable
+      def initialize(profile)
+        @file = profile.file
+        @strings = profile.strings
+        @stack_parents, @stack_count = column(profile, "stack_parent")
+        @stack_frames, _ = column(profile, "stack_frame")
+        @frame_funcs, @frame_count = column(profile, "frame_func")
+        @frame_lines, _ = column(profile, "frame_line")
+        @func_names, @func_count = column(profile, "func_name")
+        @func_filenames, _ = column(profile, "func_filename")
+        @func_first_lines, _ = column(profile, "func_first_line")
+      end
+
+      attr_reader :strings, :stack_count, :frame_count, :func_count
+
+      def stack_parent_idx(idx)
+        parent = @file.int32(@stack_parents + check(idx, @stack_count) * 4)
+        parent unless parent < 0
+      end
+
+      def stack_frame_idx(idx) = @file.int32(@stack_frames + check(idx, @stack_count) * 4)
+
+      def frame_func_idx(idx) = @file.int32(@frame_funcs + check(idx, @frame_count) * 4)
+      def frame_line_no(idx) = @file.int32(@frame_lines + check(idx, @frame_count) * 4)
+
+      def func_name_idx(idx) = @file.uint32(@func_names + check(idx, @func_count) * 4)
+      def func_filename_idx(idx) = @file.uint32(@func_filenames + check(idx, @func_count) * 4)
+      def func_name(idx) = @strings[func_name_idx(idx)]
+      def func_filename(idx) = @strings[func_filename_idx(idx)]
+      alias func_path func_filename
+      def func_first_lineno(idx) = @file.int32(@func_first_lines + check(idx, @func_count) * 4)
+
+      include StackTableHelpers
+
+      private
+
+      def column(profile, name)
+        offset, size = profile.section(name)
+        [offset, size / 4]
+      end
+
+      def check(idx, count)
+        raise IndexError, "index #{idx} out of range" unless idx >= 0 && idx < count
+        idx
+      end
+    end
+
+    class Thread
+      attr_reader :tid, :started_at, :sample_count, :marker_count
+
+      def initialize(profile, record)
+        @profile = profile
+        @file = profile.file
+        @tid, @name_idx, @flags, @started_at, @first_sample, @sample_count, @first_marker, @marker_count = record
+      end
+
+      def name = @profile.strings[@name_idx]
+      def main_thread? = @flags & THREAD_MAIN != 0
+      def start_thread? = @flags & THREAD_START != 0
+      def stack_table = @profile.stack_table
+
+      def samples
+        @samples ||= @file.int32_array(column_offset("samples", 4), @sample_count)
+      end
+
+      def weights
+        @weights ||= @file.uint32_array(column_offset("weights", 4), @sample_count)
+      end
+
+      def timestamps
+        @timestamps ||= @file.uint64_array(column_offset("timestamps", 8), @sample_count)
+      end
+
+      # Markers as [name, start, finish, phase, data]
+      def markers
+        offset, _size = @profile.section("markers")
+        offset += @first_marker * MARKER_SIZE
+        strings = @profile.strings
+        Array.new(@marker_count) do |i|
+          name, phase, start, finish, data = @file.bytes(offset + i * MARKER_SIZE, MARKER_SIZE).unpack(MARKER)
+          data = JSON.parse(strings[data], symbolize_names: true) unless data == NO_STRING
+          [strings[name], start, (finish unless finish < 0), phase, data]
+        end
+      end
+
+      # Emulate hash
+      def [](name)
+        send(name)
+      end
+
+      # The thread's slice of a 4 byte per sample section, unparsed
+      def packed_column(name)
+        @file.bytes(column_offset(name, 4), @sample_count * 4)
+      end
+
+      private
+
+      def column_offset(name, element_size)
+        offset, _size = @profile.section(name)
+        offset + @first_sample * element_size
+      end
+    end
+  end
+end
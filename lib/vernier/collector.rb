@@ -7,7 +7,7 @@ module Vernier
   class Collector
     class CustomCollector < Collector
       def initialize(mode, options)
-        @stack_table = StackTable.new
+        @stack_table = options[:stack_table] || StackTable.new
 
         @samples = []
         @timestamps = []
@@ -47,7 +47,7 @@ module Vernier
 
     class RetainedCollector < Collector
       def initialize(mode, options)
-        @stack_table = StackTable.new
+        @stack_table = options[:stack_table] || StackTable.new
         @heap_tracker = HeapTracker.new(@stack_table)
 
         @started_at = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
@@ -62,6 +62,13 @@ module Vernier
         @heap_tracker.drain
       end
 
+      def memory_usage
+        usage = super
+        usage[:heap_tracker] = ObjectSpace.memsize_of(@heap_tracker)
+        usage[:total] += usage[:heap_tracker]
+        usage
+      end
+
       def finish
         @heap_tracker.drain
 
@@ -99,8 +106,12 @@ module Vernier
     def self.new(mode, options = {})
       return super unless Collector.equal?(self)
 
+      if options[:stack_table] == :shared
+        options = options.merge(stack_table: StackTable.shared)
+      end
+
       case mode
-      when :wall
+      when :wall, :cpu
         TimeCollector.new(mode, options)
       when :custom
         CustomCollector.new(mode, options)
@@ -138,6 +149,16 @@ module Vernier
 
     attr_reader :stack_table
 
+    ##
+    # Returns the memory, in bytes, used by the profiler's own data
+    # structures, broken down by component.
+    def memory_usage
+      require "objspace"
+      usage = { stack_table: ObjectSpace.memsize_of(stack_table) }
+      usage[:total] = usage.values.sum
+      usage
+    end
+
     private def add_hook(hook)
       case hook.to_s.to_sym
       when :rails, :activesupport
@@ -203,51 +224,56 @@ module Vernier
         hook.disable
       end
 
-      result.threads.each do |obj_id, thread|
-        thread[:name] ||= @thread_names[obj_id]
-      end
-
       result.hooks = @hooks
 
       end_time = Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond)
       result.pid = Process.pid
       result.end_time = end_time
 
-      marker_strings = Marker.name_table
+      thread_names = @thread_names
+      user_markers = @markers || []
+      stopped_at = current_time
+
+      result.finish_threads do |threads|
+        threads.each do |obj_id, thread|
+          thread[:name] ||= thread_names[obj_id]
+        end
+
+        marker_strings = Marker.name_table
 
-      markers_by_thread_id = (@markers || []).group_by(&:first)
+        markers_by_thread_id = user_markers.group_by(&:first)
 
-      result.threads.each do |tid, thread|
-        last_fiber = nil
-        markers = []
+        threads.each do |tid, thread|
+          last_fiber = nil
+          markers = []
 
-        markers.concat markers_by_thread_id.fetch(tid, [])
+          markers.concat markers_by_thread_id.fetch(tid, [])
 
-        original_markers = thread[:markers] || []
-        original_markers += result.gc_markers || []
-        original_markers.each do |data|
-          type, phase, ts, te, stack, extra_info = data
-          if type == Marker::Type::FIBER_SWITCH
-            if last_fiber
-              start_event = markers[last_fiber]
-              markers << [nil, "Fiber Running", start_event[2], ts, Marker::Phase::INTERVAL, start_event[5].merge(type: "Fiber Running", cause: nil)]
+          original_markers = thread[:markers] || []
+          original_markers += result.gc_markers || []
+          original_markers.each do |data|
+            type, phase, ts, te, stack, extra_info = data
+            if type == Marker::Type::FIBER_SWITCH
+              if last_fiber
+                start_event = markers[last_fiber]
+                markers << [nil, "Fiber Running", start_event[2], ts, Marker::Phase::INTERVAL, start_event[5].merge(type: "Fiber Running", cause: nil)]
+              end
+              last_fiber = markers.size
             end
-            last_fiber = markers.size
+            name = marker_strings[type]
+            sym = Marker::MARKER_SYMBOLS[type]
+            data = { type: sym }
+            data[:cause] = { stack: stack } if stack
+            data.merge!(extra_info) if extra_info
+            markers << [tid, name, ts, te, phase, data]
+          end
+          if last_fiber
+            start_event = markers[last_fiber]
+            markers << [nil, "Fiber Running", start_event[2], stopped_at, Marker::Phase::INTERVAL, start_event[5].merge(type: "Fiber Running", cause: nil)]
           end
-          name = marker_strings[type]
-          sym = Marker::MARKER_SYMBOLS[type]
-          data = { type: sym }
-          data[:cause] = { stack: stack } if stack
-          data.merge!(extra_info) if extra_info
-          markers << [tid, name, ts, te, phase, data]
-        end
-        if last_fiber
-          end_time = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
-          start_event = markers[last_fiber]
-          markers << [nil, "Fiber Running", start_event[2], end_time, Marker::Phase::INTERVAL, start_event[5].merge(type: "Fiber Running", cause: nil)]
-        end
 
-        thread[:markers] = markers
+          thread[:markers] = markers
+        end
       end
 
       #markers.concat @markers
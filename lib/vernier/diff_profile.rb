@@ -0,0 +1,157 @@
+# frozen_string_literal: true
+
+require_relative "merged_profile"
+require_relative "output/firefox"
+require_relative "output/diff_markdown"
+
+module Vernier
+  # The difference between a base and a candidate profile, as returned by
+  # Vernier.diff. Both are merged into one MergedStackTable, which aligns
+  # their stacks by func name, filename and line, with their weights kept
+  # as separate series.
+  #
+  # Weights are normalized by each profile's total, so profiles of
+  # different lengths compare by their share of samples. Deltas are given
+  # in candidate samples: the base is scaled to the candidate's total.
+  # Profiles of different modes can't be compared and raise ArgumentError.
+  class DiffProfile
+    BASE = 0
+    CANDIDATE = 1
+
+    attr_reader :base_total, :candidate_total
+
+    def initialize(base, candidate)
+      @merged = MergedProfile.new
+      @merged.merge(base, series: BASE)
+      @merged.merge(candidate, series: CANDIDATE)
+
+      @base_total = stack_table.weights(BASE)[1].sum
+      @candidate_total = stack_table.weights(CANDIDATE)[1].sum
+    end
+
+    def stack_table = @merged.stack_table
+    def _stack_table = stack_table
+
+    # How much a base sample counts for in candidate samples
+    def scale
+      @base_total == 0 ? 1.0 : @candidate_total.to_f / @base_total
+    end
+
+    def meta
+      @meta ||= @merged.meta.merge(
+        user_metadata: {
+          "base" => "#{@base_total} samples",
+          "candidate" => "#{@candidate_total} samples",
+        }
+      )
+    end
+
+    def started_at = @merged.started_at || 0
+    def end_time = @merged.end_time
+    def pid = @merged.pid
+    def hooks = []
+
+    # [stack, base weight, candidate weight, delta] for each stack sampled
+    # in either profile, with the delta in candidate samples
+    def stack_deltas
+      @stack_deltas ||= begin
+        base = stack_table.weights(BASE).transpose.to_h
+        candidate = stack_table.weights(CANDIDATE).transpose.to_h
+        scale = self.scale
+        (base.keys | candidate.keys).sort.map do |stack|
+          base_weight = base.fetch(stack, 0)
+          candidate_weight = candidate.fetch(stack, 0)
+          [stack, base_weight, candidate_weight, candidate_weight - base_weight * scale]
+        end
+      end
+    end
+
+    # Self and total weight by func name for a series, in the shape used by
+    # Output::Markdown's hotspot tables
+    def funcs(series)
+      self_weights, total_weights = stack_table.func_weights(series)
+      funcs = Hash.new { |h, k| h[k] = { self: 0, total: 0, file: nil, line: nil } }
+      stack_table.func_count.times do |idx|
+        next if self_weights[idx] == 0 && total_weights[idx] == 0
+        func = funcs[stack_table.func_name(idx)]
+        func[:self] += self_weights[idx]
+        func[:total] += total_weights[idx]
+        func[:file] ||= stack_table.func_filename(idx)
+        func[:line] ||= stack_table.func_first_lineno(idx)
+      end
+      funcs.default_proc = nil
+      funcs
+    end
+
+    # A single thread weighted by each stack's delta, rounded to whole
+    # samples, for viewing in the Firefox profiler
+    def threads
+      samples, weights = [], []
+      stack_deltas.each do |stack, _base, _candidate, delta|
+        delta = delta.round
+        next if delta == 0
+        samples << stack
+        weights << delta
+      end
+      {
+        0 => {
+          tid: 0,
+          name: "diff",
+          is_main: true,
+          started_at: started_at,
+          samples: samples,
+          weights: weights,
+          timestamps: nil,
+          markers: [],
+        }
+      }
+    end
+
+    def main_thread
+      threads[0]
+    end
+
+    def stack(idx)
+      stack_table.stack(idx)
+    end
+
+    def to_firefox(gzip: false)
+      Output::Firefox.new(self).output(gzip: gzip)
+    end
+
+    def to_markdown(top_n: Output::Markdown::DEFAULT_TOP_N)
+      Output::DiffMarkdown.new(self, top_n: top_n).output
+    end
+
+    def write(out:, format: "firefox")
+      case format
+      when "markdown", "md"
+        if out.respond_to?(:write)
+          out.write(to_markdown)
+        else
+          File.binwrite(out, to_markdown)
+        end
+      when "firefox", nil
+        if out.respond_to?(:write)
+          Output::Firefox.new(self).write(out)
+        else
+          File.open(out, "wb") do |file|
+            Output::Firefox.new(self).write(file, gzip: out.end_with?(".gz"))
+          end
+        end
+      else
+        raise ArgumentError, "unknown format for a diff: #{format}"
+      end
+    end
+
+    def inspect
+      "#<#{self.class} #{@base_total} base samples, #{@candidate_total} candidate samples, #{stack_table.stack_count} stacks>"
+    end
+  end
+
+  # Compares two profiles, each a Result or a filename as taken by
+  # Vernier.merge
+  def self.diff(base, candidate)
+    DiffProfile.new(base, candidate)
+  end
+end
@@ -0,0 +1,168 @@
+# frozen_string_literal: true
+
+require_relative "stack_table_helpers"
+require_relative "parsed_profile"
+require_relative "output/binary"
+require_relative "output/filename_filter"
+require_relative "output/folded"
+require "vernier/vernier"
+
+module Vernier
+  class MergedStackTable
+    include StackTableHelpers
+  end
+
+  # Sums the samples of many profiles into one, as returned by
+  # Vernier.merge. All threads of all profiles are merged into a single
+  # thread, weighted by stack, so sample order and timestamps aren't kept.
+  class MergedProfile
+    attr_reader :stack_table, :meta, :started_at, :end_time, :pid, :profile_count
+
+    def initialize
+      @stack_table = MergedStackTable.new
+      @meta = {}
+      @intervals = {}
+      @started_at = @end_time = nil
+      @pid = Process.pid
+      @profile_count = 0
+    end
+
+    def _stack_table = @stack_table
+
+    # Merges a profile into this one: a filename of a Firefox, vernier-bin or
+    # streamed profile, or a Result, BinaryProfile, StreamedProfile or
+    # ParsedProfile. Only the profile's
+    # stacks and weights are kept, so the profile can be dropped afterwards.
+    # Weights are summed into series 0 unless another series is given.
+    # Raises ArgumentError if the profile's mode differs from those merged
+    # before it, or its interval from those merged into the same series.
+    def merge(profile, series: 0)
+      profile = ParsedProfile.read_file(profile) if profile.is_a?(String)
+
+      case profile
+      when Result
+        merge_meta(series, profile.meta, profile.started_at, profile.end_time)
+        # Files have their filenames filtered when written, so live ones
+        # are filtered the same way to line up with them
+        table = profile._stack_table.to_h
+        filter = Output::FilenameFilter.new
+        table[:func_table][:filename].map! { filter.call(_1) }
+        @stack_table.merge(table, profile.sample_weights, series)
+      when BinaryProfile
+        merge_meta(series, profile.meta, profile.meta[:started_at], profile.meta[:end_time])
+        @stack_table.merge(profile.stack_table.to_h, profile.sample_weights, series)
+      when StreamedProfile
+        merge_meta(series, profile.meta, profile.meta[:started_at], nil)
+        # Streams hold paths as recorded, like a Result
+        table = profile.stack_table.to_h
+        filter = Output::FilenameFilter.new
+        table[:func_table][:filename].map! { filter.call(_1) }
+        @stack_table.merge(table, profile.sample_weights, series)
+      when ParsedProfile
+        # Firefox profiles don't record the mode or interval
+        start_time = profile.data.dig("meta", "startTime")
+        merge_meta(series, {}, start_time && (start_time * 1_000_000).to_i, nil)
+        # and have a stack table per thread
+        profile.threads.each do |thread|
+          @stack_table.merge(thread.stack_table.to_h, [[thread.samples, thread.weights]], series)
+        end
+      else
+        raise ArgumentError, "can't merge #{profile.class}"
+      end
+
+      @profile_count += 1
+      self
+    end
+
+    def threads
+      samples, weights = @stack_table.weights
+      {
+        0 => {
+          tid: 0,
+          name: "merged",
+          is_main: true,
+          started_at: @started_at,
+          samples: samples,
+          weights: weights,
+          timestamps: nil,
+          markers: [],
+        }
+      }
+    end
+
+    def main_thread
+      threads[0]
+    end
+
+    def sample_weights
+      [@stack_table.weights]
+    end
+
+    def stack(idx)
+      stack_table.stack(idx)
+    end
+
+    def total_weights
+      @stack_table.weights[1].sum
+    end
+
+    def to_folded
+      Output::Folded.new(self).output
+    end
+
+    def write(out:, format: "vernier-bin")
+      case format
+      when "folded"
+        if out.respond_to?(:write)
+          out.write(to_folded)
+        else
+          File.binwrite(out, to_folded)
+        end
+      when "vernier-bin", nil
+        if out.respond_to?(:write)
+          Output::Binary.new(self).write(out)
+        else
+          File.open(out, "wb") do |file|
+            Output::Binary.new(self).write(file)
+          end
+        end
+      else
+        raise ArgumentError, "unknown format for a merged profile: #{format}"
+      end
+    end
+
+    def inspect
+      "#<#{self.class} #{@profile_count} profiles, #{@stack_table.stack_count} stacks>"
+    end
+
+    private
+
+    # Keeps the first known settings, and the span covering all the
+    # profiles. Weights of different modes can't be summed or compared, nor
+    # summed across intervals, but profiles which don't record them are
+    # taken as they are.
+    def merge_meta(series, meta, started_at, end_time)
+      meta = { mode: meta[:mode]&.to_sym, interval: meta[:interval], allocation_interval: meta[:allocation_interval] }
+      if meta[:mode] && @meta[:mode] && meta[:mode] != @meta[:mode]
+        raise ArgumentError, "profiles have different modes: #{@meta[:mode]} and #{meta[:mode]}"
+      end
+      interval = @intervals[series]
+      if meta[:interval] && interval && meta[:interval] != interval
+        raise ArgumentError, "profiles have different intervals: #{interval} and #{meta[:interval]}"
+      end
+      @intervals[series] ||= meta[:interval]
+      @meta = meta.compact.merge(@meta)
+      @started_at = [@started_at, started_at].compact.min
+      @end_time = [@end_time, end_time].compact.max
+    end
+  end
+
+  # Merges profiles into a MergedProfile with their samples summed by
+  # stack. Each may be a filename or a Result, and they're merged one at a
+  # time, so memory is bounded by the stacks of the merged profile.
+  def self.merge(*profiles)
+    profiles.each_with_object(MergedProfile.new) do |profile, merged|
+      merged.merge(profile)
+    end
+  end
+end
@@ -23,15 +23,34 @@ module Vernier
       result = Vernier.trace(interval:, allocation_interval:, hooks: HOOKS) do
         @app.call(env)
       end
-      body = result.to_firefox(gzip: true)
       filename = "#{request.path.gsub("/", "_")}_#{DateTime.now.strftime("%Y-%m-%d-%H-%M-%S")}.vernier.json.gz"
       headers = {
         "Content-Type" => "application/octet-stream",
-        "Content-Disposition" => "attachment; filename=\"#{filename}\"",
-        "Content-Length" => body.bytesize.to_s
+        "Content-Disposition" => "attachment; filename=\"#{filename}\""
       }
 
-      Rack::Response.new(body, 200, headers).finish
+      Rack::Response.new(ProfileBody.new(result), 200, headers).finish
+    end
+
+    # Generates and compresses the profile as the response is sent, so
+    # that neither the JSON nor the gzipped profile is held in memory.
+    # Each thread's tables are only built once the response reaches them.
+    class ProfileBody
+      def initialize(result)
+        @result = result
+      end
+
+      def each(&block)
+        Output::Firefox.new(@result).write(ChunkWriter.new(block), gzip: true)
+      end
+
+      ChunkWriter = Struct.new(:block) do
+        def write(chunk)
+          block.call(chunk)
+          chunk.bytesize
+        end
+      end
+      private_constant :ChunkWriter
     end
   end
 end
@@ -0,0 +1,123 @@
+# frozen_string_literal: true
+
+require "json"
+require_relative "filename_filter"
+require_relative "../binary_profile"
+
+module Vernier
+  module Output
+    # Writes the vernier-bin format read by BinaryProfile, which describes
+    # the layout. Filenames are filtered as in the Firefox output.
+    class Binary
+      def initialize(profile)
+        @profile = profile
+        @strings = {}
+      end
+
+      def write(io)
+        sections = build_sections
+
+        offset = BinaryProfile::HEADER_SIZE + sections.size * BinaryProfile::DIRECTORY_ENTRY_SIZE
+        directory = sections.map do |name, bytes|
+          offset = align(offset)
+          entry = [name, offset, bytes.bytesize].pack("a16Q<Q<")
+          offset += bytes.bytesize
+          entry
+        end
+
+        written = io.write(BinaryProfile::MAGIC, [BinaryProfile::VERSION, sections.size].pack("L<L<"), *directory)
+        sections.each do |_name, bytes|
+          padding = align(written) - written
+          written += io.write("\0" * padding) if padding > 0
+          written += io.write(bytes)
+        end
+        written
+      end
+
+      private
+
+      def align(offset)
+        (offset + 7) & ~7
+      end
+
+      def string_idx(string)
+        @strings[string] ||= @strings.size
+      end
+
+      def build_sections
+        stack_table = @profile._stack_table
+        table = stack_table.to_h
+        filter = FilenameFilter.new
+
+        funcs = table[:func_table]
+        func_names = funcs[:name].map { string_idx(_1) }
+        func_filenames = funcs[:filename].map { string_idx(filter.call(_1)) }
+
+        threads = []
+        samples = []
+        weights = []
+        timestamps = []
+        markers = []
+        marker_count = 0
+        @profile.threads.each do |tid, thread|
+          flags = 0
+          flags |= BinaryProfile::THREAD_MAIN if thread[:is_main]
+          flags |= BinaryProfile::THREAD_START if thread[:is_start]
+          thread_samples = thread[:samples]
+          thread_markers = thread[:markers] || []
+          threads << [
+            thread[:tid] || 0, string_idx(thread[:name].to_s), flags, thread[:started_at] || 0,
+            samples.size, thread_samples.size, marker_count, thread_markers.size
+          ].pack(BinaryProfile::THREAD)
+
+          samples.concat(thread_samples)
+          weights.concat(thread[:weights])
+          timestamps.concat(thread[:timestamps] || Array.new(thread_samples.size, 0))
+
+          thread_markers.each do |_tid, name, start, finish, phase, data|
+            data_idx = data ? string_idx(JSON.generate(data)) : BinaryProfile::NO_STRING
+            markers << [string_idx(name), phase, start, finish || -1, data_idx, 0].pack(BinaryProfile::MARKER)
+          end
+          marker_count += thread_markers.size
+        end
+
+        meta = {
+          mode: @profile.meta[:mode],
+          interval: @profile.meta[:interval],
+          allocation_interval: @profile.meta[:allocation_interval],
+          started_at: @profile.started_at,
+          end_time: @profile.end_time,
+          pid: @profile.pid,
+          user_metadata: @profile.meta[:user_metadata],
+        }
+
+        {
+          "meta" => JSON.generate(meta),
+          "strings" => pack_strings,
+          "stack_parent" => table[:stack_table][:parent].map { _1 || -1 }.pack("l<*"),
+          "stack_frame" => table[:stack_table][:frame].pack("l<*"),
+          "frame_func" => table[:frame_table][:func].pack("l<*"),
+          "frame_line" => table[:frame_table][:line].pack("l<*"),
+          "func_name" => func_names.pack("L<*"),
+          "func_filename" => func_filenames.pack("L<*"),
+          "func_first_line" => funcs[:first_line].pack("l<*"),
+          "threads" => threads.join,
+          "samples" => samples.pack("l<*"),
+          "weights" => weights.pack("L<*"),
+          "timestamps" => timestamps.pack("Q<*"),
+          "markers" => markers.join,
+        }
+      end
+
+      def pack_strings
+        offsets = [0]
+        data = @strings.each_key.map do |string|
+          string = string.b
+          offsets << offsets.last + string.bytesize
+          string
+        end
+        [@strings.size, *offsets].pack("L<*") + data.join
+      end
+    end
+  end
+end
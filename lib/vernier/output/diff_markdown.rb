@@ -0,0 +1,79 @@
+# frozen_string_literal: true
+
+require_relative "markdown"
+
+module Vernier
+  module Output
+    # Summarizes a DiffProfile: the functions whose share of samples changed
+    # most, followed by the candidate's and base's hotspot tables as in
+    # Markdown.
+    class DiffMarkdown < Markdown
+      def output
+        base = @profile.funcs(DiffProfile::BASE)
+        candidate = @profile.funcs(DiffProfile::CANDIDATE)
+
+        out = +"# Vernier Profile Diff\n\n"
+        out << build_diff_summary
+        out << "## Biggest Changes\n\n"
+        out << changes_table("By Self Time", base, candidate, :self)
+        out << changes_table("By Total Time", base, candidate, :total)
+        out << "## Candidate Hotspots\n\n"
+        out << hotspots(candidate, @profile.candidate_total)
+        out << "## Base Hotspots\n\n"
+        out << hotspots(base, @profile.base_total)
+        out
+      end
+
+      private
+
+      def build_diff_summary
+        out = +"## Summary\n\n"
+        mode = @profile.meta[:mode]
+        weight_unit = mode == :retained ? "bytes" : "samples"
+
+        out << "| Metric | Value |\n"
+        out << "|--------|-------|\n"
+        out << "| Mode | #{mode || 'unknown'} |\n"
+        out << "| Base | #{@profile.base_total} #{weight_unit} |\n"
+        out << "| Candidate | #{@profile.candidate_total} #{weight_unit} |\n"
+        out << "\n"
+        out
+      end
+
+      def hotspots(funcs, total)
+        return "_No samples collected._\n\n" if total == 0
+
+        top_functions_table("By Self Time", funcs, total, :self)
+      end
+
+      # Functions by the change in their share of samples, largest first
+      def changes_table(title, base, candidate, sort_key)
+        out = +"### #{title}\n\n"
+        base_total = @profile.base_total
+        candidate_total = @profile.candidate_total
+        percent = ->(funcs, name, total) { total == 0 ? 0.0 : 100.0 * funcs.fetch(name, {}).fetch(sort_key, 0) / total }
+
+        changes = (base.keys | candidate.keys).map do |name|
+          base_pct = percent.(base, name, base_total)
+          candidate_pct = percent.(candidate, name, candidate_total)
+          [name, base_pct, candidate_pct, candidate_pct - base_pct]
+        end
+        changes.reject! { |_, _, _, delta| delta.abs < 0.05 }
+        return out << "_No changes._\n\n" if changes.empty?
+
+        column = sort_key == :self ? "Self" : "Total"
+        out << "| Rank | Change | Base #{column} % | Candidate #{column} % | Function | Location |\n"
+        out << "|------|--------|--------|--------|----------|----------|\n"
+
+        changes.sort_by { |_, _, _, delta| -delta.abs }.first(@top_n).each_with_index do |(name, base_pct, candidate_pct, delta), idx|
+          data = candidate[name] || base[name]
+          location = format_location(data[:file], data[:line])
+          out << "| #{idx + 1} | #{format("%+.1f", delta)}% | #{format("%.1f", base_pct)}% | #{format("%.1f", candidate_pct)}% | #{format_code_span(name)} | #{escape_markdown(location)} |\n"
+        end
+
+        out << "\n"
+        out
+      end
+    end
+  end
+end
@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "json"
+require "stringio"
 require "rbconfig"
 
 require_relative "filename_filter"
@@ -121,12 +122,29 @@ module Vernier
       end
 
       def output(gzip: false)
-        result = ::JSON.generate(data)
+        if gzip
+          io = StringIO.new(+"".b)
+          write(io, gzip: true)
+          io.string
+        else
+          JSONWriter.generate(data)
+        end
+      end
+
+      # Writes the profile to io as it's generated, compressing it on the
+      # way if gzip is set, so that the whole JSON is never in memory.
+      def write(io, gzip: false)
         if gzip
           require "zlib"
-          result = Zlib.gzip(result)
+          gz = Zlib::GzipWriter.new(io)
+          JSONWriter.generate(data) { |chunk| gz.write(chunk) }
+          gz.finish
+        elsif io.is_a?(IO)
+          JSONWriter.write(data, io)
+        else
+          JSONWriter.generate(data) { |chunk| io.write(chunk) }
         end
-        result
+        io
       end
 
       private
@@ -136,13 +154,17 @@ module Vernier
       def data
         #markers_by_thread = profile.markers.group_by { |marker| marker[0] }
 
-        threads = profile.threads.map do |ruby_thread_id, thread_info|
+        # A Result's samples are left packed, for the tables to be built
+        # from natively
+        profile_threads = profile.respond_to?(:packed_threads) ? profile.packed_threads : profile.threads
+        threads = profile_threads.map do |ruby_thread_id, thread_info|
           #markers = markers_by_thread[ruby_thread_id] || []
           Thread.new(
             ruby_thread_id,
             profile,
             @categorizer,
             #markers: markers,
+            only_thread: profile_threads.size == 1,
             **thread_info,
           )
         end
@@ -188,10 +210,16 @@ module Vernier
           },
           counters: counter_data,
           libs: [],
-          threads: threads.map(&:data)
+          threads: threads.map { deferred_data(_1) }
         }
       end
 
+      # Each thread's tables are only built when the writer gets to them,
+      # so that only one thread's are in memory at a time
+      def deferred_data(thread)
+        JSONWriter::Deferred.new { thread.data }
+      end
+
       def counter_data
         profile.hooks.flat_map do |hook|
           if hook.respond_to?(:firefox_counters)
@@ -277,7 +305,10 @@ module Vernier
 
         attr_reader :profile, :is_start
 
-        def initialize(ruby_thread_id, profile, categorizer, name:, tid:, samples:, weights:, timestamps: nil, sample_categories: nil, markers:, started_at:, stopped_at: nil, allocations: nil, is_main: nil, is_start: nil)
+        # Samples and allocations are either arrays or, as from
+        # Result#packed_threads, packed under packed:. Nothing is built
+        # until data is called.
+        def initialize(ruby_thread_id, profile, categorizer, name:, tid:, samples: nil, weights: nil, timestamps: nil, sample_categories: nil, markers:, started_at:, stopped_at: nil, allocations: nil, is_main: nil, is_start: nil, packed: nil, only_thread: false)
           @ruby_thread_id = ruby_thread_id
           @profile = profile
           @categorizer = categorizer
@@ -287,107 +318,32 @@ module Vernier
           if is_main.nil?
             @is_main = @ruby_thread_id == ::Thread.main.object_id
           end
-          @is_main = true if profile.threads.size == 1
+          @is_main = true if only_thread
           @is_start = is_start.nil? ? @is_main : is_start
 
-          @stack_table = Vernier::StackTable.new
-          samples = samples.map { |sample| @stack_table.convert(profile._stack_table, sample) }
-
-          @samples = samples
-
-          if allocations
-            allocation_samples = allocations[:samples].dup
-            allocation_samples.map! do |sample|
-              @stack_table.convert(profile._stack_table, sample)
+          if packed
+            @samples, @timestamps, @sample_categories = packed.values_at(:samples, :timestamps, :sample_categories)
+            @weights = column(packed.fetch(:weights), :uint32)
+            if allocations = packed[:allocations]
+              @allocations = allocations.merge(weights: column(allocations.fetch(:weights), :uint32))
             end
-            allocations = allocations.merge(samples: allocation_samples)
-          end
-          @allocations = allocations
-
-          timestamps ||= [0] * samples.size
-          @weights, @timestamps = weights, timestamps
-          @sample_categories = sample_categories || ([0] * samples.size)
-          @markers = markers.map do |marker|
-            if stack_idx = marker[5]&.dig(:cause, :stack)
-              marker = marker.dup
-              new_idx = @stack_table.convert(profile._stack_table, stack_idx)
-              marker[5] = marker[5].merge({ cause: { stack: new_idx }})
+          else
+            # Weights can be negative, as in a DiffProfile
+            @samples = pack(samples, :samples)
+            @timestamps = pack(timestamps, :timestamps) if timestamps
+            @sample_categories = sample_categories ? pack(sample_categories, :sample_categories) : "".b
+            @weights = column(weights.pack("q<*"), :int64)
+            if allocations
+              @allocations = {
+                samples: pack(allocations[:samples], :samples),
+                weights: column(allocations[:weights].pack("q<*"), :int64),
+                timestamps: pack(allocations[:timestamps], :timestamps),
+              }
             end
-            marker
           end
 
+          @markers = markers
           @started_at, @stopped_at = started_at, stopped_at
-
-          @stack_table_hash = @stack_table.to_h
-          names = @stack_table_hash[:func_table].fetch(:name)
-          filenames = @stack_table_hash[:func_table].fetch(:filename)
-
-          stacks_size = @stack_table.stack_count
-          @categorized_stacks = Hash.new do |h, k|
-            h[k] = h.size + stacks_size
-          end
-
-          @strings = Hash.new { |h, k| h[k] = h.size }
-          @func_names = names.map do |name|
-            @strings[name]
-          end
-
-          @filenames = filter_filenames(filenames).map do |filename|
-            @strings[filename]
-          end
-
-          func_implementations = filenames.map do |filename|
-            # Must match strings in `src/profile-logic/profile-data.js`
-            # inside the firefox profiler. See `getFriendlyStackTypeName`
-            if filename == "<cfunc>"
-              @strings["native"]
-            else
-              # nil means interpreter
-              nil
-            end
-          end
-          @frame_implementations = @stack_table_hash[:frame_table].fetch(:func).map do |func_idx|
-            func_implementations[func_idx]
-          end
-
-          func_categories, func_subcategories = [], []
-          filenames.each do |filename|
-            category, subcategory = categorize_filename(filename)
-            func_categories << category
-            func_subcategories << subcategory
-          end
-
-          @frame_categories = @stack_table_hash[:frame_table].fetch(:func).map do |func_idx|
-            func_categories[func_idx]
-          end
-          @frame_subcategories = @stack_table_hash[:frame_table].fetch(:func).map do |func_idx|
-            func_subcategories[func_idx]
-          end
-
-          @sample_category_idx = SAMPLE_CATEGORY_NAMES.transform_values do |name|
-            @categorizer.get_category(name).idx
-          end
-
-          @samples.zip(@sample_categories).each do |sample, raw_category|
-            next if raw_category == 0
-
-            @categorized_stacks[[sample, raw_category]]
-          end
-
-          base_stack_frames = @stack_table_hash[:stack_table].fetch(:frame)
-          base_frame_count = @stack_table_hash[:frame_table].fetch(:func).size
-          @extra_frames = []
-          @categorized_frame_map = {}
-
-          @categorized_stacks.each_key do |(stack, raw_category)|
-            original_frame_idx = base_stack_frames[stack]
-            key = [original_frame_idx, raw_category]
-            next if @categorized_frame_map.key?(key)
-
-            new_frame_idx = base_frame_count + @extra_frames.size
-            @categorized_frame_map[key] = new_frame_idx
-            @extra_frames << [original_frame_idx, @sample_category_idx[raw_category]]
-          end
         end
 
         def categorize_filename(filename)
@@ -416,14 +372,80 @@ module Vernier
           [nil, nil]
         end
 
-        def filter_filenames(filenames)
+        # Filters each distinct filename once and returns indexes into
+        # strings for the filtered names
+        def filter_filenames(strings, func_strings, filename_indexes)
           filter = FilenameFilter.new
-          filenames.map do |filename|
-            filter.call(filename)
+          filtered = {}
+          filename_indexes.map do |idx|
+            filtered[idx] ||= strings[filter.call(func_strings[idx])]
           end
         end
 
+        # Builds the thread's tables. Samples, stacks, frames and funcs are
+        # built natively by FirefoxTables from the packed samples and stack
+        # table, leaving Ruby to categorize each func and build markers.
+        # Nothing is kept, so that once a thread is written its tables can
+        # be collected.
         def data
+          if profile._stack_table.is_a?(Vernier::StackTable)
+            thread_stack_table = Vernier::StackTable.new
+            convert = ->(stacks) { thread_stack_table.convert_many(profile._stack_table, stacks) }
+          else
+            # A standalone table, such as a MergedStackTable, is used as is
+            thread_stack_table = profile._stack_table
+            convert = ->(stacks) { stacks }
+          end
+          samples = convert.(@samples)
+          allocation_samples = convert.(@allocations[:samples]) if @allocations
+          markers = convert_markers(convert)
+
+          # The stack table has already interned names and filenames, so
+          # start the string table from its strings and use its indexes.
+          func_strings = thread_stack_table.func_string_table
+          strings = Hash.new { |h, k| h[k] = h.size }
+          func_strings.fetch(:strings).each do |string|
+            strings[string]
+          end
+          filenames = func_strings.fetch(:strings).values_at(*func_strings.fetch(:filename))
+          filtered_filenames = filter_filenames(strings, func_strings.fetch(:strings), func_strings.fetch(:filename))
+
+          func_implementations = filenames.map do |filename|
+            # Must match strings in `src/profile-logic/profile-data.js`
+            # inside the firefox profiler. See `getFriendlyStackTypeName`
+            if filename == "<cfunc>"
+              strings["native"]
+            else
+              # nil means interpreter
+              nil
+            end
+          end
+
+          func_categories, func_subcategories = [], []
+          filenames.each do |filename|
+            category, subcategory = categorize_filename(filename)
+            func_categories << category.idx
+            func_subcategories << subcategory
+          end
+
+          sample_category_idx = [nil]
+          SAMPLE_CATEGORY_NAMES.each do |raw_category, name|
+            sample_category_idx[raw_category] = @categorizer.get_category(name).idx
+          end
+
+          tables = FirefoxTables.build(
+            **thread_stack_table.packed_tables,
+            func_name: func_strings.fetch(:name),
+            func_filename: filtered_filenames,
+            func_category: func_categories,
+            func_subcategory: func_subcategories,
+            func_implementation: func_implementations,
+            cfunc: strings["<cfunc>"],
+            samples: samples,
+            sample_categories: @sample_categories,
+            sample_category: sample_category_idx
+          )
+
           started_at = (@started_at - 0) / 1_000_000.0
           stopped_at = (@stopped_at - 0) / 1_000_000.0 if @stopped_at
 
@@ -437,12 +459,12 @@ module Vernier
             pausedRanges: [],
             pid: profile.pid || Process.pid,
             tid: @tid,
-            frameTable: frame_table,
-            funcTable: func_table,
+            frameTable: frame_table(tables),
+            funcTable: func_table(tables),
             nativeSymbols: {},
-            samples: samples_table,
-            jsAllocations: allocations_table,
-            stackTable: stack_table,
+            samples: samples_table(tables),
+            jsAllocations: allocations_table(allocation_samples),
+            stackTable: stack_table(tables),
             resourceTable: {
               length: 0,
               lib: [],
@@ -450,12 +472,12 @@ module Vernier
               host: [],
               type: []
             },
-            markers: markers_table,
-            stringArray: string_table
+            markers: markers_table(markers, strings),
+            stringArray: string_table(strings)
           }.compact
         end
 
-        def markers_table
+        def markers_table(markers, strings)
           string_indexes = []
           start_times = []
           end_times = []
@@ -463,8 +485,8 @@ module Vernier
           categories = []
           data = []
 
-          @markers.each do |(_, name, start, finish, phase, datum)|
-            string_indexes << @strings[name]
+          markers.each do |(_, name, start, finish, phase, datum)|
+            string_indexes << strings[name]
             start_times << (start / 1_000_000.0)
 
             # Please don't hate me. Divide by 1,000,000 only if finish is not nil
@@ -495,158 +517,135 @@ module Vernier
           }
         end
 
-        def allocations_table
-          return nil unless @allocations
-
-          samples, weights, timestamps = @allocations.values_at(:samples, :weights, :timestamps)
-          return nil if samples.empty?
+        def allocations_table(samples)
+          return nil unless samples
 
+          weights, timestamps = @allocations.values_at(:weights, :timestamps)
+          samples = column(samples)
           size = samples.size
-          timestamps = timestamps.map { _1 / 1_000_000.0 }
+          return nil if size == 0
+
           {
-            "time": timestamps,
-            "className": ["Object"]*size,
-            "typeName": ["JSObject"]*size,
-            "coarseType": ["Object"]*size,
+            "time": column(timestamps, :milliseconds),
+            "className": JSONWriter::PackedArray.repeat("Object", size),
+            "typeName": JSONWriter::PackedArray.repeat("JSObject", size),
+            "coarseType": JSONWriter::PackedArray.repeat("Object", size),
             "weight": weights,
-            "inNursery": [false] * size,
+            "inNursery": JSONWriter::PackedArray.repeat(false, size),
             "stack": samples,
             "length": size
           }
         end
 
-        def samples_table
-          samples = @samples
+        def samples_table(tables)
+          samples = column(tables.fetch(:samples))
           weights = @weights
-          categories = @sample_categories
           size = samples.size
-          if categories.empty?
-            categories = [0] * size
-          end
 
           if @timestamps
-            times = @timestamps.map { _1 / 1_000_000.0 }
+            times = column(@timestamps, :milliseconds)
           else
             # FIXME: record timestamps for memory samples
-            times = (0...size).to_a
+            times = JSONWriter::PackedArray.repeat(0.0, size)
           end
 
           raise unless weights.size == size
           raise unless times.size == size
 
-          samples = samples.zip(categories).map do |sample, category|
-            if category == 0
-              sample
-            else
-              @categorized_stacks[[sample, category]]
-            end
-          end
-
           {
             stack: samples,
             time: times,
             weight: weights,
             weightType: profile.meta[:mode] == :retained ? "bytes" : "samples",
-            length: samples.length
+            length: size
           }
         end
 
-        def stack_table
-          base_frames = @stack_table_hash[:stack_table].fetch(:frame)
-          frames = base_frames.dup
-          prefixes = @stack_table_hash[:stack_table].fetch(:parent).dup
-          categories = frames.map { |idx| @frame_categories[idx].idx }
-          subcategories = frames.map { |idx| @frame_subcategories[idx] }
-
-          @categorized_stacks.each_key do |(stack, raw_category)|
-            original_frame_idx = base_frames[stack]
-            frames << @categorized_frame_map[[original_frame_idx, raw_category]]
-            prefixes << prefixes[stack]
-            categories << @sample_category_idx[raw_category]
-            subcategories << 0
-          end
+        def stack_table(tables)
+          frames = column(tables.fetch(:stack_frame))
+          prefixes = column(tables.fetch(:stack_prefix), :nullable_int32)
 
           raise unless prefixes.size == frames.size
 
           {
             frame: frames,
-            category: categories,
-            subcategory: subcategories,
+            category: column(tables.fetch(:stack_category)),
+            subcategory: column(tables.fetch(:stack_subcategory)),
             prefix: prefixes,
-            length: prefixes.length
+            length: prefixes.size
           }
         end
 
-        def frame_table
-          funcs = @stack_table_hash[:frame_table].fetch(:func).dup
-          lines = @stack_table_hash[:frame_table].fetch(:line).dup
-          raise unless lines.size == funcs.size
-
-          categories = @frame_categories.map(&:idx)
-          subcategories = @frame_subcategories.dup
-          implementations = @frame_implementations.dup
-
-          @extra_frames.each do |(frame_idx, category_idx)|
-            funcs << funcs[frame_idx]
-            lines << lines[frame_idx]
-            categories << category_idx
-            subcategories << 0
-            implementations << implementations[frame_idx]
-          end
-
+        def frame_table(tables)
+          funcs = column(tables.fetch(:frame_func))
           size = funcs.size
-          none = [nil] * size
-          default = [0] * size
-          unidentified = [-1] * size
+          none = JSONWriter::PackedArray.repeat(nil, size)
 
           {
-            address: unidentified,
-            inlineDepth: default,
-            category: categories,
-            subcategory: subcategories,
+            address: JSONWriter::PackedArray.repeat(-1, size),
+            inlineDepth: JSONWriter::PackedArray.repeat(0, size),
+            category: column(tables.fetch(:frame_category)),
+            subcategory: column(tables.fetch(:frame_subcategory)),
             func: funcs,
             nativeSymbol: none,
             innerWindowID: none,
-            implementation: implementations,
-            line: lines,
+            implementation: column(tables.fetch(:frame_implementation), :nullable_int32),
+            line: column(tables.fetch(:frame_line)),
             column: none,
             length: size
           }
         end
 
-        def func_table
-          size = @func_names.size
+        def func_table(tables)
+          names = column(tables.fetch(:func_name))
+          size = names.size
+          is_js = column(tables.fetch(:func_is_js), :bool)
 
-          cfunc_idx = @strings["<cfunc>"]
-          is_js = @filenames.map { |fn| fn != cfunc_idx }
-          line_numbers = @stack_table_hash[:func_table].fetch(:first_line).map.with_index do |line, i|
-            if is_js[i] || line != 0
-              line
-            else
-              nil
-            end
-          end
           {
-            name: @func_names,
+            name: names,
             isJS: is_js,
             relevantForJS: is_js,
-            resource: [-1] * size, # set to unidentified for now
-            fileName: @filenames,
-            lineNumber: line_numbers,
-            columnNumber: [nil] * size,
+            resource: JSONWriter::PackedArray.repeat(-1, size), # set to unidentified for now
+            fileName: column(tables.fetch(:func_filename)),
+            lineNumber: column(tables.fetch(:func_line_number), :nullable_int32),
+            columnNumber: JSONWriter::PackedArray.repeat(nil, size),
             #columnNumber: functions.map { _1.column },
             length: size
           }
         end
 
-        def string_table
-          @strings.keys.map do |string|
+        def string_table(strings)
+          strings.keys.map do |string|
             sanitize_string(string)
           end
         end
 
         private
 
+        def column(bytes, type = :int32)
+          JSONWriter::PackedArray.new(bytes, type)
+        end
+
+        def pack(values, key)
+          values.pack(Result::PACKED_FORMATS.fetch(key))
+        end
+
+        # Converts the stacks markers were caused by into the thread's
+        # stack table
+        def convert_markers(convert)
+          marker_stacks = @markers.filter_map { |marker| marker[5]&.dig(:cause, :stack) }
+          marker_stacks = convert.(marker_stacks)
+          marker_stack_idx = 0
+          @markers.map do |marker|
+            if marker[5]&.dig(:cause, :stack)
+              marker = marker.dup
+              marker[5] = marker[5].merge({ cause: { stack: marker_stacks[marker_stack_idx] }})
+              marker_stack_idx += 1
+            end
+            marker
+          end
+        end
+
         def gc_category
           @categorizer.get_category("GC")
         end
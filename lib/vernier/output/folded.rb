@@ -0,0 +1,18 @@
+# frozen_string_literal: true
+
+module Vernier
+  module Output
+    # Brendan Gregg's "folded" stacks, as read by flamegraph.pl and similar
+    # tools: a line per distinct stack of functions, root first and joined
+    # by ";", followed by its total weight across all threads.
+    class Folded
+      def initialize(profile)
+        @profile = profile
+      end
+
+      def output
+        @profile._stack_table.folded(@profile.sample_weights)
+      end
+    end
+  end
+end
@@ -0,0 +1,82 @@
+# frozen_string_literal: true
+
+module Vernier
+  module Output
+    # Exports pprof's profile.proto, encoded natively by Vernier::Pprof.
+    # Samples are labelled with their thread's name.
+    class Pprof
+      def initialize(profile)
+        @profile = profile
+      end
+
+      def output(gzip: true)
+        native_gzip = gzip && Vernier::Pprof::GZIP
+        encoded = Vernier::Pprof.encode(@profile._stack_table, options.merge(gzip: native_gzip))
+        if gzip && !native_gzip
+          require "zlib"
+          encoded = Zlib.gzip(encoded)
+        end
+        encoded
+      end
+
+      private
+
+      def options
+        meta = @profile.meta
+        started_at = @profile.started_at
+        options = {
+          time_nanos: started_at,
+          duration_nanos: (@profile.end_time - started_at if @profile.end_time),
+        }
+
+        case meta[:mode]
+        when :wall, :cpu
+          interval_ns = meta[:interval] * 1_000
+          options[:sample_types] = [["samples", "count"], [meta[:mode].to_s, "nanoseconds"]]
+          options[:period_type] = [meta[:mode].to_s, "nanoseconds"]
+          options[:period] = interval_ns
+          options[:default_sample_type] = meta[:mode].to_s
+          series = each_thread.flat_map do |name, thread|
+            [
+              [name, thread[:samples], thread[:weights], 0, 1],
+              [name, thread[:samples], thread[:weights], 1, interval_ns],
+            ]
+          end
+
+          if allocation_interval = meta[:allocation_interval]&.nonzero?
+            options[:sample_types] << ["alloc_objects", "count"]
+            each_thread.each do |name, thread|
+              allocations = thread[:allocations] or next
+              series << [name, allocations[:samples], allocations[:weights], 2, allocation_interval]
+            end
+          end
+        when :retained
+          options[:sample_types] = [["retained_objects", "count"], ["retained_space", "bytes"]]
+          options[:period_type] = ["space", "bytes"]
+          options[:default_sample_type] = "retained_space"
+          series = each_thread.flat_map do |name, thread|
+            [
+              [name, thread[:samples], nil, 0, 1],
+              [name, thread[:samples], thread[:weights], 1, 1],
+            ]
+          end
+        else
+          options[:sample_types] = [["samples", "count"]]
+          options[:period_type] = ["samples", "count"]
+          series = each_thread.map do |name, thread|
+            [name, thread[:samples], thread[:weights], 0, 1]
+          end
+        end
+
+        options[:series] = series
+        options
+      end
+
+      def each_thread
+        @profile.threads.values.map do |thread|
+          [thread[:name]&.to_s, thread]
+        end
+      end
+    end
+  end
+end
@@ -2,10 +2,20 @@
 
 require "json"
 require_relative "stack_table_helpers"
+require_relative "binary_profile"
+require_relative "streamed_profile"
 
 module Vernier
   class ParsedProfile
     def self.read_file(filename)
+      # Binary profiles are mapped rather than parsed
+      if BinaryProfile.binary?(filename)
+        return BinaryProfile.read_file(filename)
+      end
+      if StreamedProfile.stream?(filename)
+        return StreamedProfile.read_file(filename)
+      end
+
       # Print the inverted tree from a Vernier profile
       is_gzip = File.binread(filename, 2) == "\x1F\x8B".b # check for gzip header
 
@@ -7,7 +7,72 @@ module Vernier
 
     attr_accessor :hooks, :pid, :end_time
 
-    attr_reader :meta, :threads, :gc_markers
+    attr_reader :meta
+
+    # TimeCollector hands over each thread's samples and markers packed
+    # into little-endian binary strings, so that stopping doesn't allocate
+    # an object per sample. They're unpacked into arrays the first time
+    # threads is read.
+    PACKED_FORMATS = {
+      samples: "l<*",
+      weights: "L<*",
+      timestamps: "Q<*",
+      sample_categories: "C*",
+    }.freeze
+
+    # type, phase, timestamp, finish (-1 unless an interval) and stack index
+    # (-1 for none)
+    PACKED_MARKER = "l<l<q<q<l<"
+    PACKED_MARKER_SIZE = 28
+
+    def threads
+      unless @threads_unpacked
+        @threads_unpacked = true
+        packed_threads.each_value { unpack_thread(_1) }
+      end
+      @threads
+    end
+
+    # Threads as from threads, except that any which haven't been unpacked
+    # yet keep their samples and allocations under :packed, in
+    # PACKED_FORMATS, for exporters which write them without unpacking.
+    # Markers are always unpacked.
+    def packed_threads
+      unless @threads_finished
+        @threads_finished = true
+        @threads.each_value { unpack_thread_markers(_1) }
+        @finish_threads&.call(@threads)
+        @finish_threads = nil
+      end
+      @threads
+    end
+
+    def gc_markers
+      @gc_markers ||= @packed_gc_markers && unpack_markers(@packed_gc_markers)
+    end
+
+    # Each thread's samples and weights, still packed if threads haven't
+    # been read, for exporters which don't need anything else
+    def sample_weights
+      @threads.values.map do |thread|
+        if packed = thread[:packed]
+          load_streamed(packed)
+          packed.values_at(:samples, :weights)
+        else
+          thread.values_at(:samples, :weights)
+        end
+      end
+    end
+
+    # Defers finishing off threads, such as naming them and building their
+    # markers, until they're first read
+    def finish_threads(&block)
+      if @threads_finished
+        block.call(@threads)
+      else
+        @finish_threads = block
+      end
+    end
 
     def main_thread
       threads.values.detect {|x| x[:is_main] }
@@ -30,6 +95,14 @@ module Vernier
       Output::Cpuprofile.new(self).output
     end
 
+    def to_pprof(gzip: true)
+      Output::Pprof.new(self).output(gzip:)
+    end
+
+    def to_folded
+      Output::Folded.new(self).output
+    end
+
     def to_markdown(top_n: 20, lines_per_file: 5)
       Output::Markdown.new(self, top_n: top_n, lines_per_file: lines_per_file).output
     end
@@ -48,11 +121,33 @@ module Vernier
         else
           File.binwrite(out, to_markdown)
         end
+      when "folded"
+        if out.respond_to?(:write)
+          out.write(to_folded)
+        else
+          File.binwrite(out, to_folded)
+        end
+      when "pprof"
+        if out.respond_to?(:write)
+          out.write(to_pprof)
+        else
+          File.binwrite(out, to_pprof)
+        end
+      when "vernier-bin"
+        if out.respond_to?(:write)
+          Output::Binary.new(self).write(out)
+        else
+          File.open(out, "wb") do |file|
+            Output::Binary.new(self).write(file)
+          end
+        end
       when "firefox", nil
         if out.respond_to?(:write)
-          out.write(to_firefox)
+          Output::Firefox.new(self).write(out)
         else
-          File.binwrite(out, to_firefox(gzip: out.end_with?(".gz")))
+          File.open(out, "wb") do |file|
+            Output::Firefox.new(self).write(file, gzip: out.end_with?(".gz"))
+          end
         end
       else
         raise ArgumentError, "unknown format: #{format}"
@@ -99,5 +194,77 @@ module Vernier
     def total_unique_samples
       threads.values.flat_map { _1[:samples] }.uniq.count
     end
+
+    private
+
+    def unpack_thread(thread)
+      packed = thread.delete(:packed) or return
+
+      PACKED_FORMATS.each do |key, format|
+        thread[key] = packed.fetch(key).unpack(format)
+      end
+      if allocations = packed[:allocations]
+        thread[:allocations] = allocations.to_h do |key, bytes|
+          [key, bytes.unpack(PACKED_FORMATS.fetch(key))]
+        end
+      end
+    end
+
+    def unpack_thread_markers(thread)
+      packed = thread[:packed] or return
+      load_streamed(packed)
+
+      thread[:markers] = unpack_markers(packed)
+      if streamed = packed.delete(:streamed_markers)
+        thread[:markers] = merge_markers(unpack_markers(markers: streamed, marker_info: []), thread[:markers])
+      end
+      packed.delete(:markers)
+      packed.delete(:marker_info)
+    end
+
+    # A TimeCollector given stream: leaves what it streamed in the file,
+    # and it's only read once the thread is needed. It comes before what was
+    # still in memory at stop, except for markers, which are merged by time
+    # since those with extra info are never streamed.
+    def load_streamed(packed)
+      serial = packed.delete(:stream_serial) or return
+      streamed = @stream.thread_data(serial)
+
+      PACKED_FORMATS.each_key do |key|
+        packed[key] = streamed.fetch(key) + packed.fetch(key)
+      end
+      if allocations = packed[:allocations]
+        packed[:allocations] = allocations.to_h do |key, bytes|
+          [key, streamed.fetch(:allocations).fetch(key) + bytes]
+        end
+      end
+      packed[:streamed_markers] = streamed.fetch(:markers)
+    end
+
+    # Interleaves two lists of markers by start time, each keeping its own
+    # order, with the first list's markers first on ties
+    def merge_markers(first, second)
+      return second if first.empty?
+
+      merged = []
+      i = 0
+      first.each do |marker|
+        while i < second.size && second[i][2] < marker[2]
+          merged << second[i]
+          i += 1
+        end
+        merged << marker
+      end
+      merged.concat(second[i..])
+    end
+
+    def unpack_markers(packed)
+      bytes = packed.fetch(:markers)
+      info = packed.fetch(:marker_info)
+      Array.new(bytes.bytesize / PACKED_MARKER_SIZE) do |i|
+        type, phase, ts, te, stack = bytes.unpack(PACKED_MARKER, offset: i * PACKED_MARKER_SIZE)
+        [type, phase, ts, (te unless te < 0), (stack unless stack < 0), info[i]]
+      end
+    end
   end
 end
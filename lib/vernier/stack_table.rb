@@ -3,5 +3,16 @@ require_relative "stack_table_helpers"
 module Vernier
   class StackTable
     include StackTableHelpers
+
+    @shared = nil
+    @shared_mutex = Mutex.new
+
+    ##
+    # A process-wide StackTable, used by collectors created with
+    # <tt>stack_table: :shared</tt>. It keeps every stack and function seen
+    # by those sessions, so later sessions start warm.
+    def self.shared
+      @shared || @shared_mutex.synchronize { @shared ||= new }
+    end
   end
 end
@@ -0,0 +1,158 @@
+# frozen_string_literal: true
+
+require_relative "stack_table_helpers"
+require_relative "marker"
+require_relative "result"
+require "vernier/vernier"
+
+module Vernier
+  # Reads a file written by a collector given stream:, without the collector
+  # that wrote it. The file holds its own stack table, so it can be read even
+  # if the process died before stopping the profiler, in which case it's read
+  # up to the last flush. Each thread's samples are only read when they're
+  # first accessed.
+  class StreamedProfile
+    MAGIC = "VERNIER-STREAM-1".b
+
+    def self.stream?(filename)
+      File.binread(filename, MAGIC.bytesize) == MAGIC
+    end
+
+    def self.read_file(filename)
+      new(StreamFile.new(filename))
+    end
+
+    attr_reader :file
+
+    def initialize(file)
+      @file = file
+    end
+
+    # Whether the profiler was stopped, rather than the file cut short
+    def complete?
+      @file.complete?
+    end
+
+    def meta
+      @meta ||= @file.meta
+    end
+
+    def stack_table
+      @stack_table ||= StackTable.new(@file.stack_table)
+    end
+
+    def strings
+      stack_table.strings
+    end
+
+    def threads
+      @threads ||= @file.threads.each_with_index.map do |info, serial|
+        Thread.new(self, serial, info)
+      end
+    end
+
+    def main_thread
+      threads.detect(&:main_thread?) || threads.first
+    end
+
+    # [samples, weights] for each thread, as packed int32 and uint32 strings
+    def sample_weights
+      threads.map { _1.packed.values_at(:samples, :weights) }
+    end
+
+    def inspect
+      "#<#{self.class} #{threads.size} threads, #{stack_table.stack_count} stacks#{" (incomplete)" unless complete?}>"
+    end
+
+    class StackTable
+      def initialize(table)
+        @stack_parents = table.fetch(:stack_parent)
+        @stack_frames = table.fetch(:stack_frame)
+        @frame_funcs = table.fetch(:frame_func)
+        @frame_lines = table.fetch(:frame_line)
+        @func_names = table.fetch(:func_name)
+        @func_filenames = table.fetch(:func_filename)
+        @func_first_linenos = table.fetch(:func_first_line)
+        @strings = table.fetch(:strings)
+      end
+
+      attr_reader :strings
+
+      def stack_count = @stack_parents.length
+      def frame_count = @frame_funcs.length
+      def func_count = @func_names.length
+
+      def stack_parent_idx(idx)
+        parent = @stack_parents.fetch(idx)
+        parent unless parent < 0
+      end
+
+      def stack_frame_idx(idx) = @stack_frames.fetch(idx)
+
+      def frame_func_idx(idx) = @frame_funcs.fetch(idx)
+      def frame_line_no(idx) = @frame_lines.fetch(idx)
+
+      def func_name_idx(idx) = @func_names.fetch(idx)
+      def func_filename_idx(idx) = @func_filenames.fetch(idx)
+      def func_name(idx) = @strings[func_name_idx(idx)]
+      def func_filename(idx) = @strings[func_filename_idx(idx)]
+      alias func_path func_filename
+      def func_first_lineno(idx) = @func_first_linenos.fetch(idx)
+
+      include StackTableHelpers
+    end
+
+    class Thread
+      attr_reader :tid, :started_at, :stopped_at
+
+      def initialize(profile, serial, info)
+        @profile = profile
+        @serial = serial
+        @tid, @started_at, @stopped_at, @object_id, @is_main, @is_start =
+          info.values_at(:tid, :started_at, :stopped_at, :object_id, :is_main, :is_start)
+      end
+
+      def name
+        @is_main ? "main" : "thread obj_id:#{@object_id}"
+      end
+
+      def main_thread? = @is_main
+      def start_thread? = @is_start
+      def stack_table = @profile.stack_table
+
+      # The thread's samples and markers, packed as in a Result
+      def packed
+        @packed ||= @profile.file.thread_data(@serial)
+      end
+
+      def samples
+        @samples ||= packed.fetch(:samples).unpack(Result::PACKED_FORMATS[:samples])
+      end
+
+      def weights
+        @weights ||= packed.fetch(:weights).unpack(Result::PACKED_FORMATS[:weights])
+      end
+
+      def timestamps
+        @timestamps ||= packed.fetch(:timestamps).unpack(Result::PACKED_FORMATS[:timestamps])
+      end
+
+      # Markers as [name, start, finish, phase, data]. Only those without
+      # extra info are streamed, so GC pauses and fiber switches are missing.
+      def markers
+        bytes = packed.fetch(:markers)
+        Array.new(bytes.bytesize / Result::PACKED_MARKER_SIZE) do |i|
+          type, phase, start, finish, stack = bytes.unpack(Result::PACKED_MARKER, offset: i * Result::PACKED_MARKER_SIZE)
+          data = { type: Marker::MARKER_SYMBOLS[type] }
+          data[:cause] = { stack: stack } unless stack < 0
+          [Marker.name_table[type], start, (finish unless finish < 0), phase, data]
+        end
+      end
+
+      # Emulate hash
+      def [](name)
+        send(name)
+      end
+    end
+  end
+end
@@ -247,6 +247,90 @@ class TestOutputFirefox < Minitest::Test
     assert_valid_firefox_profile(output)
   end
 
+  def test_native_json_matches_json_generate
+    result = Vernier.trace(interval: 100, allocation_interval: 10) do
+      GC.start
+      encoded_method("UTF-8").call { 1000.times.map(&:to_s) }
+    end
+
+    data = Vernier::Output::Firefox.new(result).send(:data)
+    assert_equal JSON.generate(data), Vernier::JSONWriter.generate(data)
+  end
+
+  def test_firefox_tables_built_from_packed_samples
+    result = Vernier.trace(interval: 100, allocation_interval: 10) do
+      Thread.new { sleep 0.01 }.join
+      1000.times.map(&:to_s)
+    end
+
+    output = Vernier::Output::Firefox.new(result).output
+    assert result.instance_variable_get(:@threads).values.all? { _1[:packed] }
+
+    result.threads
+    unpacked = Vernier::Output::Firefox.new(result).output
+    assert_equal JSON.parse(unpacked)["threads"], JSON.parse(output)["threads"]
+  end
+
+  def test_native_json_writer_packed_arrays
+    ints = Array.new(100_000) { |i| i * 7 - 50 }
+    times = Array.new(1000) { |i| 1_700_000_000_000_000_000 + i * 1_234_567 }
+    packed = {
+      int32: Vernier::JSONWriter::PackedArray.new(ints.pack("l<*"), :int32),
+      nullable: Vernier::JSONWriter::PackedArray.new([3, -1, 0].pack("l<*"), :nullable_int32),
+      uint32: Vernier::JSONWriter::PackedArray.new([0, 2**32 - 1].pack("L<*"), :uint32),
+      int64: Vernier::JSONWriter::PackedArray.new([-2**40, 2**62].pack("q<*"), :int64),
+      bool: Vernier::JSONWriter::PackedArray.new([1, 0].pack("C*"), :bool),
+      time: Vernier::JSONWriter::PackedArray.new(times.pack("Q<*"), :milliseconds),
+      repeated: Vernier::JSONWriter::PackedArray.repeat("Object", 3),
+      deferred: Vernier::JSONWriter::Deferred.new { { nested: [Vernier::JSONWriter::Deferred.new { 1.5 }] } },
+    }
+    expected = {
+      int32: ints,
+      nullable: [3, nil, 0],
+      uint32: [0, 2**32 - 1],
+      int64: [-2**40, 2**62],
+      bool: [true, false],
+      time: times.map { _1 / 1_000_000.0 },
+      repeated: ["Object"] * 3,
+      deferred: { nested: [1.5] },
+    }
+
+    assert_equal JSON.generate(expected), Vernier::JSONWriter.generate(packed)
+    assert_equal JSON.generate(expected), JSON.generate(packed)
+    # What's being walked must stay put when compacting between chunks
+    chunks = []
+    Vernier::JSONWriter.generate(packed) do |chunk|
+      chunks << chunk
+      GC.compact if GC.respond_to?(:compact)
+    end
+    assert_operator chunks.size, :>, 1
+    assert_equal JSON.generate(expected), chunks.join
+
+    assert_equal expected[:nullable], packed[:nullable].to_a
+    assert_raises(ArgumentError) { Vernier::JSONWriter::PackedArray.new("abc", :int32) }
+    assert_raises(ArgumentError) { Vernier::JSONWriter::PackedArray.repeat([], 1) }
+  end
+
+  def test_native_json_writer
+    data = {
+      floats: [0.0, -0.0, 1.5, 0.001, 0.0001, 1.0e-05, 123456.789012, 1.0e+15, 999999999999999.9, 1234567890123456.8, 2.0 / 3, -1.0e+300, 5.0e-324, 5.3952252961507e-310, -2.2250738585072014e-308],
+      integers: [0, -1, 2**62, 2**70],
+      strings: ["", "a\"b\\c/", "\b\f\n\r\t\u0001\u001f\u007f", "caf\u00e9", :sym],
+      other: [nil, true, false, { 1 => [{}] }],
+    }
+    assert_equal JSON.generate(data), Vernier::JSONWriter.generate(data)
+
+    assert_raises(JSON::GeneratorError) { Vernier::JSONWriter.generate([Float::NAN]) }
+    assert_raises(JSON::GeneratorError) { Vernier::JSONWriter.generate(["\xff".b]) }
+
+    Tempfile.create("vernier") do |file|
+      file.write("x")
+      assert_equal JSON.generate(data).bytesize, Vernier::JSONWriter.write(data, file)
+      file.close
+      assert_equal "x#{JSON.generate(data)}".b, File.binread(file.path)
+    end
+  end
+
   private
 
   def file_lineno
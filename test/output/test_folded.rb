@@ -0,0 +1,41 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestOutputFolded < Minitest::Test
+  def test_folded
+    result = Vernier.trace(interval: 100) do
+      Thread.new { sleep 0.01 }.join
+      GVLTest.sleep_holding_gvl(0.01)
+    end
+
+    # Exported before threads are unpacked
+    output = result.to_folded
+
+    folded = output.lines.to_h do |line|
+      stack, weight = line.chomp.rpartition(" ").values_at(0, 2)
+      [stack, Integer(weight)]
+    end
+    assert_equal output.lines.size, folded.size
+
+    expected = Hash.new(0)
+    result.threads.each_value do |thread|
+      thread[:samples].zip(thread[:weights]) do |stack_idx, weight|
+        stack = result.stack(stack_idx).frames.reverse.map { _1.label.tr(";", ":") }.join(";")
+        expected[stack] += weight
+      end
+    end
+    assert_equal expected, folded
+
+    # and again after
+    assert_equal output, result.to_folded
+    assert folded.keys.any? { _1.end_with?(";GVLTest.sleep_holding_gvl") }
+  end
+
+  def test_write
+    result = Vernier.trace { sleep 0.001 }
+    io = StringIO.new
+    result.write(out: io, format: "folded")
+    assert_equal result.total_weights, io.string.lines.sum { Integer(_1.split(" ").last) }
+  end
+end
@@ -0,0 +1,97 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "zlib"
+
+class TestOutputPprof < Minitest::Test
+  # Decodes a protobuf message into { field => [values] }, leaving nested
+  # messages as strings
+  def decode(bytes)
+    fields = Hash.new { |h, k| h[k] = [] }
+    io = StringIO.new(bytes)
+    until io.eof?
+      key = varint(io)
+      case key & 7
+      when 0 then fields[key >> 3] << varint(io)
+      when 2 then fields[key >> 3] << io.read(varint(io))
+      else raise "unexpected wire type #{key & 7}"
+      end
+    end
+    fields
+  end
+
+  def varint(io)
+    value = shift = 0
+    loop do
+      byte = io.readbyte
+      value |= (byte & 0x7f) << shift
+      shift += 7
+      return value if byte < 0x80
+    end
+  end
+
+  def packed(bytes)
+    io = StringIO.new(bytes || "")
+    values = []
+    values << varint(io) until io.eof?
+    values
+  end
+
+  def test_wall_profile
+    result = Vernier.trace(interval: 100, allocation_interval: 1) do
+      Thread.new { Object.new }.join
+      sleep 0.01
+    end
+
+    profile = decode(Zlib.gunzip(result.to_pprof))
+    strings = profile[6]
+    assert_equal "", strings[0]
+
+    sample_types = profile[1].map { decode(_1).values_at(1, 2).map { |idx| strings[idx[0]] } }
+    assert_equal [["samples", "count"], ["wall", "nanoseconds"], ["alloc_objects", "count"]], sample_types
+    assert_equal "wall", strings[profile[14][0]]
+    assert_equal 100_000, profile[12][0]
+
+    samples = profile[2].map { decode(_1) }
+    values = samples.map { packed(_1[2][0]) }
+    total_weight = result.threads.values.sum { _1[:weights].sum }
+    assert_equal total_weight, values.sum { _1[0] }
+    assert_equal total_weight * 100_000, values.sum { _1[1] }
+    assert_operator values.sum { _1[2] || 0 }, :>, 0
+
+    thread_names = samples.map { strings[decode(_1[3][0])[2][0]] }.uniq
+    assert_equal result.threads.values.map { _1[:name] }.sort, thread_names.sort
+
+    functions = profile[5].map { decode(_1) }
+    assert_includes functions.map { strings[_1[2][0]] }, "Kernel#sleep"
+    locations = profile[4].map { decode(_1) }
+    assert_equal result._stack_table.frame_count, locations.size
+
+    # Each sample's locations are leaf first
+    leaf_frames = samples.map { packed(_1[1][0]).first - 1 }
+    assert leaf_frames.all? { _1 >= 0 && _1 < locations.size }
+  end
+
+  def test_retained_profile
+    retained = []
+    result = Vernier.trace_retained do
+      100.times { retained << "x" * 100 }
+    end
+
+    profile = decode(result.to_pprof(gzip: false))
+    strings = profile[6]
+    sample_types = profile[1].map { strings[decode(_1)[1][0]] }
+    assert_equal ["retained_objects", "retained_space"], sample_types
+
+    values = profile[2].map { packed(decode(_1)[2][0]) }
+    assert_equal result.threads.values.sum { _1[:samples].size }, values.sum { _1[0] }
+    assert_equal result.total_bytes, values.sum { _1[1] }
+  end
+
+  def test_write
+    result = Vernier.trace { sleep 0.001 }
+    io = StringIO.new(+"".b)
+    result.write(out: io, format: "pprof")
+    assert_equal "\x1F\x8B".b, io.string.byteslice(0, 2)
+  end
+end
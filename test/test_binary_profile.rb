@@ -0,0 +1,89 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tempfile"
+
+class TestBinaryProfile < Minitest::Test
+  def profile
+    Vernier.trace(interval: 100) do
+      sleep 0.01
+      Thread.new { sleep 0.01 }.join
+      GC.start
+    end
+  end
+
+  def write(result)
+    file = Tempfile.new(["profile", ".vernier.bin"])
+    file.close
+    result.write(out: file.path, format: "vernier-bin")
+    file
+  end
+
+  def test_round_trip
+    result = profile
+    file = write(result)
+
+    profile = Vernier::ParsedProfile.read_file(file.path)
+    assert_kind_of Vernier::BinaryProfile, profile
+    assert_equal result.threads.size, profile.threads.size
+
+    table = result._stack_table.to_h
+    stack_table = profile.stack_table
+    assert_equal table[:stack_table][:parent], stack_table.stack_count.times.map { stack_table.stack_parent_idx(_1) }
+    assert_equal table[:frame_table][:line], stack_table.frame_count.times.map { stack_table.frame_line_no(_1) }
+    assert_equal table[:func_table][:name], stack_table.func_count.times.map { stack_table.func_name(_1) }
+
+    main = profile.main_thread
+    expected = result.main_thread
+    assert_equal expected[:name], main.name
+    assert_equal expected[:samples], main[:samples]
+    assert_equal expected[:weights], main[:weights]
+    assert_equal expected[:timestamps], main[:timestamps]
+    assert_equal expected[:markers].size, main.markers.size
+    assert_includes main.markers.map(&:first), "GC pause"
+
+    # Filenames are filtered as in the Firefox output
+    assert_equal result.main_thread[:samples].map { result.stack(_1).frames.map { |f| [f.label, f.line] } },
+      main[:samples].map { stack_table.stack(_1).frames.map { |f| [f.label, f.line] } }
+    assert_equal Vernier::Output::Top.new(result, 20).output,
+      Vernier::Output::Top.new(profile, 20).output
+  ensure
+    file&.unlink
+  end
+
+  def test_write_to_io
+    result = profile
+    io = StringIO.new(+"".b)
+    result.write(out: io, format: "vernier-bin")
+    assert_equal Vernier::BinaryProfile::MAGIC, io.string.byteslice(0, 8)
+  end
+
+  def test_rejects_other_files
+    file = Tempfile.new("profile")
+    file.write("not a profile")
+    file.close
+
+    assert_raises(ArgumentError) { Vernier::BinaryProfile.read_file(file.path) }
+  ensure
+    file&.unlink
+  end
+
+  def test_mapped_file_bounds
+    file = Tempfile.new("mapped")
+    file.write([1, -2].pack("l<l<"))
+    file.close
+
+    mapped = Vernier::MappedFile.new(file.path)
+    assert_equal 8, mapped.size
+    assert_equal(-2, mapped.int32(4))
+    assert_equal [1, -2], mapped.int32_array(0, 2)
+    assert_raises(IndexError) { mapped.int32(5) }
+    assert_raises(IndexError) { mapped.int32_array(4, 2) }
+    assert_raises(IndexError) { mapped.bytes(-1, 1) }
+
+    mapped.close
+    assert_raises(IOError) { mapped.int32(0) }
+  ensure
+    file&.unlink
+  end
+end
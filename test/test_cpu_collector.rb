@@ -0,0 +1,69 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestCpuCollector < Minitest::Test
+  def setup
+    skip "cpu mode requires per-thread CPU timers" unless RUBY_PLATFORM.include?("linux")
+  end
+
+  def test_busy_method
+    result = Vernier.profile(mode: :cpu, interval: 1000) do
+      spin_for(0.1)
+    end
+
+    assert_valid_result result
+    assert_equal :cpu, result.meta[:mode]
+
+    # About one sample per millisecond of CPU time
+    assert_operator result.total_weights, :>, 50
+
+    names = result.main_thread[:samples].map do |stack_idx|
+      result.stack(stack_idx).frames.map(&:label)
+    end.flatten.uniq
+    assert_includes names, "#{self.class}#spin_for"
+  end
+
+  def test_idle_threads_are_not_sampled
+    result = Vernier.profile(mode: :cpu, interval: 1000) do
+      sleep 0.1
+    end
+
+    assert_valid_result result
+    assert_operator result.total_weights, :<, 10
+  end
+
+  def test_busy_and_sleeping_threads
+    sleeping = nil
+    result = Vernier.profile(mode: :cpu, interval: 1000) do
+      sleeping = Thread.new { sleep 0.1 }
+      spin_for(0.1)
+      sleeping.join
+    end
+
+    assert_valid_result result
+    main_weight = result.main_thread[:weights].sum
+    sleeping_weight = result.threads[sleeping.object_id][:weights].sum
+    assert_operator main_weight, :>, 50
+    assert_operator sleeping_weight, :<, 10
+  end
+
+  def test_many_threads
+    result = Vernier.profile(mode: :cpu, interval: 1000) do
+      10.times.map do
+        Thread.new { spin_for(0.01) }
+      end.each(&:join)
+    end
+
+    assert_valid_result result
+  end
+
+  private
+
+  def spin_for(seconds)
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+    i = 0
+    i += 1 while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    i
+  end
+end
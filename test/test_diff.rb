@@ -0,0 +1,102 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tempfile"
+
+class TestDiff < Minitest::Test
+  def fake_table(names)
+    {
+      stack_table: { parent: [nil, 0, 0], frame: [0, 1, 2] },
+      frame_table: { func: [0, 1, 2], line: [1, 2, 3] },
+      func_table: { name: names, filename: ["a.rb"] * 3, first_line: [1, 2, 3] },
+    }
+  end
+
+  def test_stack_table_series
+    table = Vernier::MergedStackTable.new
+    table.merge(fake_table(["main", "a", "b"]), [[[1, 2], [10, 30]]], 0)
+    # "c" only differs by name, so it's a new stack
+    table.merge(fake_table(["main", "a", "c"]), [[[1, 2, 2], [30, 5, 5]]], 1)
+
+    assert_equal 4, table.stack_count
+    assert_equal [[1, 2], [10, 30]], table.weights(0)
+    assert_equal [[1, 3], [30, 10]], table.weights(1)
+
+    self_weights, total_weights = table.func_weights(1)
+    assert_equal [0, 30, 0, 10], self_weights
+    assert_equal [40, 30, 0, 10], total_weights
+  end
+
+  def test_diff_results
+    base = Vernier.trace(interval: 100) { sleep 0.01 }
+    candidate = Vernier.trace(interval: 100) { sleep 0.01; 50_000.times { Object.new } }
+    diff = Vernier.diff(base, candidate)
+
+    assert_equal base.total_weights, diff.base_total
+    assert_equal candidate.total_weights, diff.candidate_total
+
+    # Deltas are in candidate samples, so they sum to nothing
+    deltas = diff.stack_deltas
+    assert_in_delta 0, deltas.sum { _1[3] }, 0.001
+    assert_equal diff.candidate_total, deltas.sum { _1[2] }
+
+    # Sleeping takes a smaller share of the candidate
+    base_sleep = diff.funcs(Vernier::DiffProfile::BASE)["Kernel#sleep"][:total] / diff.base_total.to_f
+    candidate_sleep = diff.funcs(Vernier::DiffProfile::CANDIDATE)["Kernel#sleep"][:total] / diff.candidate_total.to_f
+    assert_operator candidate_sleep, :<, base_sleep
+
+    markdown = diff.to_markdown
+    assert_includes markdown, "# Vernier Profile Diff"
+    assert_includes markdown, "### By Self Time"
+    assert_includes markdown, "`Integer#times`"
+  end
+
+  def test_diff_against_own_file
+    result = Vernier.trace(interval: 100) do
+      sleep 0.005
+      Thread.new { 10_000.times { Object.new } }.join
+    end
+    file = Tempfile.new(["baseline", ".vernier.bin"])
+    file.close
+    result.write(out: file.path, format: "vernier-bin")
+
+    diff = Vernier.diff(result, file.path)
+    assert_equal diff.base_total, diff.candidate_total
+    refute_empty diff.stack_deltas
+    diff.stack_deltas.each do |stack, base, candidate, delta|
+      assert_equal base, candidate
+      assert_equal 0, delta
+    end
+    assert_empty diff.threads[0][:samples]
+  ensure
+    file&.unlink
+  end
+
+  def test_rejects_different_modes
+    wall = Vernier.trace(interval: 100) { sleep 0.001 }
+    retained = Vernier.trace_retained { 10.times { Object.new } }
+    assert_raises(ArgumentError) { Vernier.diff(wall, retained) }
+
+    # Intervals may differ, as weights are normalized by their totals
+    other_interval = Vernier.trace(interval: 200) { sleep 0.001 }
+    assert_equal :wall, Vernier.diff(wall, other_interval).meta[:mode]
+  end
+
+  def test_write_firefox
+    base = Vernier.trace(interval: 100) { sleep 0.005 }
+    candidate = Vernier.trace(interval: 100) { 20_000.times { Object.new } }
+    file = Tempfile.new(["diff", ".vernier.json"])
+    file.close
+    diff = Vernier.diff(base, candidate)
+    diff.write(out: file.path)
+
+    profile = Vernier::ParsedProfile.read_file(file.path)
+    thread = profile.main_thread
+    assert_equal diff.threads[0][:weights], thread.weights
+    assert thread.weights.any?(&:negative?)
+    stack_table = thread.stack_table
+    assert_equal diff.stack_table.stack_count, stack_table.stack_count
+  ensure
+    file&.unlink
+  end
+end
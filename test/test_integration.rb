@@ -12,6 +12,13 @@ class IntegrationTest < Minitest::Test
     assert_valid_firefox_profile(result.to_json)
   end
 
+  def test_cpu_mode
+    skip "cpu mode requires per-thread CPU timers" unless RUBY_PLATFORM.include?("linux")
+
+    result = run_vernier({mode: "cpu"}, "-e", "100_000.times { }")
+    assert_valid_firefox_profile(result.to_json)
+  end
+
   def test_vernier_run
     result = vernier_run("--", "ruby", "-e", "'sleep 1'")
     assert_valid_firefox_profile(result.to_json)
@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "objspace"
 
 class TestMemoryTracker < Minitest::Test
   # 10MB to 500MB
@@ -22,6 +23,13 @@ class TestMemoryTracker < Minitest::Test
     assert_equal timestamps.size, memory.size
   end
 
+  def test_memsize
+    memory_tracker = Vernier::MemoryTracker.new
+    empty_size = ObjectSpace.memsize_of(memory_tracker)
+    1000.times { memory_tracker.record }
+    assert_operator ObjectSpace.memsize_of(memory_tracker), :>=, empty_size + 1000 * 16
+  end
+
   def test_start_and_stop
     memory_tracker = Vernier::MemoryTracker.new
     memory_tracker.start
@@ -0,0 +1,113 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tempfile"
+
+class TestMerge < Minitest::Test
+  def profile
+    Vernier.trace(interval: 100) do
+      sleep 0.005
+      Thread.new { sleep 0.005 }.join
+    end
+  end
+
+  # Total weight by backtrace, which is what merging preserves. Filenames
+  # are filtered when merged, so frames are compared by label and line.
+  def weights_by_stack(profile, stack_table = profile._stack_table)
+    weights = Hash.new(0)
+    profile.threads.each_value do |thread|
+      thread[:samples].zip(thread[:weights]) do |stack, weight|
+        weights[stack_table.stack(stack).frames.map { [_1.label, _1.line] }] += weight
+      end
+    end
+    weights
+  end
+
+  def test_merge_results
+    a = profile
+    b = profile
+    merged = Vernier.merge(a, b)
+
+    assert_equal 2, merged.profile_count
+    assert_equal a.total_weights + b.total_weights, merged.total_weights
+    expected = weights_by_stack(a).merge(weights_by_stack(b)) { |_, x, y| x + y }
+    assert_equal expected, weights_by_stack(merged)
+    assert_in_delta [a.started_at, b.started_at].min, merged.started_at, 1_000_000
+    assert_equal :wall, merged.meta[:mode]
+  end
+
+  def test_merge_files
+    results = [profile, profile]
+    files = [
+      Tempfile.new(["profile", ".vernier.bin"]),
+      Tempfile.new(["profile", ".vernier.json"]),
+    ]
+    files.each(&:close)
+    results[0].write(out: files[0].path, format: "vernier-bin")
+    results[1].write(out: files[1].path)
+
+    merged = Vernier.merge(*files.map(&:path))
+    assert_equal results.sum(&:total_weights), merged.total_weights
+    # Merging the same stacks again only adds weight
+    stack_count = merged.stack_table.stack_count
+    merged.merge(files[0].path)
+    assert_equal stack_count, merged.stack_table.stack_count
+
+    io = StringIO.new(+"".b)
+    merged.write(out: io)
+    file = Tempfile.new(["merged", ".vernier.bin"])
+    file.binmode
+    file.write(io.string)
+    file.close
+    written = Vernier::ParsedProfile.read_file(file.path)
+    assert_equal merged.total_weights, written.main_thread.weights.sum
+    assert_equal results.sum(&:total_weights) + results[0].total_weights, merged.total_weights
+  ensure
+    files&.each(&:unlink)
+    file&.unlink
+  end
+
+  def test_merge_result_with_its_own_file
+    result = profile
+    file = Tempfile.new(["profile", ".vernier.bin"])
+    file.close
+    result.write(out: file.path, format: "vernier-bin")
+
+    alone = Vernier.merge(result)
+    merged = Vernier.merge(result, file.path)
+    assert_equal alone.stack_table.stack_count, merged.stack_table.stack_count
+    assert_equal alone.stack_table.func_count, merged.stack_table.func_count
+    assert_equal 2 * result.total_weights, merged.total_weights
+  ensure
+    file&.unlink
+  end
+
+  def test_rejects_different_modes
+    wall = profile
+    retained = Vernier.trace_retained { 10.times { Object.new } }
+    merged = Vernier.merge(wall)
+    assert_raises(ArgumentError) { merged.merge(retained) }
+    # Nothing was merged from the rejected profile
+    assert_equal wall.total_weights, merged.total_weights
+
+    other_interval = Vernier.trace(interval: 200) { sleep 0.001 }
+    assert_raises(ArgumentError) { merged.merge(other_interval) }
+  end
+
+  def test_folded
+    a = profile
+    merged = Vernier.merge(a, a)
+    totals = merged.to_folded.lines.sum { _1.split(" ").last.to_i }
+    assert_equal 2 * a.total_weights, totals
+  end
+
+  def test_rejects_unordered_table
+    table = Vernier::MergedStackTable.new
+    hash = {
+      stack_table: { parent: [1, nil], frame: [0, 0] },
+      frame_table: { func: [0], line: [1] },
+      func_table: { name: ["a"], filename: ["a.rb"], first_line: [1] },
+    }
+    assert_raises(ArgumentError) { table.merge(hash, []) }
+  end
+end
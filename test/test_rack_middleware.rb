@@ -21,7 +21,7 @@ class TestOutputFirefox < Minitest::Test
     assert_equal "application/octet-stream", headers["content-type"]
     assert_match(/\Aattachment; filename="/, headers["content-disposition"])
 
-    profile_gzip = body.to_enum.to_a[0]
+    profile_gzip = body.to_enum.to_a.join
     profile_json = Zlib.gunzip(profile_gzip)
     assert_valid_firefox_profile(profile_json)
   end
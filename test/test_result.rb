@@ -49,6 +49,27 @@ class TestResult < Minitest::Test
     assert_valid_cpuprofile(content)
   end
 
+  def test_write_streams_in_chunks
+    result = Vernier.trace(interval: 50, allocation_interval: 1) do
+      10_000.times.map(&:to_s)
+    end
+
+    writes = []
+    io = Object.new
+    io.define_singleton_method(:write) { |chunk| writes << chunk; chunk.bytesize }
+    result.write(out: io, format: "firefox")
+
+    assert_operator writes.size, :>, 1
+    assert_operator writes.map(&:bytesize).max, :<, 128 * 1024
+    assert_valid_firefox_profile(writes.join)
+  end
+
+  def test_gzip_output_matches_json
+    json = @result.to_firefox
+    gzipped = @result.to_firefox(gzip: true)
+    assert_equal JSON.parse(json).except("meta"), JSON.parse(Zlib.gunzip(gzipped)).except("meta")
+  end
+
   def test_write_to_file_with_gz_extension
     Tempfile.open(["vernier_test", ".gz"]) do |tempfile|
       @result.write(out: tempfile.path, format: "firefox")
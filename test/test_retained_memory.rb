@@ -4,6 +4,18 @@ require "test_helper"
 require "objspace"
 
 class TestRetainedMemory < Minitest::Test
+  def test_memory_usage
+    collector = Vernier::Collector.new(:retained)
+    collector.start
+    retained = 100.times.map { Object.new }
+    usage = collector.memory_usage
+    collector.stop
+
+    assert_operator usage[:stack_table], :>, 0
+    assert_operator usage[:heap_tracker], :>, 0
+    assert_equal usage[:stack_table] + usage[:heap_tracker], usage[:total]
+  end
+
   def test_tracing_retained_objects
     retained = []
 
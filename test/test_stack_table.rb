@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "objspace"
 
 class TestStackTable < Minitest::Test
   def test_new
@@ -19,6 +20,36 @@ class TestStackTable < Minitest::Test
     assert_empty hash[:func_table][:first_line]
   end
 
+  def test_to_h_matches_accessors
+    stack_table = Vernier::StackTable.new
+    100.times do |i|
+      eval("stack_table.current_stack", binding, "(eval)", i % 10)
+    end
+    stack_table.current_stack
+
+    generic_to_h = Vernier::StackTableHelpers.instance_method(:to_h).bind_call(stack_table)
+    assert_equal generic_to_h, stack_table.to_h
+    assert_nil stack_table.to_h[:stack_table][:parent][0]
+  end
+
+  def test_func_string_table
+    stack_table = Vernier::StackTable.new
+    stack_table.current_stack
+    stack_table.current_stack
+
+    string_table = stack_table.func_string_table
+    strings = string_table[:strings]
+    assert_equal strings.uniq, strings
+    assert_equal stack_table.func_count, string_table[:name].size
+
+    to_h = stack_table.to_h
+    assert_equal to_h[:func_table][:name], string_table[:name].map { strings[_1] }
+    assert_equal to_h[:func_table][:filename], string_table[:filename].map { strings[_1] }
+
+    # Ruby strings are only created once per table
+    assert_same stack_table.func_filename(0), stack_table.func_filename(0)
+  end
+
   def test_current_sample
     stack_table = Vernier::StackTable.new
     stack1 = stack_table.current_stack; stack2 = stack_table.current_stack
@@ -144,6 +175,46 @@ class TestStackTable < Minitest::Test
     assert_equal expected, actual
   end
 
+  def test_convert_many
+    original = Vernier::StackTable.new
+    samples = []
+    1000.times do |i|
+      samples << eval("original.current_stack", binding, "(eval)", i % 100)
+    end
+    samples << original.current_stack
+
+    reduced = Vernier::StackTable.new
+    reduced.convert(original, samples[20])
+    new_samples = reduced.convert_many(original, samples)
+
+    assert_equal samples.size, new_samples.size
+    assert_equal samples.map { reduced.convert(original, _1) }, new_samples
+    samples.zip(new_samples) do |sample, new_sample|
+      assert_equal original.backtrace(sample), reduced.backtrace(new_sample)
+    end
+    assert_equal [], reduced.convert_many(original, [])
+
+    assert_raises(RangeError) { reduced.convert_many(original, [original.stack_count]) }
+    assert_raises(RangeError) { reduced.convert_many(original, [-1]) }
+
+    packed = reduced.convert_many(original, samples.pack("l<*"))
+    assert_equal new_samples, packed.unpack("l<*")
+    assert_raises(RangeError) { reduced.convert_many(original, [-1].pack("l<*")) }
+  end
+
+  def test_packed_tables
+    stack_table = Vernier::StackTable.new
+    stack_table.current_stack
+    table = stack_table.to_h
+    packed = stack_table.packed_tables
+
+    assert_equal table[:stack_table][:parent].map { _1 || -1 }, packed[:stack_parent].unpack("l<*")
+    assert_equal table[:stack_table][:frame], packed[:stack_frame].unpack("l<*")
+    assert_equal table[:frame_table][:func], packed[:frame_func].unpack("l<*")
+    assert_equal table[:frame_table][:line], packed[:frame_line].unpack("l<*")
+    assert_equal table[:func_table][:first_line], packed[:func_first_line].unpack("l<*")
+  end
+
   def test_replacing_with_a_refinement
     klass = Class.new do
       def foo
@@ -180,6 +251,58 @@ class TestStackTable < Minitest::Test
     end
   end
 
+  def test_hash_stats
+    stack_table = Vernier::StackTable.new
+
+    # Same iseq, different lines: these keys only differ in their low bits
+    5000.times do |i|
+      eval("stack_table.current_stack", binding, "(eval)", i)
+    end
+    stack_table.finalize
+
+    stats = stack_table.hash_stats
+
+    edges = stats[:stack_edges]
+    assert_operator edges[:size], :>=, 5000
+    assert_operator edges[:load_factor], :<, 0.7
+    assert_operator edges[:mean_probes], :<, 2.5
+    assert_operator edges[:max_probes], :<, 64
+
+    frames = stats[:frames]
+    assert_equal stack_table.frame_count, frames[:size]
+    # A well distributed hash fills about 1 - 1/e of the buckets at this load
+    assert_operator frames[:used_buckets], :>, frames[:size] / 2
+    assert_operator frames[:max_bucket_size], :<, 16
+
+    assert_equal stack_table.func_count, stats[:funcs][:size]
+  end
+
+  def test_compaction
+    skip "compaction not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    stack_table = Vernier::StackTable.new
+    indexes = 2.times.map do |i|
+      GC.verify_compaction_references(expand_heap: true, toward: :empty) if i == 1
+      stack_table.current_stack
+    end
+
+    # Frames moved by compaction must still be found in the table
+    assert_equal indexes[0], indexes[1]
+    assert_equal "#{self.class}##{__method__}", stack_table.backtrace(indexes[1]).grep(/#{__method__}/).first[/'(.*)'/, 1]
+  end
+
+  def test_memsize
+    stack_table = Vernier::StackTable.new
+    empty_size = ObjectSpace.memsize_of(stack_table)
+
+    1000.times do |i|
+      eval("stack_table.current_stack", binding, "(eval)", i)
+    end
+    stack_table.finalize
+
+    assert_operator ObjectSpace.memsize_of(stack_table), :>, empty_size + stack_table.stack_count * 16
+  end
+
   def test_backtrace
     stack_table = Vernier::StackTable.new
     expected = caller_locations(0); index = stack_table.current_stack
@@ -0,0 +1,81 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestSymbolCache < Minitest::Test
+  def teardown
+    Vernier::SymbolCache.disable
+  end
+
+  def test_disabled_by_default
+    refute Vernier::SymbolCache.enabled?
+    assert_nil Vernier::SymbolCache.stats
+  end
+
+  def test_reused_across_stack_tables
+    Vernier::SymbolCache.enable
+
+    tables = 2.times.map do
+      stack_table = Vernier::StackTable.new
+      stack_table.current_stack
+      stack_table.finalize
+      stack_table
+    end
+
+    stats = Vernier::SymbolCache.stats
+    assert_equal tables[0].func_count, stats[:misses]
+    assert_equal tables[1].func_count, stats[:hits]
+    assert_operator stats[:memsize], :>, 0
+
+    assert_equal tables[0].to_h[:func_table], tables[1].to_h[:func_table]
+    assert_includes tables[1].to_h[:func_table][:name], "#{self.class}##{__method__}"
+  end
+
+  def test_invalid_capacity
+    assert_raises(ArgumentError) { Vernier::SymbolCache.enable(-1) }
+    assert_raises(ArgumentError) { Vernier::SymbolCache.enable(2**40) }
+    assert_raises(RangeError) { Vernier::SymbolCache.enable(2**64) }
+    refute Vernier::SymbolCache.enabled?
+
+    Vernier::SymbolCache.enable(2**20)
+    assert_equal 2**20, Vernier::SymbolCache.stats[:capacity]
+  end
+
+  def test_evicts_over_capacity
+    Vernier::SymbolCache.enable(10)
+
+    mod = Module.new
+    stack_table = Vernier::StackTable.new
+    20.times do |i|
+      mod.module_eval "def self.m#{i}(stack_table) = stack_table.current_stack"
+      mod.send(:"m#{i}", stack_table)
+    end
+    stack_table.finalize
+
+    stats = Vernier::SymbolCache.stats
+    assert_equal 10, stats[:size]
+    assert_equal 10, stats[:capacity]
+    assert_equal stack_table.func_count - 10, stats[:evictions]
+    assert_equal 1, stack_table.to_h[:func_table][:name].grep(/\.m19\z/).size
+  end
+
+  def test_compaction
+    skip "compaction not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    Vernier::SymbolCache.enable
+
+    stack_table = Vernier::StackTable.new
+    stack_table.current_stack
+    stack_table.finalize
+    misses = Vernier::SymbolCache.stats[:misses]
+
+    GC.verify_compaction_references(expand_heap: true, toward: :empty)
+
+    # Frames moved by compaction must still be found in the cache
+    stack_table = Vernier::StackTable.new
+    stack_table.current_stack
+    stack_table.finalize
+    assert_equal misses, Vernier::SymbolCache.stats[:misses]
+    assert_equal stack_table.func_count, Vernier::SymbolCache.stats[:hits]
+  end
+end
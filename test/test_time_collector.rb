@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "objspace"
 
 class TestTimeCollector < Minitest::Test
   def test_receives_gc_events
@@ -16,6 +17,35 @@ class TestTimeCollector < Minitest::Test
       result.main_thread[:markers].map { |x| x[1] }.grep(/^GC/).uniq.sort
   end
 
+  def test_threads_unpacked_when_read
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    GC.start
+    Fiber.new { sleep 0.01 }.resume
+    result = collector.stop
+
+    packed = result.instance_variable_get(:@threads).values.map { _1[:packed] }
+    packed.each do |thread|
+      assert_kind_of String, thread[:samples]
+      assert_kind_of String, thread[:markers]
+    end
+
+    assert_valid_result result
+    main = result.main_thread
+    assert_kind_of Array, main[:samples]
+    assert_equal main[:samples].size, main[:timestamps].size
+    assert_equal main[:timestamps].sort, main[:timestamps]
+    assert_operator main[:weights].sum, :>, 0
+    assert_nil main[:packed]
+
+    names = main[:markers].map { _1[1] }
+    assert_includes names, "GC pause"
+    assert_includes names, "Fiber Running"
+    gc_pause = main[:markers].detect { _1[1] == "GC pause" }
+    assert_operator gc_pause[3], :>=, gc_pause[2]
+    assert_includes gc_pause[5].keys, :gc_by
+  end
+
   def test_time_collector
     collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
     collector.start
@@ -98,6 +128,388 @@ class TestTimeCollector < Minitest::Test
     # TODO: some assertions on behaviour
   end
 
+  def test_concurrently_running_ractors
+    # Ractors leave the VM in multi-ractor mode for the rest of the process,
+    # which changes GC and allocation behaviour for other tests, so run this
+    # one in a child process.
+    script = <<~RUBY
+      require "vernier"
+      Warning[:experimental] = false
+
+      def tarai(x, y, z) =
+        x <= y ? y : tarai(tarai(x-1, y, z),
+                           tarai(y-1, z, x),
+                           tarai(z-1, x, y))
+
+      result = Vernier.trace(interval: 1000) do
+        4.times.map do
+          Ractor.new { tarai(12, 6, 0) }
+        end.each { |ractor| ractor.respond_to?(:value) ? ractor.value : ractor.take }
+      end
+
+      result.threads.each_value do |thread|
+        next if thread[:is_main]
+        running = thread[:weights].zip(thread[:sample_categories]).sum { |weight, category| category == 0 ? weight : 0 }
+        puts running
+      end
+    RUBY
+
+    output = IO.popen([RbConfig.ruby, "-I", File.expand_path("../lib", __dir__), "-e", script], &:read)
+    assert_predicate $?, :success?
+
+    # Each Ractor holds its own GVL, so all of them should be sampled while
+    # running rather than only one at a time.
+    running_samples = output.lines.map(&:to_i)
+    assert_equal 4, running_samples.size
+    running_samples.each do |count|
+      assert_operator count, :>, 0
+    end
+  end
+
+  def recurse_then_spin(depth, &block)
+    if depth > 0
+      recurse_then_spin(depth - 1, &block)
+    else
+      yield
+    end
+  end
+
+  def test_deep_stacks
+    # Deep stacks fill each thread's sample buffer quickly, so this exercises
+    # wrapping around and draining it many times.
+    result = Vernier.trace(interval: 100) do
+      recurse_then_spin(1500) do
+        deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.2
+        count_up_to(1_000) while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      end
+    end
+
+    assert_valid_result result
+    assert_operator result.main_thread[:weights].sum, :>, 100
+
+    stack_table = result.stack_table
+    deepest = result.main_thread[:samples].map { stack_table.full_stack(_1).size }.max
+    assert_operator deepest, :>, 1500
+  end
+
+  def test_gc_compact
+    skip "compaction not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    result = Vernier.trace(interval: 100) do
+      2.times do
+        count_up_to(2_000_000)
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      end
+    end
+
+    assert_valid_result result
+    stack_table = result.stack_table
+    stacks = result.main_thread[:samples].map { stack_table.backtrace(_1).join("\n") }
+    assert stacks.any? { _1.include?("count_up_to") }
+  end
+
+  def test_memory_usage
+    collector = Vernier::Collector.new(:wall, interval: 100, allocation_interval: 1)
+    collector.start
+    count_up_to(1_000_000)
+    1000.times { Object.new }
+    assert_operator collector.memory_usage[:total], :>, 0
+    collector.stop
+    usage = collector.memory_usage
+
+    assert_operator usage[:stack_table], :>, 0
+    assert_operator usage[:samples], :>, 0
+    assert_operator usage[:allocation_samples], :>, 0
+    assert_operator usage[:markers], :>, 0
+    assert_operator usage[:sample_buffers], :>, 0
+    assert_equal usage[:total], usage.except(:total).values.sum
+
+    assert_operator ObjectSpace.memsize_of(collector), :>, usage[:samples]
+  end
+
+  def test_symbolicates_while_running
+    mod = Module.new
+    500.times { |i| mod.module_eval "def self.m#{i} = #{i}" }
+
+    # The cache counts each function symbolicated as a miss
+    Vernier::SymbolCache.enable(10_000)
+
+    collector = Vernier::Collector.new(:wall, interval: 10)
+    collector.start
+    10.times { 500.times { |i| mod.send(:"m#{i}") } }
+
+    # Samples are only translated, and the job triggered, once a thread's
+    # buffer is half full. Sleeping records an idle sample every interval.
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 5
+    until Vernier::SymbolCache.stats[:misses] > 0 || Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+      sleep 0.01
+    end
+    symbolicated = Vernier::SymbolCache.stats[:misses]
+    result = collector.stop
+
+    assert_operator symbolicated, :>, 0
+
+    func_table = result.stack_table.to_h[:func_table]
+    assert_equal func_table[:name].size, result.stack_table.func_count
+    assert func_table[:name].all?(String)
+    assert func_table[:filename].all?(String)
+  ensure
+    Vernier::SymbolCache.disable
+  end
+
+  def test_reused_stack_table
+    stack_table = Vernier::StackTable.new
+
+    results = 2.times.map do
+      Vernier.profile(interval: 100, stack_table:) do
+        count_up_to(1_000_000)
+      end
+    end
+
+    results.each do |result|
+      assert_same stack_table, result.stack_table
+      assert_valid_result result
+    end
+
+    # Both sessions sample the same stacks, which share indexes
+    samples = results.map { _1.main_thread[:samples].uniq }
+    refute_empty samples[0] & samples[1]
+  end
+
+  def test_shared_stack_table
+    result = Vernier.profile(stack_table: :shared) { sleep 0.01 }
+    assert_same Vernier::StackTable.shared, result.stack_table
+    assert_valid_result result
+  end
+
+  def test_invalid_stack_table
+    assert_raises(TypeError) do
+      Vernier::Collector.new(:wall, stack_table: Object.new)
+    end
+  end
+
+  def test_compact_stack_table
+    mod = Module.new
+    200.times { |i| mod.module_eval "def self.m#{i}(n) = n.times { }" }
+
+    collector = Vernier::Collector.new(:wall, interval: 10, allocation_interval: 1)
+    collector.start
+    200.times { |i| mod.send(:"m#{i}", 10_000) }
+
+    # Everything is still referenced
+    collector.compact_stack_table
+    stack_count = collector.stack_table.stack_count
+    assert_equal 0, collector.compact_stack_table
+    assert_operator collector.stack_table.stack_count, :>=, stack_count
+
+    removed = collector.compact_stack_table(collector.current_time)
+    assert_operator removed, :>, 0
+    assert_operator collector.stack_table.stack_count, :<, stack_count
+
+    count_up_to(1_000_000)
+    Object.new
+    result = collector.stop
+
+    assert_valid_result result
+    names = result.each_sample.flat_map { |stack, _| stack.frames.map(&:label) }
+    assert names.any?(/count_up_to/)
+    refute names.any?(/\.m\d+\z/)
+    result.threads.each_value do |thread|
+      (thread[:samples] + thread[:allocations][:samples]).each do |idx|
+        assert_operator idx, :<, result.stack_table.stack_count
+      end
+    end
+  end
+
+  def test_compact_stack_table_requires_own_table
+    collector = Vernier::Collector.new(:wall)
+    assert_raises(RuntimeError) { collector.compact_stack_table }
+
+    collector = Vernier::Collector.new(:wall, stack_table: Vernier::StackTable.new)
+    collector.start
+    assert_raises(RuntimeError) { collector.compact_stack_table }
+    collector.stop
+  end
+
+  def test_sample_storage_is_compact
+    collector = Vernier::Collector.new(:wall, interval: 50)
+    collector.start
+    # Alternate between stacks, so that samples aren't merged
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.2
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    usage = collector.memory_usage
+    result = collector.stop
+
+    assert_valid_result result
+    samples = result.threads.values.sum { _1[:samples].size }
+    assert_operator samples, :>, 100
+
+    # Allow for one partly filled chunk per thread
+    assert_operator usage[:samples], :<, samples * 10 + result.threads.size * 4096
+  end
+
+  def test_stream
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+    collector.start
+    sleep 0.01
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.5
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    usage = collector.memory_usage
+    assert_raises(RuntimeError) { collector.compact_stack_table }
+    result = collector.stop
+
+    assert_valid_result result
+    samples = result.threads.values.sum { _1[:samples].size }
+    assert_operator samples, :>, 1000
+
+    # Only what arrived since the last flush is held in memory, at most a
+    # chunk per thread
+    assert_operator usage[:samples], :<=, result.threads.size * 4200
+    assert_operator File.size(stream_file), :>, samples
+
+    main = result.threads.values.find { _1[:is_main] }
+    assert_equal main[:timestamps], main[:timestamps].sort
+    assert_includes main[:markers].map { _1[1] }, "Thread Running"
+  end
+
+  def test_stream_interleaves_markers
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+    collector.start
+    Fiber.new { sleep 0.01 }.resume
+    sleep 0.1
+    result = collector.stop
+
+    # Fiber switches stay in memory while the thread's other markers are
+    # streamed, but they're placed among them by time
+    markers = result.threads.values.find { _1[:is_main] }[:markers]
+    first_switch = markers.index { _1[1] == "Fiber Switch" }
+    assert first_switch
+    later = markers[first_switch..].reject { _1[1].start_with?("Fiber") }
+    refute_empty later
+    assert later.any? { _1[2] > markers[first_switch][2] }
+  end
+
+  def test_stream_is_read_when_used
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+    collector.start
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.3
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    result = collector.stop
+
+    # Stopping doesn't read back what was streamed
+    in_memory = result.instance_variable_get(:@threads).values.sum { _1[:packed][:samples].bytesize / 4 }
+    samples = result.threads.values.sum { _1[:samples].size }
+    assert_operator samples, :>, in_memory + 100
+
+    assert_valid_result result
+  end
+
+  def test_stream_allocations
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, allocation_interval: 10, stream: stream_file)
+    collector.start
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.6
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    usage = collector.memory_usage
+    result = collector.stop
+
+    allocations = result.main_thread[:allocations]
+    assert_operator allocations[:samples].size, :>, 1000
+    assert_equal allocations[:samples].size, allocations[:timestamps].size
+    assert_equal allocations[:timestamps], allocations[:timestamps].sort
+    assert_operator usage[:allocation_samples], :<, allocations[:samples].size * 16 / 2
+  end
+
+  def test_read_stream
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+    collector.start
+    Thread.new { sleep 0.05 }.join
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.3
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+
+    # Everything up to the last flush can be read while profiling
+    running = Vernier::ParsedProfile.read_file(stream_file)
+    assert_kind_of Vernier::StreamedProfile, running
+    refute running.complete?
+    refute_empty running.main_thread.samples
+    assert_operator running.stack_table.stack_count, :>, 0
+    assert_equal :wall, running.meta[:mode]
+
+    result = collector.stop
+    profile = Vernier::ParsedProfile.read_file(stream_file)
+    assert profile.complete?
+    assert_equal result.threads.size, profile.threads.size
+
+    main = profile.main_thread
+    expected = result.main_thread
+    assert_equal expected[:samples].size, main.samples.size
+    assert_equal expected[:weights], main.weights
+    assert_equal expected[:timestamps], main.timestamps
+    assert_includes main.markers.map(&:first), "Thread Running"
+    assert_equal expected[:samples].map { result.stack(_1).frames.map { |f| [f.label, f.line] } },
+      main.samples.map { profile.stack_table.stack(_1).frames.map { |f| [f.label, f.line] } }
+    assert_equal Vernier::Output::Top.new(result, 20).output,
+      Vernier::Output::Top.new(profile, 20).output
+
+    merged = Vernier.merge(stream_file)
+    assert_equal result.threads.values.sum { _1[:weights].sum }, merged.total_weights
+  end
+
+  def test_read_stream_of_process_which_died
+    skip "fork not available" unless Process.respond_to?(:fork)
+
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    pid = fork do
+      collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+      collector.start
+      finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.3
+      i = 0
+      i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+      exit!
+    end
+    Process.wait(pid)
+
+    profile = Vernier::StreamedProfile.read_file(stream_file)
+    refute profile.complete?
+    assert_operator profile.main_thread.samples.size, :>, 100
+    names = profile.main_thread.samples.flat_map { profile.stack_table.stack(_1).frames.map(&:label) }
+    assert_includes names, "Integer#to_s"
+  end
+
+  def test_read_truncated_stream
+    stream_file = File.join(__dir__, "../tmp/stream.vernier")
+    collector = Vernier::Collector.new(:wall, interval: 50, stream: stream_file)
+    collector.start
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.3
+    i = 0
+    i.to_s if (i += 1).odd? while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    collector.stop
+
+    full = Vernier::StreamedProfile.read_file(stream_file).main_thread.samples.size
+    File.truncate(stream_file, File.size(stream_file) * 2 / 3)
+    profile = Vernier::StreamedProfile.read_file(stream_file)
+    refute profile.complete?
+    samples = profile.main_thread.samples
+    assert_operator samples.size, :>, 0
+    assert_operator samples.size, :<, full
+    assert Vernier::Output::Top.new(profile, 20).output
+  end
+
+  def test_stream_to_invalid_path
+    assert_raises(Errno::ENOENT) do
+      Vernier::Collector.new(:wall, stream: File.join(__dir__, "../tmp/missing/stream.vernier"))
+    end
+  end
+
   def test_many_threads
     50.times do
       collector = Vernier::Collector.new(:wall)